@@ -45,6 +45,19 @@ void Vehicle::updateBeachDetection(){
     futureLocation = location;
     beachSlope = ofVec2f(0);
     beach = false;
+
+    // No need to look ahead step by step if the pyramid shows the whole path on the same side of the sea level
+    FrameRef<DepthPyramid> pyramid = kinectProjector->getDepthPyramid();
+    if (pyramid.isValid())
+    {
+        ofRectangle path(location, location + velocity*8);
+        path.width += 1; // Pixels of the last steps
+        path.height += 1;
+        DepthRange range = pyramid->getRange(path);
+        if (range.isComplete() && ((liveInWater && range.maxElevation <= 0) || (!liveInWater && range.minElevation > 0)))
+            return;
+    }
+
     int i = 1;
     while (i < 10 && !beach)
     {
@@ -0,0 +1,102 @@
+/***********************************************************************
+ChessboardDetector - Search of the calibration chessboard in the kinect
+images on a worker thread.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "ChessboardDetector.h"
+
+// Smallest ROI searched at half resolution
+static const int minCoarseSize = 64;
+
+ChessboardDetector::ChessboardDetector()
+{
+}
+
+bool ChessboardDetector::start(const ChessboardRequest& request){
+	// The result of an abandoned search is dropped
+	if (isBusy())
+		return false;
+	ChessboardRequest copy;
+	copy.image = request.image.clone();
+	copy.ROI = request.ROI & cv::Rect(0, 0, request.image.cols, request.image.rows);
+	copy.patternSize = request.patternSize;
+	pending = std::async(std::launch::async, &ChessboardDetector::detect, std::move(copy));
+	return true;
+}
+
+bool ChessboardDetector::isBusy() const {
+	return pending.valid() && pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+bool ChessboardDetector::getResult(ChessboardResult& result){
+	if (!pending.valid() || pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		return false;
+	result = pending.get();
+	ofLogVerbose("ChessboardDetector") << "getResult(): chessboard " << (result.found ? (result.coarse ? "found at half resolution" : "found") : "not found") << " in " << result.duration << " ms";
+	return true;
+}
+
+ChessboardResult ChessboardDetector::detect(ChessboardRequest request){
+	uint64_t start = ofGetElapsedTimeMicros();
+	ChessboardResult result;
+	result.found = false;
+	result.coarse = false;
+	if (request.ROI.area() == 0)
+	{
+		result.duration = 0;
+		return result;
+	}
+	cv::Mat roiImage = request.image(request.ROI);
+
+	// The corners of the half resolution image are at half the full resolution coordinates
+	if (roiImage.cols >= minCoarseSize && roiImage.rows >= minCoarseSize)
+	{
+		cv::Mat coarseImage;
+		cv::pyrDown(roiImage, coarseImage);
+		if (findCorners(coarseImage, request.patternSize, result.corners))
+		{
+			for (auto & corner : result.corners)
+				corner *= 2.0f;
+			result.found = true;
+			result.coarse = true;
+		}
+	}
+	if (!result.found)
+		result.found = findCorners(roiImage, request.patternSize, result.corners);
+
+	if (result.found)
+	{
+		for (auto & corner : result.corners)
+		{
+			corner.x += request.ROI.x;
+			corner.y += request.ROI.y;
+		}
+		cornerSubPix(request.image, result.corners, cv::Size(2, 2), cv::Size(-1, -1),   // Rasmus: changed search size to 2 from 11 - since this caused false findings
+			cv::TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 30, 0.1));
+	}
+	result.duration = (ofGetElapsedTimeMicros() - start) / 1000.0f;
+	return result;
+}
+
+bool ChessboardDetector::findCorners(const cv::Mat& image, cv::Size patternSize, std::vector<cv::Point2f>& corners){
+	if (findChessboardCorners(image, patternSize, corners, 0))
+		return true;
+	return findChessboardCorners(image, patternSize, corners, cv::CALIB_CB_ADAPTIVE_THRESH + cv::CALIB_CB_FAST_CHECK);
+}
@@ -0,0 +1,64 @@
+/***********************************************************************
+ChessboardDetector - Search of the calibration chessboard in the kinect
+images on a worker thread.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <future>
+#include <vector>
+
+#include "ofMain.h"
+#include "ofxCv.h"
+
+// Gray image to search - the detector keeps its own copy
+struct ChessboardRequest {
+	cv::Mat image;
+	cv::Rect ROI; // Only the chessboards inside the ROI are found
+	cv::Size patternSize; // Inner corners
+};
+
+struct ChessboardResult {
+	bool found;
+	bool coarse; // Found on the half resolution image
+	std::vector<cv::Point2f> corners; // Refined in full resolution image coordinates
+	float duration; // Milliseconds spent on the search
+};
+
+//! Chessboard search off the main thread
+/** start() hands a copy of the image to a worker and returns immediately, the main
+    thread polls getResult() from its update loop. The board is first searched in the
+    image at half resolution, which is about four times faster, and the corners found
+    are refined in the full resolution image. Small boards that do not survive the
+    downscaling are searched again at full resolution. Each resolution is tried with
+    the default flags and then with adaptive thresholding. One search runs at a time.*/
+class ChessboardDetector {
+public:
+	ChessboardDetector();
+
+	bool start(const ChessboardRequest& request); // False if a search is running
+	bool isBusy() const; // A search is running
+	bool getResult(ChessboardResult& result); // True once when the search is done
+
+private:
+	static ChessboardResult detect(ChessboardRequest request);
+	static bool findCorners(const cv::Mat& image, cv::Size patternSize, std::vector<cv::Point2f>& corners);
+
+	std::future<ChessboardResult> pending;
+};
@@ -0,0 +1,252 @@
+/***********************************************************************
+DepthInpainter - Fill the pixels without a valid depth with the average
+of their valid neighbours or a push-pull interpolation for large holes.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "DepthInpainter.h"
+#include "ofMain.h"
+
+// Rows of the frame in a band processed by a worker
+static const int inpaintBandRows = 16;
+
+DepthInpainter::DepthInpainter()
+:radius(5),
+invalidValue(0),
+ROIwidth(0),
+ROIheight(0),
+numLocalFills(0),
+numPyramidFills(0)
+{
+}
+
+void DepthInpainter::inpaint(float* data, int width, int height, int minX, int maxX, int minY, int maxY, int margin, float sinvalidValue, WorkerPool& workers){
+	invalidValue = sinvalidValue;
+	ROIwidth = maxX - minX;
+	ROIheight = maxY - minY;
+	numLocalFills = 0;
+	numPyramidFills = 0;
+	if (ROIwidth <= 0 || ROIheight <= 0)
+		return;
+
+	buildIntegralImages(data, width, minX, minY);
+
+	int fillMinX = max(0, minX - margin);
+	int fillMaxX = min(width, maxX + margin);
+	int fillMinY = max(0, minY - margin);
+	int fillMaxY = min(height, maxY + margin);
+	int tableWidth = ROIwidth + 1;
+
+	// Number of valid pixels and their sum in the window of (x, y) clipped to the ROI
+	auto windowStats = [&](int x, int y, int& count, double& sum) {
+		int x0 = max(minX, x - radius) - minX;
+		int x1 = min(maxX, x + radius + 1) - minX;
+		int y0 = max(minY, y - radius) - minY;
+		int y1 = min(maxY, y + radius + 1) - minY;
+		if (x0 >= x1 || y0 >= y1)
+		{
+			count = 0;
+			sum = 0;
+			return;
+		}
+		count = countTable[y1*tableWidth + x1] - countTable[y0*tableWidth + x1] - countTable[y1*tableWidth + x0] + countTable[y0*tableWidth + x0];
+		sum = sumTable[y1*tableWidth + x1] - sumTable[y0*tableWidth + x1] - sumTable[y1*tableWidth + x0] + sumTable[y0*tableWidth + x0];
+	};
+
+	// Fill from the windows and count the pixels left for the pyramid
+	// The integral images are built beforehand so the bands only read them
+	int numBands = WorkerPool::getNumBands(fillMinY, fillMaxY, inpaintBandRows);
+	std::vector<int> bandLocalFills(numBands, 0);
+	std::vector<int> bandHoles(numBands, 0);
+	workers.parallelFor(fillMinY, fillMaxY, inpaintBandRows, [&](int y0, int y1, int band) {
+		for (int y = y0; y < y1; y++)
+		{
+			float* rowPtr = data + y*width;
+			for (int x = fillMinX; x < fillMaxX; x++)
+			{
+				if (isValid(rowPtr[x]))
+					continue;
+				int count;
+				double sum;
+				windowStats(x, y, count, sum);
+				if (count > 0)
+				{
+					rowPtr[x] = sum / count;
+					bandLocalFills[band]++;
+				}
+				else
+					bandHoles[band]++;
+			}
+		}
+	});
+	int numHoles = 0;
+	for (int band = 0; band < numBands; band++)
+	{
+		numLocalFills += bandLocalFills[band];
+		numHoles += bandHoles[band];
+	}
+	if (numHoles == 0)
+		return;
+
+	// Large holes: interpolate from the push-pull pyramid of the valid pixels
+	buildPyramid(data, width, minX, minY);
+	bool noValidPixel = pyramid.back().weight[0] == 0;
+	std::vector<int> bandPyramidFills(numBands, 0);
+	workers.parallelFor(fillMinY, fillMaxY, inpaintBandRows, [&](int y0, int y1, int band) {
+		const PyramidLevel& base = pyramid[0];
+		for (int y = y0; y < y1; y++)
+		{
+			float* rowPtr = data + y*width;
+			int by = ofClamp(y - minY, 0, ROIheight - 1); // Pixels of the margin use the closest ROI pixel
+			for (int x = fillMinX; x < fillMaxX; x++)
+			{
+				if (isValid(rowPtr[x]))
+					continue;
+				int count;
+				double sum;
+				windowStats(x, y, count, sum);
+				if (count > 0)
+					continue; // Filled from its window
+				int bx = ofClamp(x - minX, 0, ROIwidth - 1);
+				rowPtr[x] = noValidPixel ? invalidValue : base.value[by*base.width + bx];
+				bandPyramidFills[band]++;
+			}
+		}
+	});
+	for (int band = 0; band < numBands; band++)
+		numPyramidFills += bandPyramidFills[band];
+}
+
+void DepthInpainter::buildIntegralImages(const float* data, int width, int minX, int minY){
+	int tableWidth = ROIwidth + 1;
+	countTable.assign(tableWidth*(ROIheight + 1), 0);
+	sumTable.assign(tableWidth*(ROIheight + 1), 0);
+	for (int y = 0; y < ROIheight; y++)
+	{
+		const float* rowPtr = data + (y + minY)*width + minX;
+		const int* countAbove = &countTable[y*tableWidth];
+		const double* sumAbove = &sumTable[y*tableWidth];
+		int* countPtr = &countTable[(y + 1)*tableWidth];
+		double* sumPtr = &sumTable[(y + 1)*tableWidth];
+		int rowCount = 0;
+		double rowSum = 0;
+		for (int x = 0; x < ROIwidth; x++)
+		{
+			if (isValid(rowPtr[x]))
+			{
+				rowCount++;
+				rowSum += rowPtr[x];
+			}
+			countPtr[x + 1] = countAbove[x + 1] + rowCount;
+			sumPtr[x + 1] = sumAbove[x + 1] + rowSum;
+		}
+	}
+}
+
+void DepthInpainter::buildPyramid(const float* data, int width, int minX, int minY){
+	// Levels are kept between frames so their buffers are reused
+	int numLevels = 1;
+	for (int w = ROIwidth, h = ROIheight; w > 1 || h > 1; w = (w + 1)/2, h = (h + 1)/2)
+		numLevels++;
+	pyramid.resize(numLevels);
+
+	// Level 0 holds the valid pixels of the ROI with weight 1
+	PyramidLevel& base = pyramid[0];
+	base.width = ROIwidth;
+	base.height = ROIheight;
+	base.value.resize(ROIwidth*ROIheight);
+	base.weight.resize(ROIwidth*ROIheight);
+	for (int y = 0; y < ROIheight; y++)
+	{
+		const float* rowPtr = data + (y + minY)*width + minX;
+		for (int x = 0; x < ROIwidth; x++)
+		{
+			bool valid = isValid(rowPtr[x]);
+			base.value[y*ROIwidth + x] = valid ? rowPtr[x] : 0;
+			base.weight[y*ROIwidth + x] = valid ? 1 : 0;
+		}
+	}
+
+	// Push: weighted average of 2x2 blocks down to a single pixel
+	for (int level = 1; level < numLevels; level++)
+	{
+		PyramidLevel& coarse = pyramid[level];
+		const PyramidLevel& fine = pyramid[level - 1];
+		coarse.width = (fine.width + 1)/2;
+		coarse.height = (fine.height + 1)/2;
+		coarse.value.resize(coarse.width*coarse.height);
+		coarse.weight.resize(coarse.width*coarse.height);
+		for (int y = 0; y < coarse.height; y++)
+		{
+			for (int x = 0; x < coarse.width; x++)
+			{
+				float sumWeight = 0;
+				float sumValue = 0;
+				for (int dy = 0; dy < 2; dy++)
+				{
+					for (int dx = 0; dx < 2; dx++)
+					{
+						int fx = min(2*x + dx, fine.width - 1);
+						int fy = min(2*y + dy, fine.height - 1);
+						float w = fine.weight[fy*fine.width + fx];
+						sumWeight += w;
+						sumValue += w*fine.value[fy*fine.width + fx];
+					}
+				}
+				coarse.value[y*coarse.width + x] = sumWeight > 0 ? sumValue / sumWeight : 0;
+				coarse.weight[y*coarse.width + x] = min(1.0f, sumWeight); // A parent of a valid pixel is fully trusted
+			}
+		}
+	}
+
+	// Pull: blend each level with the interpolation of the coarser one where it lacks samples
+	for (int level = numLevels - 2; level >= 0; level--)
+	{
+		PyramidLevel& fine = pyramid[level];
+		for (int y = 0; y < fine.height; y++)
+		{
+			for (int x = 0; x < fine.width; x++)
+			{
+				int idx = y*fine.width + x;
+				float w = fine.weight[idx];
+				if (w >= 1)
+					continue;
+				float coarseValue = samplePyramid(level + 1, (x + 0.5f)/2 - 0.5f, (y + 0.5f)/2 - 0.5f);
+				fine.value[idx] = w*fine.value[idx] + (1 - w)*coarseValue;
+				fine.weight[idx] = 1;
+			}
+		}
+	}
+}
+
+float DepthInpainter::samplePyramid(int level, float x, float y){
+	// Bilinear interpolation clamped to the level
+	const PyramidLevel& l = pyramid[level];
+	x = ofClamp(x, 0, l.width - 1);
+	y = ofClamp(y, 0, l.height - 1);
+	int x0 = (int)x;
+	int y0 = (int)y;
+	int x1 = min(x0 + 1, l.width - 1);
+	int y1 = min(y0 + 1, l.height - 1);
+	float fx = x - x0;
+	float fy = y - y0;
+	float top = l.value[y0*l.width + x0]*(1 - fx) + l.value[y0*l.width + x1]*fx;
+	float bottom = l.value[y1*l.width + x0]*(1 - fx) + l.value[y1*l.width + x1]*fx;
+	return top*(1 - fy) + bottom*fy;
+}
@@ -0,0 +1,83 @@
+/***********************************************************************
+DepthInpainter - Fill the pixels without a valid depth with the average
+of their valid neighbours or a push-pull interpolation for large holes.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <vector>
+
+#include "WorkerPool.h"
+
+//! Inpainting of the invalid depth values (0 and the filter initial value)
+/** An invalid pixel gets the average of the valid pixels of the ROI in the
+    (2*radius+1)^2 window around it, read from integral images of the valid
+    pixel count and sum so the cost does not depend on the window size.
+    Pixels without any valid neighbour in their window get the value of a
+    push-pull pyramid: the valid pixels are averaged down to a single pixel
+    and the holes are filled back up level by level with bilinear
+    interpolation, so large holes get a smooth fill instead of a constant.*/
+class DepthInpainter {
+public:
+	DepthInpainter();
+
+	void setRadius(int sradius){
+		radius = sradius;
+	}
+
+	// Fill the invalid pixels of the ROI [minX, maxX[ x [minY, maxY[ grown by margin pixels
+	// Only the valid pixels inside the ROI are used as samples
+	void inpaint(float* data, int width, int height, int minX, int maxX, int minY, int maxY, int margin, float invalidValue, WorkerPool& workers);
+
+	// Statistics of the last call
+	int getNumLocalFills(){
+		return numLocalFills;
+	}
+	int getNumPyramidFills(){
+		return numPyramidFills;
+	}
+
+private:
+	struct PyramidLevel {
+		int width, height;
+		std::vector<float> value;
+		std::vector<float> weight; // Fraction of the area covered by valid pixels
+	};
+
+	void buildIntegralImages(const float* data, int width, int minX, int minY);
+	void buildPyramid(const float* data, int width, int minX, int minY);
+	float samplePyramid(int level, float x, float y);
+
+	bool isValid(float val){
+		return val != 0 && val != invalidValue;
+	}
+
+	int radius;
+	float invalidValue;
+	int ROIwidth, ROIheight;
+
+	// Integral images of the ROI with one extra row and column of zeros
+	std::vector<int> countTable;
+	std::vector<double> sumTable;
+
+	std::vector<PyramidLevel> pyramid;
+
+	int numLocalFills;
+	int numPyramidFills;
+};
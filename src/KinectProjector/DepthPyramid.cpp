@@ -0,0 +1,215 @@
+/***********************************************************************
+DepthPyramid - Min, max and mean of the filtered depth and of the
+elevation over blocks of the ROI at every scale.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "DepthPyramid.h"
+#include <cfloat>
+
+// Rows of blocks in a band processed by a worker
+static const int pyramidBandRows = 8;
+// Depth of the pixels without measure or not yet filtered
+static const float invalidDepth = 4000;
+
+DepthRange::DepthRange()
+:count(0),
+area(0),
+minDepth(FLT_MAX), maxDepth(-FLT_MAX), meanDepth(0),
+minElevation(FLT_MAX), maxElevation(-FLT_MAX), meanElevation(0)
+{
+}
+
+void DepthRange::add(const DepthRange& other){
+	area += other.area;
+	if (other.count == 0)
+		return;
+	int total = count + other.count;
+	float w = (float)other.count / total;
+	meanDepth += (other.meanDepth - meanDepth)*w;
+	meanElevation += (other.meanElevation - meanElevation)*w;
+	minDepth = min(minDepth, other.minDepth);
+	maxDepth = max(maxDepth, other.maxDepth);
+	minElevation = min(minElevation, other.minElevation);
+	maxElevation = max(maxElevation, other.maxElevation);
+	count = total;
+}
+
+DepthPyramid::DepthPyramid()
+:width(0),
+height(0),
+basePlaneW(0)
+{
+}
+
+void DepthPyramid::compute(const float* depth, int swidth, int sheight, int minX, int maxX, int minY, int maxY, const ofMatrix4x4& worldMatrix, const ofVec4f& basePlane, WorkerPool& workers){
+	width = swidth;
+	height = sheight;
+	// The world coordinates are z*worldMatrix*(x, y, z, 1): the elevation is a quadratic of the depth
+	ofVec3f normal(basePlane.x, basePlane.y, basePlane.z);
+	ofVec4f column[4] = {worldMatrix*ofVec4f(1, 0, 0, 0), worldMatrix*ofVec4f(0, 1, 0, 0), worldMatrix*ofVec4f(0, 0, 1, 0), worldMatrix*ofVec4f(0, 0, 0, 1)};
+	elevationCoefficients = ofVec4f(normal.dot(ofVec3f(column[0])), normal.dot(ofVec3f(column[1])), normal.dot(ofVec3f(column[2])), normal.dot(ofVec3f(column[3])));
+	basePlaneW = basePlane.w;
+
+	// The level buffers are kept between frames
+	int numLevels = 0;
+	for (int w = width, h = height; w > 1 || h > 1; w = (w + 1)/2, h = (h + 1)/2)
+		numLevels++;
+	levels.resize(numLevels);
+	for (int l = 0; l < numLevels; l++)
+	{
+		levels[l].width = l == 0 ? (width + 1)/2 : (levels[l-1].width + 1)/2;
+		levels[l].height = l == 0 ? (height + 1)/2 : (levels[l-1].height + 1)/2;
+		levels[l].blocks.resize(levels[l].width*levels[l].height);
+	}
+	if (numLevels == 0)
+		return;
+
+	workers.parallelFor(0, levels[0].height, pyramidBandRows, [&](int j0, int j1, int /*band*/) {
+		computeBase(depth, minX, maxX, minY, maxY, j0, j1);
+	});
+	for (int l = 1; l < numLevels; l++)
+	{
+		workers.parallelFor(0, levels[l].height, pyramidBandRows, [&](int j0, int j1, int /*band*/) {
+			downsample(l, j0, j1);
+		});
+	}
+}
+
+// Blocks of 2 x 2 pixels
+void DepthPyramid::computeBase(const float* depth, int minX, int maxX, int minY, int maxY, int j0, int j1){
+	Level& base = levels[0];
+	for (int j = j0; j < j1; j++)
+	{
+		DepthRange* row = &base.blocks[j*base.width];
+		int y0 = max(2*j, minY);
+		int y1 = min(2*j + 2, maxY);
+		for (int i = 0; i < base.width; i++)
+		{
+			DepthRange block;
+			block.area = min(2, width - 2*i)*min(2, height - 2*j);
+			int x0 = max(2*i, minX);
+			int x1 = min(2*i + 2, maxX);
+			float sumDepth = 0, sumElevation = 0;
+			for (int y = y0; y < y1; y++)
+				for (int x = x0; x < x1; x++)
+				{
+					float z = depth[y*width + x];
+					if (z <= 0 || z >= invalidDepth)
+						continue;
+					float e = -z*(elevationCoefficients.x*x + elevationCoefficients.y*y + elevationCoefficients.z*z + elevationCoefficients.w) - basePlaneW;
+					block.count++;
+					sumDepth += z;
+					sumElevation += e;
+					block.minDepth = min(block.minDepth, z);
+					block.maxDepth = max(block.maxDepth, z);
+					block.minElevation = min(block.minElevation, e);
+					block.maxElevation = max(block.maxElevation, e);
+				}
+			if (block.count > 0)
+			{
+				block.meanDepth = sumDepth / block.count;
+				block.meanElevation = sumElevation / block.count;
+			}
+			row[i] = block;
+		}
+	}
+}
+
+void DepthPyramid::downsample(int level, int j0, int j1){
+	const Level& fine = levels[level - 1];
+	Level& coarse = levels[level];
+	for (int j = j0; j < j1; j++)
+		for (int i = 0; i < coarse.width; i++)
+		{
+			// The blocks of the last row and column of a level with an odd size have a single child
+			DepthRange block;
+			for (int fj = 2*j; fj < min(2*j + 2, fine.height); fj++)
+				for (int fi = 2*i; fi < min(2*i + 2, fine.width); fi++)
+					block.add(fine.blocks[fj*fine.width + fi]);
+			coarse.blocks[j*coarse.width + i] = block;
+		}
+}
+
+int DepthPyramid::getLevelWidth(int level) const {
+	return levels.empty() ? 0 : getLevel(level).width;
+}
+
+int DepthPyramid::getLevelHeight(int level) const {
+	return levels.empty() ? 0 : getLevel(level).height;
+}
+
+const DepthRange& DepthPyramid::getBlock(int i, int j, int level) const {
+	if (levels.empty())
+		return emptyRange;
+	const Level& l = getLevel(level);
+	if (i < 0 || i >= l.width || j < 0 || j >= l.height)
+		return emptyRange;
+	return l.blocks[j*l.width + i];
+}
+
+bool DepthPyramid::getBounds(const ofRectangle& region, int& x0, int& x1, int& y0, int& y1, int& outside) const {
+	int left = (int)floor(region.getLeft());
+	int right = (int)ceil(region.getRight());
+	int top = (int)floor(region.getTop());
+	int bottom = (int)ceil(region.getBottom());
+	x0 = max(left, 0);
+	x1 = min(right, width);
+	y0 = max(top, 0);
+	y1 = min(bottom, height);
+	if (x1 <= x0 || y1 <= y0)
+	{
+		outside = max(0, right - left)*max(0, bottom - top);
+		return false;
+	}
+	outside = (right - left)*(bottom - top) - (x1 - x0)*(y1 - y0);
+	return true;
+}
+
+DepthRange DepthPyramid::mergeBlocks(const Level& level, int shift, int x0, int x1, int y0, int y1) const {
+	DepthRange range;
+	for (int j = y0 >> shift; j <= (y1 - 1) >> shift; j++)
+		for (int i = x0 >> shift; i <= (x1 - 1) >> shift; i++)
+			range.add(level.blocks[j*level.width + i]);
+	return range;
+}
+
+DepthRange DepthPyramid::getRange(ofRectangle region, int level) const {
+	DepthRange range;
+	int x0, x1, y0, y1, outside;
+	bool inside = getBounds(region, x0, x1, y0, y1, outside);
+	if (inside && !levels.empty())
+	{
+		level = min(max(level, 1), (int)levels.size());
+		range = mergeBlocks(levels[level - 1], level, x0, x1, y0, y1);
+	}
+	range.area += outside;
+	return range;
+}
+
+DepthRange DepthPyramid::getRange(ofRectangle region) const {
+	int x0, x1, y0, y1, outside;
+	int level = 1;
+	if (getBounds(region, x0, x1, y0, y1, outside))
+	{
+		while (level < (int)levels.size() && (((x1 - 1) >> level) - (x0 >> level) > 1 || ((y1 - 1) >> level) - (y0 >> level) > 1))
+			level++;
+	}
+	return getRange(region, level);
+}
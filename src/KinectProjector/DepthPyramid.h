@@ -0,0 +1,97 @@
+/***********************************************************************
+DepthPyramid - Min, max and mean of the filtered depth and of the
+elevation over blocks of the ROI at every scale.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <vector>
+
+#include "ofMain.h"
+#include "WorkerPool.h"
+
+// Statistics of the valid pixels of a block or of a region
+struct DepthRange {
+	DepthRange();
+	void add(const DepthRange& other);
+
+	bool isEmpty() const {
+		return count == 0;
+	}
+	bool isComplete() const { // Every pixel covered has a valid depth
+		return count == area;
+	}
+
+	int count; // Valid pixels (inside the ROI with a depth)
+	int area; // Pixels covered
+	float minDepth, maxDepth, meanDepth; // Millimeters
+	float minElevation, maxElevation, meanElevation; // Millimeters above the base plane
+};
+
+//! Coarse terrain of the sand at every scale
+/** Level l holds the statistics of blocks of 2^l x 2^l kinect pixels for l >= 1 (level 0
+    is the depth frame itself and is not stored). Only the pixels of the ROI with a valid
+    depth are counted so the blocks outside the ROI are empty. The elevation is computed
+    with the base plane given to compute(). getRange() merges at most 2 x 2 blocks of the
+    finest level covering the region so range checks such as "is there land in this
+    region" do not depend on the size of the region.*/
+class DepthPyramid {
+public:
+	DepthPyramid();
+
+	// Statistics of the depth frame in the ROI [minX, maxX[ x [minY, maxY[
+	void compute(const float* depth, int width, int height, int minX, int maxX, int minY, int maxY, const ofMatrix4x4& worldMatrix, const ofVec4f& basePlane, WorkerPool& workers);
+
+	int getNumLevels() const { // Including level 0
+		return levels.size() + 1;
+	}
+	bool isEmpty() const {
+		return levels.empty();
+	}
+	int getLevelWidth(int level) const;
+	int getLevelHeight(int level) const;
+
+	// Block (i, j) of a level covers the kinect pixels [i*2^l, (i+1)*2^l[ x [j*2^l, (j+1)*2^l[
+	const DepthRange& getBlock(int i, int j, int level) const;
+	// All the blocks of a level overlapping a region in kinect pixels - the pixels of the region outside the frame are counted in the area
+	DepthRange getRange(ofRectangle region, int level) const;
+	// Same with the finest level where the region overlaps at most 2 x 2 blocks
+	DepthRange getRange(ofRectangle region) const;
+
+private:
+	struct Level {
+		int width, height;
+		std::vector<DepthRange> blocks;
+	};
+
+	const Level& getLevel(int level) const {
+		return levels[min(max(level, 1), (int)levels.size()) - 1];
+	}
+	void computeBase(const float* depth, int minX, int maxX, int minY, int maxY, int j0, int j1);
+	void downsample(int level, int j0, int j1);
+	// Pixel bounds of a region clipped to the frame - false if the clipped region is empty
+	bool getBounds(const ofRectangle& region, int& x0, int& x1, int& y0, int& y1, int& outside) const;
+	DepthRange mergeBlocks(const Level& level, int shift, int x0, int x1, int y0, int y1) const;
+
+	std::vector<Level> levels;
+	int width, height;
+	ofVec4f elevationCoefficients; // Elevation of pixel (x, y) of depth z: -z*(a*x + b*y + c*z + d) - basePlane.w
+	float basePlaneW;
+	DepthRange emptyRange;
+};
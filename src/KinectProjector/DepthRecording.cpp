@@ -0,0 +1,513 @@
+/***********************************************************************
+DepthRecording - Recording of raw depth and color frames in a
+memory-mapped and indexed container file.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "DepthRecording.h"
+
+#ifdef TARGET_WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char recordingMagic[8] = {'M', 'S', 'A', 'N', 'D', 'R', 'E', 'C'};
+static const uint32_t recordingVersion = 1;
+static const uint32_t frameMagic = 0x4D534652; // "MSFR"
+static const uint64_t recordingChunkSize = 256 * 1024 * 1024; // The file is grown by chunks of 256MB
+
+static uint64_t alignOffset(uint64_t offset){
+	return (offset + 15) & ~(uint64_t)15;
+}
+
+//--------------------------------------------------------------
+// MappedFile
+//--------------------------------------------------------------
+MappedFile::MappedFile()
+:data(nullptr),
+size(0),
+writable(false)
+#ifdef TARGET_WIN32
+,fileHandle(INVALID_HANDLE_VALUE),
+mappingHandle(NULL)
+#else
+,fd(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile(){
+	close();
+}
+
+#ifdef TARGET_WIN32
+bool MappedFile::open(std::string path, bool write, uint64_t ssize){
+	close();
+	writable = write;
+	fileHandle = CreateFileA(path.c_str(), write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+		write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE)
+		return false;
+	if (write)
+	{
+		size = ssize;
+	}
+	else
+	{
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(fileHandle, &fileSize);
+		size = fileSize.QuadPart;
+	}
+	if (!map())
+	{
+		CloseHandle(fileHandle);
+		fileHandle = INVALID_HANDLE_VALUE;
+		return false;
+	}
+	return true;
+}
+
+bool MappedFile::map(){
+	if (size == 0)
+		return false;
+	// Read-only files are mapped copy-on-write so the frames can be wrapped in pixels safely
+	mappingHandle = CreateFileMappingA(fileHandle, NULL, writable ? PAGE_READWRITE : PAGE_WRITECOPY, (DWORD)(size >> 32), (DWORD)(size & 0xFFFFFFFF), NULL);
+	if (mappingHandle == NULL)
+		return false;
+	data = (uint8_t*)MapViewOfFile(mappingHandle, writable ? FILE_MAP_WRITE : FILE_MAP_COPY, 0, 0, (SIZE_T)size);
+	if (data == nullptr)
+	{
+		CloseHandle(mappingHandle);
+		mappingHandle = NULL;
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::unmap(){
+	if (data != nullptr)
+		UnmapViewOfFile(data);
+	if (mappingHandle != NULL)
+		CloseHandle(mappingHandle);
+	data = nullptr;
+	mappingHandle = NULL;
+}
+
+bool MappedFile::resize(uint64_t ssize){
+	if (!writable)
+		return false;
+	unmap();
+	size = ssize; // Creating the mapping with a larger size grows the file
+	return map();
+}
+
+void MappedFile::close(uint64_t finalSize){
+	if (fileHandle == INVALID_HANDLE_VALUE)
+		return;
+	unmap();
+	if (writable && finalSize > 0)
+	{
+		LARGE_INTEGER pos;
+		pos.QuadPart = finalSize;
+		SetFilePointerEx(fileHandle, pos, NULL, FILE_BEGIN);
+		SetEndOfFile(fileHandle);
+	}
+	CloseHandle(fileHandle);
+	fileHandle = INVALID_HANDLE_VALUE;
+	size = 0;
+}
+#else
+bool MappedFile::open(std::string path, bool write, uint64_t ssize){
+	close();
+	writable = write;
+	fd = ::open(path.c_str(), write ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+	if (fd < 0)
+		return false;
+	if (write)
+	{
+		size = ssize;
+		if (ftruncate(fd, size) != 0)
+		{
+			::close(fd);
+			fd = -1;
+			return false;
+		}
+	}
+	else
+	{
+		struct stat st;
+		fstat(fd, &st);
+		size = st.st_size;
+	}
+	if (!map())
+	{
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+	return true;
+}
+
+bool MappedFile::map(){
+	if (size == 0)
+		return false;
+	// Read-only files are mapped copy-on-write so the frames can be wrapped in pixels safely
+	void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	if (ptr == MAP_FAILED)
+		return false;
+	data = (uint8_t*)ptr;
+	return true;
+}
+
+void MappedFile::unmap(){
+	if (data != nullptr)
+		munmap(data, size);
+	data = nullptr;
+}
+
+bool MappedFile::resize(uint64_t ssize){
+	if (!writable)
+		return false;
+	unmap();
+	size = ssize;
+	if (ftruncate(fd, size) != 0)
+		return false;
+	return map();
+}
+
+void MappedFile::close(uint64_t finalSize){
+	if (fd < 0)
+		return;
+	unmap();
+	if (writable && finalSize > 0)
+		ftruncate(fd, finalSize);
+	::close(fd);
+	fd = -1;
+	size = 0;
+}
+#endif
+
+//--------------------------------------------------------------
+// DepthCodec
+//--------------------------------------------------------------
+static inline uint8_t* writeVarint(uint8_t* dst, uint32_t val){
+	while (val >= 0x80)
+	{
+		*dst++ = (uint8_t)(val | 0x80);
+		val >>= 7;
+	}
+	*dst++ = (uint8_t)val;
+	return dst;
+}
+
+size_t DepthCodec::encode(const uint16_t* src, size_t numPixels, uint8_t* dst){
+	// Symbols are varints: (zigzag residual << 1) for a single value
+	// or (run length << 1) | 1 for a run of values equal to the previous one
+	uint8_t* dstPtr = dst;
+	int prev = 0;
+	size_t i = 0;
+	while (i < numPixels)
+	{
+		int val = src[i];
+		if (val == prev)
+		{
+			size_t run = 1;
+			while (i + run < numPixels && src[i + run] == prev)
+				run++;
+			if (run > 1)
+			{
+				dstPtr = writeVarint(dstPtr, (uint32_t)(run << 1) | 1);
+				i += run;
+				continue;
+			}
+		}
+		int delta = val - prev;
+		uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+		dstPtr = writeVarint(dstPtr, zigzag << 1);
+		prev = val;
+		i++;
+	}
+	return dstPtr - dst;
+}
+
+bool DepthCodec::decode(const uint8_t* src, size_t srcSize, uint16_t* dst, size_t numPixels){
+	const uint8_t* srcEnd = src + srcSize;
+	int prev = 0;
+	size_t i = 0;
+	while (i < numPixels && src < srcEnd)
+	{
+		uint32_t symbol = 0;
+		int shift = 0;
+		uint8_t byte;
+		do
+		{
+			if (src >= srcEnd || shift > 28)
+				return false;
+			byte = *src++;
+			symbol |= (uint32_t)(byte & 0x7F) << shift;
+			shift += 7;
+		} while (byte & 0x80);
+
+		if (symbol & 1)
+		{
+			size_t run = symbol >> 1;
+			if (i + run > numPixels)
+				return false;
+			for (size_t j = 0; j < run; j++)
+				dst[i++] = (uint16_t)prev;
+		}
+		else
+		{
+			uint32_t zigzag = symbol >> 1;
+			int delta = (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+			prev += delta;
+			dst[i++] = (uint16_t)prev;
+		}
+	}
+	return i == numPixels;
+}
+
+//--------------------------------------------------------------
+// DepthRecorder
+//--------------------------------------------------------------
+DepthRecorder::DepthRecorder()
+:writeOffset(0),
+compressDepth(false)
+{
+}
+
+DepthRecorder::~DepthRecorder(){
+	stop();
+}
+
+bool DepthRecorder::start(std::string spath, int width, int height, bool recordColor, bool scompressDepth, ofVec3f worldScale, ofVec3f worldOffset){
+	stop();
+	path = spath;
+	compressDepth = scompressDepth;
+	index.clear();
+
+	if (!file.open(path, true, recordingChunkSize))
+	{
+		ofLogError("DepthRecorder") << "start(): Could not create recording " << path;
+		return false;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, recordingMagic, sizeof(header.magic));
+	header.version = recordingVersion;
+	header.width = width;
+	header.height = height;
+	header.hasColor = recordColor ? 1 : 0;
+	header.worldScaleX = worldScale.x;
+	header.worldScaleY = worldScale.y;
+	header.worldOffsetX = worldOffset.x;
+	header.worldOffsetY = worldOffset.y;
+	memcpy(file.getData(), &header, sizeof(header));
+	writeOffset = alignOffset(sizeof(header));
+
+	ofLogVerbose("DepthRecorder") << "start(): Recording to " << path << (compressDepth ? " with" : " without") << " depth compression";
+	return true;
+}
+
+bool DepthRecorder::reserve(uint64_t bytes){
+	if (writeOffset + bytes <= file.getSize())
+		return true;
+	uint64_t newSize = file.getSize() + std::max(recordingChunkSize, bytes);
+	if (!file.resize(newSize))
+	{
+		ofLogError("DepthRecorder") << "reserve(): Could not grow recording to " << newSize << " bytes - stopping";
+		file.close(writeOffset);
+		return false;
+	}
+	return true;
+}
+
+bool DepthRecorder::addFrame(const ofShortPixels& depth, const ofPixels& color, uint64_t timestamp){
+	if (!file.isOpen())
+		return false;
+	if (depth.getWidth() != header.width || depth.getHeight() != header.height)
+		return false;
+
+	size_t numPixels = header.width*header.height;
+	size_t colorSize = header.hasColor ? numPixels * 3 : 0;
+	size_t maxDepthSize = compressDepth ? DepthCodec::maxEncodedSize(numPixels) : numPixels*sizeof(uint16_t);
+	if (!reserve(sizeof(DepthRecordingFrameHeader) + maxDepthSize + colorSize + 16))
+		return false;
+
+	uint8_t* framePtr = file.getData() + writeOffset;
+	uint8_t* depthPtr = framePtr + sizeof(DepthRecordingFrameHeader);
+	DepthRecordingFrameHeader frameHeader;
+	frameHeader.magic = frameMagic;
+	frameHeader.timestamp = timestamp;
+	if (compressDepth)
+	{
+		frameHeader.depthCodec = DepthCodec::DEPTH_CODEC_DELTA_RLE;
+		frameHeader.depthSize = DepthCodec::encode(depth.getData(), numPixels, depthPtr);
+	}
+	else
+	{
+		frameHeader.depthCodec = DepthCodec::DEPTH_CODEC_RAW;
+		frameHeader.depthSize = numPixels*sizeof(uint16_t);
+		memcpy(depthPtr, depth.getData(), frameHeader.depthSize);
+	}
+	// Frames without the expected color are stored black
+	frameHeader.colorSize = colorSize;
+	if (colorSize > 0)
+	{
+		if (color.getWidth() == header.width && color.getHeight() == header.height && color.getNumChannels() == 3)
+			memcpy(depthPtr + frameHeader.depthSize, color.getData(), colorSize);
+		else
+			memset(depthPtr + frameHeader.depthSize, 0, colorSize);
+	}
+	memcpy(framePtr, &frameHeader, sizeof(frameHeader));
+
+	DepthRecordingIndexEntry entry;
+	entry.offset = writeOffset;
+	entry.timestamp = timestamp;
+	index.push_back(entry);
+	writeOffset = alignOffset(writeOffset + sizeof(frameHeader) + frameHeader.depthSize + colorSize);
+
+	// Keep the frame count up to date in case the recording is not closed properly
+	header.numFrames = index.size();
+	memcpy(file.getData(), &header, sizeof(header));
+	return true;
+}
+
+void DepthRecorder::stop(){
+	if (!file.isOpen())
+		return;
+	uint64_t indexSize = index.size()*sizeof(DepthRecordingIndexEntry);
+	if (reserve(indexSize))
+	{
+		if (indexSize > 0)
+			memcpy(file.getData() + writeOffset, index.data(), indexSize);
+		header.numFrames = index.size();
+		header.indexOffset = writeOffset;
+		memcpy(file.getData(), &header, sizeof(header));
+		file.close(writeOffset + indexSize);
+	}
+	ofLogVerbose("DepthRecorder") << "stop(): Recorded " << index.size() << " frames in " << path;
+	index.clear();
+}
+
+//--------------------------------------------------------------
+// DepthRecordingReader
+//--------------------------------------------------------------
+DepthRecordingReader::DepthRecordingReader(){
+	memset(&header, 0, sizeof(header));
+}
+
+bool DepthRecordingReader::open(std::string path){
+	close();
+	if (!file.open(path, false))
+	{
+		ofLogError("DepthRecordingReader") << "open(): Could not open recording " << path;
+		return false;
+	}
+	if (file.getSize() < sizeof(header))
+	{
+		ofLogError("DepthRecordingReader") << "open(): Recording is too small " << path;
+		close();
+		return false;
+	}
+	memcpy(&header, file.getData(), sizeof(header));
+	if (memcmp(header.magic, recordingMagic, sizeof(header.magic)) != 0 || header.version != recordingVersion)
+	{
+		ofLogError("DepthRecordingReader") << "open(): Not a recording or unsupported version " << path;
+		close();
+		return false;
+	}
+
+	uint64_t indexSize = header.numFrames*sizeof(DepthRecordingIndexEntry);
+	if (header.indexOffset != 0 && header.indexOffset + indexSize <= file.getSize())
+	{
+		const DepthRecordingIndexEntry* entries = (const DepthRecordingIndexEntry*)(file.getData() + header.indexOffset);
+		index.assign(entries, entries + header.numFrames);
+	}
+	else if (!rebuildIndex())
+	{
+		close();
+		return false;
+	}
+	ofLogVerbose("DepthRecordingReader") << "open(): " << index.size() << " frames of " << header.width << "x" << header.height << " in " << path;
+	return !index.empty();
+}
+
+bool DepthRecordingReader::rebuildIndex(){
+	ofLogWarning("DepthRecordingReader") << "rebuildIndex(): Recording was not closed properly - rebuilding frame index";
+	index.clear();
+	size_t numPixels = header.width*header.height;
+	uint64_t offset = alignOffset(sizeof(header));
+	while (offset + sizeof(DepthRecordingFrameHeader) <= file.getSize())
+	{
+		const DepthRecordingFrameHeader* frameHeader = (const DepthRecordingFrameHeader*)(file.getData() + offset);
+		uint64_t frameEnd = offset + sizeof(DepthRecordingFrameHeader) + frameHeader->depthSize + frameHeader->colorSize;
+		if (frameHeader->magic != frameMagic || frameEnd > file.getSize() || frameHeader->depthSize > DepthCodec::maxEncodedSize(numPixels))
+			break;
+		DepthRecordingIndexEntry entry;
+		entry.offset = offset;
+		entry.timestamp = frameHeader->timestamp;
+		index.push_back(entry);
+		offset = alignOffset(frameEnd);
+	}
+	return !index.empty();
+}
+
+void DepthRecordingReader::close(){
+	file.close();
+	index.clear();
+}
+
+const DepthRecordingFrameHeader* DepthRecordingReader::getFrameHeader(int frame){
+	if (frame < 0 || frame >= (int)index.size())
+		return nullptr;
+	return (const DepthRecordingFrameHeader*)(file.getData() + index[frame].offset);
+}
+
+bool DepthRecordingReader::getDepth(int frame, ofShortPixels& depth){
+	const DepthRecordingFrameHeader* frameHeader = getFrameHeader(frame);
+	if (frameHeader == nullptr)
+		return false;
+	uint8_t* depthPtr = (uint8_t*)frameHeader + sizeof(DepthRecordingFrameHeader);
+	size_t numPixels = header.width*header.height;
+	if (frameHeader->depthCodec == DepthCodec::DEPTH_CODEC_RAW)
+	{
+		depth.setFromExternalPixels((uint16_t*)depthPtr, header.width, header.height, 1);
+		return true;
+	}
+	// Decoding in pixels wrapping a previous raw frame would overwrite the mapped recording
+	if (isMapped(depth.getData()))
+		depth.clear();
+	if (depth.getWidth() != header.width || depth.getHeight() != header.height || depth.getNumChannels() != 1)
+		depth.allocate(header.width, header.height, 1);
+	return DepthCodec::decode(depthPtr, frameHeader->depthSize, depth.getData(), numPixels);
+}
+
+bool DepthRecordingReader::getColor(int frame, ofPixels& color){
+	const DepthRecordingFrameHeader* frameHeader = getFrameHeader(frame);
+	if (frameHeader == nullptr || frameHeader->colorSize == 0)
+		return false;
+	uint8_t* colorPtr = (uint8_t*)frameHeader + sizeof(DepthRecordingFrameHeader) + frameHeader->depthSize;
+	color.setFromExternalPixels(colorPtr, header.width, header.height, 3);
+	return true;
+}
@@ -0,0 +1,192 @@
+/***********************************************************************
+DepthRecording - Recording of raw depth and color frames in a
+memory-mapped and indexed container file.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+
+/* Layout of a recording (.msd) file:
+   - DepthRecordingHeader
+   - frames, each one a DepthRecordingFrameHeader followed by the depth data
+     and the RGB color data (if any), aligned on 16 bytes
+   - frame index (one DepthRecordingIndexEntry per frame) written when the recording is closed
+   If the recording was not closed properly (no index) the reader rebuilds the index
+   by walking the frame headers. */
+
+struct DepthRecordingHeader {
+	char magic[8]; // "MSANDREC"
+	uint32_t version;
+	uint32_t width, height;
+	uint32_t hasColor;
+	uint64_t numFrames;
+	uint64_t indexOffset; // 0 if the recording was not closed
+	float worldScaleX, worldScaleY; // World coordinates are ((x*scaleX+offsetX)*z, (y*scaleY+offsetY)*z, z)
+	float worldOffsetX, worldOffsetY;
+	uint8_t reserved[16];
+};
+
+struct DepthRecordingFrameHeader {
+	uint32_t magic; // Frame marker used to rebuild the index
+	uint32_t depthCodec;
+	uint32_t depthSize; // Size in bytes of the (encoded) depth data
+	uint32_t colorSize; // Size in bytes of the RGB data - 0 if no color
+	uint64_t timestamp; // Microseconds
+};
+
+struct DepthRecordingIndexEntry {
+	uint64_t offset; // Offset of the frame header
+	uint64_t timestamp;
+};
+
+//! Minimal read/write memory mapping of a file
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool open(std::string path, bool write, uint64_t size = 0);
+	bool resize(uint64_t size); // Only for writable mappings - the content is kept
+	void close(uint64_t finalSize = 0); // Truncate writable files to finalSize if > 0
+
+	uint8_t* getData(){
+		return data;
+	}
+	uint64_t getSize(){
+		return size;
+	}
+	bool isOpen(){
+		return data != nullptr;
+	}
+
+private:
+	bool map();
+	void unmap();
+
+	uint8_t* data;
+	uint64_t size;
+	bool writable;
+#ifdef TARGET_WIN32
+	void* fileHandle;
+	void* mappingHandle;
+#else
+	int fd;
+#endif
+};
+
+//! Lossless codec for the depth frames
+/** Each depth value is predicted by its left neighbour. The zigzag coded residuals
+    are written as variable-length integers and runs of identical values (flat sand and
+    invalid regions) are collapsed in a single symbol. */
+class DepthCodec {
+public:
+	enum Depth_codec
+	{
+		DEPTH_CODEC_RAW = 0,
+		DEPTH_CODEC_DELTA_RLE = 1
+	};
+
+	// Maximum size of an encoded frame
+	static size_t maxEncodedSize(size_t numPixels){
+		return numPixels*3;
+	}
+	static size_t encode(const uint16_t* src, size_t numPixels, uint8_t* dst);
+	static bool decode(const uint8_t* src, size_t srcSize, uint16_t* dst, size_t numPixels);
+};
+
+//! Appends frames to a recording
+/** Frames are copied (or encoded) directly in the mapped file that is grown
+    by large chunks so the cost in the grabber thread is mostly a memcpy.*/
+class DepthRecorder {
+public:
+	DepthRecorder();
+	~DepthRecorder();
+
+	bool start(std::string path, int width, int height, bool recordColor, bool compressDepth, ofVec3f worldScale, ofVec3f worldOffset);
+	bool addFrame(const ofShortPixels& depth, const ofPixels& color, uint64_t timestamp);
+	void stop();
+
+	bool isRecording(){
+		return file.isOpen();
+	}
+	uint64_t getNumFrames(){
+		return index.size();
+	}
+
+private:
+	bool reserve(uint64_t bytes);
+
+	MappedFile file;
+	std::string path;
+	DepthRecordingHeader header;
+	std::vector<DepthRecordingIndexEntry> index;
+	uint64_t writeOffset;
+	bool compressDepth;
+};
+
+//! Random access to the frames of a recording
+/** Raw depth and color frames are returned as pointers in the mapped file (zero-copy).
+    Compressed depth frames are decoded in the given pixels.*/
+class DepthRecordingReader {
+public:
+	DepthRecordingReader();
+
+	bool open(std::string path);
+	void close();
+
+	bool isOpen(){
+		return file.isOpen();
+	}
+	int getNumFrames(){
+		return index.size();
+	}
+	int getWidth(){
+		return header.width;
+	}
+	int getHeight(){
+		return header.height;
+	}
+	bool hasColor(){
+		return header.hasColor != 0;
+	}
+	uint64_t getTimestamp(int frame){
+		return index[frame].timestamp;
+	}
+	ofVec3f getWorldCoordinateAt(int x, int y, float z){
+		return ofVec3f((x*header.worldScaleX + header.worldOffsetX)*z, (y*header.worldScaleY + header.worldOffsetY)*z, z);
+	}
+
+	// Depth of a frame: wraps the mapped data if the frame is raw, decodes it otherwise
+	bool getDepth(int frame, ofShortPixels& depth);
+	// Color of a frame wrapping the mapped data
+	bool getColor(int frame, ofPixels& color);
+	// Do the pixels wrap the mapped data - they must get their own storage before being written
+	bool isMapped(const void* data){
+		return file.isOpen() && data >= file.getData() && data < file.getData() + file.getSize();
+	}
+
+private:
+	bool rebuildIndex();
+	const DepthRecordingFrameHeader* getFrameHeader(int frame);
+
+	MappedFile file;
+	DepthRecordingHeader header;
+	std::vector<DepthRecordingIndexEntry> index;
+};
@@ -0,0 +1,340 @@
+/***********************************************************************
+DepthSource - Source of raw depth and color frames for the KinectGrabber.
+Either a live Kinect or a replay of a recorded session.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "DepthSource.h"
+
+//--------------------------------------------------------------
+// KinectDepthSource
+//--------------------------------------------------------------
+KinectDepthSource::KinectDepthSource()
+:opened(false),
+timestamp(0),
+colorEnabled(true),
+colorReady(false)
+{
+}
+
+bool KinectDepthSource::setup(){
+	kinect.init(false, colorEnabled, false);
+	kinect.setRegistration(true); // To have correspondance between RGB and depth images
+	kinect.setUseTexture(false);
+	return true;
+}
+
+bool KinectDepthSource::open(){
+	opened = kinect.open();
+	return opened;
+}
+
+void KinectDepthSource::close(){
+	kinect.close();
+	opened = false;
+}
+
+bool KinectDepthSource::isOpen(){
+	return opened;
+}
+
+void KinectDepthSource::update(){
+	kinect.update();
+	if (kinect.isFrameNew())
+		timestamp = ofGetElapsedTimeMicros();
+	if (colorEnabled && kinect.isFrameNewVideo())
+		colorReady = true;
+}
+
+// ofxKinect only starts the video stream when the device is opened: the kinect is reopened in the new mode
+bool KinectDepthSource::setColorEnabled(bool enabled){
+	if (enabled == colorEnabled)
+		return true;
+	colorEnabled = enabled;
+	colorReady = false;
+	bool wasOpen = opened;
+	if (wasOpen)
+		close();
+	kinect.init(false, colorEnabled, false);
+	kinect.setRegistration(true);
+	if (wasOpen && !open())
+	{
+		ofLogError("KinectDepthSource") << "setColorEnabled(): Could not reopen the kinect";
+		return false;
+	}
+	ofLogVerbose("KinectDepthSource") << "setColorEnabled(): Color stream " << (colorEnabled ? "enabled" : "disabled");
+	return true;
+}
+
+bool KinectDepthSource::isFrameNew(){
+	return kinect.isFrameNew();
+}
+
+ofShortPixels& KinectDepthSource::getRawDepthPixels(){
+	return kinect.getRawDepthPixels();
+}
+
+ofPixels& KinectDepthSource::getColorPixels(){
+	return kinect.getPixels();
+}
+
+uint64_t KinectDepthSource::getTimestamp(){
+	return timestamp;
+}
+
+unsigned int KinectDepthSource::getWidth(){
+	return kinect.getWidth();
+}
+
+unsigned int KinectDepthSource::getHeight(){
+	return kinect.getHeight();
+}
+
+ofVec3f KinectDepthSource::getWorldCoordinateAt(int x, int y, float z){
+	return kinect.getWorldCoordinateAt(x, y, z);
+}
+
+//--------------------------------------------------------------
+// ReplayDepthSource
+//--------------------------------------------------------------
+ReplayDepthSource::ReplayDepthSource(std::string spath, Replay_mode smode, bool sloop)
+:path(spath),
+mode(smode),
+loop(sloop),
+opened(false),
+frameNew(false),
+finished(false),
+colorEnabled(true),
+width(640),
+height(480),
+currentFrame(-1),
+replayStartTime(0),
+requestedSteps(0),
+useRecordingFile(false)
+{
+}
+
+ReplayDepthSource::Replay_mode ReplayDepthSource::modeFromString(std::string smode){
+	if (smode == "fast")
+		return REPLAY_MODE_FAST;
+	if (smode == "step")
+		return REPLAY_MODE_STEP;
+	return REPLAY_MODE_REALTIME;
+}
+
+std::string ReplayDepthSource::framePath(std::string prefix, int frame){
+	char name[32];
+	snprintf(name, sizeof(name), "%s_%06d.png", prefix.c_str(), frame);
+	return ofToDataPath(path + "/" + name);
+}
+
+bool ReplayDepthSource::setup(){
+	timestamps.clear();
+
+	useRecordingFile = ofToLower(ofFilePath::getFileExt(path)) == "msd";
+	if (useRecordingFile)
+	{
+		if (!recording.open(ofToDataPath(path)))
+			return false;
+		for (int i = 0; i < recording.getNumFrames(); i++)
+			timestamps.push_back(recording.getTimestamp(i));
+		width = recording.getWidth();
+		height = recording.getHeight();
+		currentFrame = -1;
+		return true;
+	}
+
+	// Count the depth frames of the recording
+	int nFrames = 0;
+	while (ofFile::doesFileExist(framePath("depth", nFrames), false))
+		nFrames++;
+	if (nFrames == 0)
+	{
+		ofLogError("ReplayDepthSource") << "setup(): No depth frames found in " << path;
+		return false;
+	}
+
+	// Read the time stamps if available - default to 30 fps otherwise
+	std::string timestampsFile = ofToDataPath(path + "/timestamps.txt");
+	if (ofFile::doesFileExist(timestampsFile, false))
+	{
+		std::ifstream fist(timestampsFile.c_str());
+		uint64_t ts;
+		while ((int)timestamps.size() < nFrames && fist >> ts)
+			timestamps.push_back(ts);
+	}
+	if ((int)timestamps.size() < nFrames)
+	{
+		ofLogVerbose("ReplayDepthSource") << "setup(): Missing time stamps - replaying at 30 fps";
+		timestamps.clear();
+		for (int i = 0; i < nFrames; i++)
+			timestamps.push_back((uint64_t)i * 1000000 / 30);
+	}
+
+	if (!loadFrame(0))
+		return false;
+	width = depthPixels.getWidth();
+	height = depthPixels.getHeight();
+	currentFrame = -1;
+	ofLogVerbose("ReplayDepthSource") << "setup(): " << nFrames << " frames of " << width << "x" << height << " in " << path;
+	return true;
+}
+
+bool ReplayDepthSource::open(){
+	opened = !timestamps.empty();
+	currentFrame = -1;
+	finished = false;
+	replayStartTime = 0;
+	return opened;
+}
+
+void ReplayDepthSource::close(){
+	opened = false;
+}
+
+bool ReplayDepthSource::isOpen(){
+	return opened;
+}
+
+bool ReplayDepthSource::loadFrame(int frame){
+	if (useRecordingFile)
+	{
+		// The raw frames are wrapped in the mapped recording without copy
+		if (!recording.getDepth(frame, depthPixels))
+		{
+			ofLogError("ReplayDepthSource") << "loadFrame(): Could not read depth frame " << frame;
+			return false;
+		}
+		if (colorEnabled && !recording.getColor(frame, colorPixels))
+		{
+			// The pixels may still wrap the color of a previous frame in the mapped recording
+			if (recording.isMapped(colorPixels.getData()))
+				colorPixels.clear();
+			if (colorPixels.getWidth() != width || colorPixels.getHeight() != height)
+				colorPixels.allocate(width, height, OF_IMAGE_COLOR);
+			colorPixels.set(0);
+		}
+		return true;
+	}
+	if (!ofLoadImage(depthPixels, framePath("depth", frame)))
+	{
+		ofLogError("ReplayDepthSource") << "loadFrame(): Could not read depth frame " << frame;
+		return false;
+	}
+	if (!colorEnabled)
+		return true;
+	std::string colorFile = framePath("color", frame);
+	if (!ofFile::doesFileExist(colorFile, false) || !ofLoadImage(colorPixels, colorFile))
+	{
+		// No color recorded: keep a black image so the grabber always gets a valid color frame
+		if (colorPixels.getWidth() != depthPixels.getWidth() || colorPixels.getHeight() != depthPixels.getHeight())
+			colorPixels.allocate(depthPixels.getWidth(), depthPixels.getHeight(), OF_IMAGE_COLOR);
+		colorPixels.set(0);
+	}
+	return true;
+}
+
+void ReplayDepthSource::update(){
+	frameNew = false;
+	if (!opened || finished)
+		return;
+
+	int nextFrame = currentFrame + 1;
+	if (mode == REPLAY_MODE_STEP)
+	{
+		if (requestedSteps <= 0)
+		{
+			ofSleepMillis(1);
+			return;
+		}
+		requestedSteps--;
+	}
+	else if (mode == REPLAY_MODE_REALTIME)
+	{
+		uint64_t now = ofGetElapsedTimeMicros();
+		if (nextFrame == 0)
+			replayStartTime = now;
+		uint64_t dueTime = replayStartTime + timestamps[nextFrame] - timestamps[0];
+		if (now < dueTime)
+		{
+			// Wait for the frame without blocking the grabber actions for too long
+			uint64_t wait = std::min<uint64_t>(dueTime - now, 5000);
+			ofSleepMillis(std::max<int>(1, (int)(wait / 1000)));
+			return;
+		}
+		// Drop the frames that are already late like a real sensor would do
+		while (nextFrame + 1 < (int)timestamps.size() && replayStartTime + timestamps[nextFrame + 1] - timestamps[0] <= now)
+			nextFrame++;
+	}
+
+	if (!loadFrame(nextFrame))
+	{
+		finished = true;
+		return;
+	}
+	currentFrame = nextFrame;
+	frameNew = true;
+
+	if (currentFrame + 1 >= (int)timestamps.size())
+	{
+		if (loop)
+			currentFrame = -1; // Restart from the first frame at next update
+		else
+			finished = true;
+	}
+}
+
+bool ReplayDepthSource::isFrameNew(){
+	return frameNew;
+}
+
+ofShortPixels& ReplayDepthSource::getRawDepthPixels(){
+	return depthPixels;
+}
+
+ofPixels& ReplayDepthSource::getColorPixels(){
+	return colorPixels;
+}
+
+uint64_t ReplayDepthSource::getTimestamp(){
+	if (currentFrame < 0)
+		return timestamps.empty() ? 0 : timestamps.back();
+	return timestamps[currentFrame];
+}
+
+unsigned int ReplayDepthSource::getWidth(){
+	return width;
+}
+
+unsigned int ReplayDepthSource::getHeight(){
+	return height;
+}
+
+ofVec3f ReplayDepthSource::getWorldCoordinateAt(int x, int y, float z){
+	if (useRecordingFile)
+		return recording.getWorldCoordinateAt(x, y, z);
+	// Registered Kinect v1 intrinsics as used by libfreenect:
+	// 2 * reference pixel size (0.1042mm) / reference distance (120mm)
+	const float factor = 2.0f * 0.1042f / 120.0f;
+	return ofVec3f((x - width / 2.0f) * factor * z, (y - height / 2.0f) * factor * z, z);
+}
+
+void ReplayDepthSource::step(){
+	requestedSteps++;
+}
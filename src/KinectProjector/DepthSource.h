@@ -0,0 +1,179 @@
+/***********************************************************************
+DepthSource - Source of raw depth and color frames for the KinectGrabber.
+Either a live Kinect or a replay of a recorded session.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include "ofMain.h"
+#include "ofxKinect.h"
+
+#include "DepthRecording.h"
+
+//! Abstract source of depth and color frames
+/** The grabber thread calls update() in its loop and fetches the frame
+    when isFrameNew() is true. All functions are called from the grabber thread
+    except setup() and getWidth()/getHeight() that are called before the thread starts.*/
+class DepthSource {
+public:
+	virtual ~DepthSource() {}
+
+	virtual bool setup() = 0; // Initialise the source - width and height are valid afterwards
+	virtual bool open() = 0;
+	virtual void close() = 0;
+	virtual bool isOpen() = 0;
+
+	virtual void update() = 0;
+	virtual bool isFrameNew() = 0;
+
+	virtual ofShortPixels& getRawDepthPixels() = 0;
+	virtual ofPixels& getColorPixels() = 0;
+
+	// Time stamp of the current frame in microseconds
+	virtual uint64_t getTimestamp() = 0;
+
+	virtual unsigned int getWidth() = 0;
+	virtual unsigned int getHeight() = 0;
+
+	// World coordinates of a kinect pixel at depth z (used to compute the kinect world matrix)
+	virtual ofVec3f getWorldCoordinateAt(int x, int y, float z) = 0;
+
+	// Request the next frame when replaying in frame-stepped mode
+	virtual void step() {}
+
+	// Stop or restart the color stream - the color pixels are not updated while it is disabled
+	// Returns false if the device was lost while switching the stream
+	virtual bool setColorEnabled(bool enabled) {
+		return true;
+	}
+	// False after a restart until the first color frame arrives
+	virtual bool isColorReady() {
+		return true;
+	}
+};
+
+//! Live Kinect (v1) source using ofxKinect
+class KinectDepthSource : public DepthSource {
+public:
+	KinectDepthSource();
+
+	bool setup() override;
+	bool open() override;
+	void close() override;
+	bool isOpen() override;
+
+	void update() override;
+	bool isFrameNew() override;
+
+	ofShortPixels& getRawDepthPixels() override;
+	ofPixels& getColorPixels() override;
+	uint64_t getTimestamp() override;
+
+	unsigned int getWidth() override;
+	unsigned int getHeight() override;
+	ofVec3f getWorldCoordinateAt(int x, int y, float z) override;
+
+	bool setColorEnabled(bool enabled) override;
+	bool isColorReady() override {
+		return colorReady;
+	}
+
+private:
+	ofxKinect kinect;
+	bool opened;
+	uint64_t timestamp;
+	bool colorEnabled;
+	bool colorReady;
+};
+
+//! Replay of a recorded session
+/** A recording is either a recording file (.msd) written by the DepthRecorder or
+    a folder holding 16 bits depth images depth_000000.png, depth_000001.png...,
+    optional color images color_000000.png... and an optional timestamps.txt file holding
+    the time stamp in microseconds of each frame (one per line). Without time stamps the frames are
+    replayed at 30 fps.*/
+class ReplayDepthSource : public DepthSource {
+public:
+	enum Replay_mode
+	{
+		REPLAY_MODE_REALTIME, // Frames are delivered at their original time stamps
+		REPLAY_MODE_FAST,     // Frames are delivered as fast as they can be read
+		REPLAY_MODE_STEP      // A frame is delivered each time step() is called
+	};
+
+	ReplayDepthSource(std::string spath, Replay_mode smode, bool sloop = true);
+
+	bool setup() override;
+	bool open() override;
+	void close() override;
+	bool isOpen() override;
+
+	void update() override;
+	bool isFrameNew() override;
+
+	ofShortPixels& getRawDepthPixels() override;
+	ofPixels& getColorPixels() override;
+	uint64_t getTimestamp() override;
+
+	unsigned int getWidth() override;
+	unsigned int getHeight() override;
+	ofVec3f getWorldCoordinateAt(int x, int y, float z) override;
+
+	void step() override;
+	bool setColorEnabled(bool enabled) override {
+		colorEnabled = enabled;
+		return true;
+	}
+
+	int getNumFrames(){
+		return timestamps.size();
+	}
+	int getCurrentFrame(){
+		return currentFrame;
+	}
+	bool isFinished(){
+		return finished;
+	}
+
+	static Replay_mode modeFromString(std::string smode);
+
+private:
+	bool loadFrame(int frame);
+	std::string framePath(std::string prefix, int frame);
+
+	std::string path;
+	Replay_mode mode;
+	bool loop;
+	bool opened;
+	bool frameNew;
+	bool finished;
+	bool colorEnabled; // The color images are not read while disabled
+
+	unsigned int width, height;
+	std::vector<uint64_t> timestamps;
+	int currentFrame;
+	uint64_t replayStartTime; // Wall clock time of the first frame of the current loop
+	std::atomic<int> requestedSteps;
+
+	bool useRecordingFile;
+	DepthRecordingReader recording;
+
+	ofShortPixels depthPixels;
+	ofPixels colorPixels;
+};
@@ -0,0 +1,170 @@
+/***********************************************************************
+DepthTextureStreamer - Asynchronous upload of the changed regions of the
+filtered depth to the texture read by the sandbox shaders.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "DepthTextureStreamer.h"
+
+DepthTextureStreamer::DepthTextureStreamer()
+:currentBuffer(0),
+width(0),
+height(0),
+use16Bit(false),
+bytesPerPixel(4),
+glFormat(0),
+glType(0),
+scaleMin(0),
+invScale(1),
+uploadedBytes(0)
+{
+}
+
+void DepthTextureStreamer::allocate(int swidth, int sheight, bool suse16Bit){
+	width = swidth;
+	height = sheight;
+	use16Bit = suse16Bit;
+	bytesPerPixel = use16Bit ? 2 : 4;
+	glType = use16Bit ? GL_UNSIGNED_SHORT : GL_FLOAT;
+	int glInternalFormat;
+	if (ofIsGLProgrammableRenderer())
+		glInternalFormat = use16Bit ? GL_R16 : GL_R32F;
+	else
+		glInternalFormat = use16Bit ? GL_LUMINANCE16 : GL_LUMINANCE32F_ARB;
+	glFormat = ofGetGLFormatFromInternal(glInternalFormat);
+
+	texture.allocate(width, height, glInternalFormat);
+	// The texels outside the uploaded rectangles start at 0
+	if (use16Bit)
+	{
+		std::vector<unsigned short> zeros(width*height, 0);
+		texture.loadData(zeros.data(), width, height, glFormat);
+	}
+	else
+	{
+		std::vector<float> zeros(width*height, 0);
+		texture.loadData(zeros.data(), width, height, glFormat);
+	}
+	for (auto & buffer : buffers)
+		buffer.allocate(width*height*bytesPerPixel, GL_STREAM_DRAW);
+	currentBuffer = 0;
+	ofLogVerbose("DepthTextureStreamer") << "allocate(): " << width << "x" << height << (use16Bit ? " 16 bit" : " 32 bit float") << " depth texture";
+}
+
+void DepthTextureStreamer::setNativeScale(float sscaleMin, float scaleMax){
+	scaleMin = sscaleMin;
+	invScale = scaleMax != scaleMin ? 1.0f / (scaleMax - scaleMin) : 1.0f;
+}
+
+void DepthTextureStreamer::upload(const float* depth, ofRectangle rect){
+	upload(depth, std::vector<ofRectangle>(1, rect));
+}
+
+void DepthTextureStreamer::upload(const float* depth){
+	upload(depth, ofRectangle(0, 0, width, height));
+}
+
+void DepthTextureStreamer::upload(const float* depth, const std::vector<ofRectangle>& rects){
+	uploadedBytes = 0;
+	if (!isAllocated())
+		return;
+
+	// Rectangles clipped to the frame in whole pixels, packed one after the other in the buffer
+	uploadRects.clear();
+	uploadOffsets.clear();
+	size_t bytes = 0;
+	for (auto & rect : rects)
+	{
+		int x0 = max(0, (int)floor(rect.getLeft()));
+		int y0 = max(0, (int)floor(rect.getTop()));
+		int x1 = min(width, (int)ceil(rect.getRight()));
+		int y1 = min(height, (int)ceil(rect.getBottom()));
+		if (x1 <= x0 || y1 <= y0)
+			continue;
+		uploadRects.push_back(ofRectangle(x0, y0, x1 - x0, y1 - y0));
+		uploadOffsets.push_back(bytes);
+		bytes += (size_t)(x1 - x0)*(y1 - y0)*bytesPerPixel;
+	}
+	if (uploadRects.empty())
+		return;
+	if (bytes > (size_t)width*height*bytesPerPixel)
+	{
+		// Overlapping rectangles: the whole frame is smaller
+		uploadRects.assign(1, ofRectangle(0, 0, width, height));
+		uploadOffsets.assign(1, 0);
+		bytes = (size_t)width*height*bytesPerPixel;
+	}
+
+	// The other buffer may still be read by the previous transfer
+	ofBufferObject& buffer = buffers[currentBuffer];
+	currentBuffer = 1 - currentBuffer;
+	unsigned char* data = buffer.map<unsigned char>(GL_WRITE_ONLY);
+	if (data == nullptr)
+	{
+		ofLogVerbose("DepthTextureStreamer") << "upload(): Could not map the pixel buffer";
+		return;
+	}
+	for (size_t i = 0; i < uploadRects.size(); i++)
+		convertRect(depth, uploadRects[i], data + uploadOffsets[i]);
+	buffer.unmap();
+
+	// The copies read from the bound buffer at the offsets of the rectangles and return immediately
+	const ofTextureData& textureData = texture.getTextureData();
+	buffer.bind(GL_PIXEL_UNPACK_BUFFER);
+	glBindTexture(textureData.textureTarget, textureData.textureID);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (size_t i = 0; i < uploadRects.size(); i++)
+	{
+		const ofRectangle& rect = uploadRects[i];
+		glTexSubImage2D(textureData.textureTarget, 0, (GLint)rect.x, (GLint)rect.y, (GLsizei)rect.width, (GLsizei)rect.height,
+			glFormat, glType, reinterpret_cast<const GLvoid*>(uploadOffsets[i]));
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(textureData.textureTarget, 0);
+	buffer.unbind(GL_PIXEL_UNPACK_BUFFER);
+	uploadedBytes = bytes;
+}
+
+// Rows of a rectangle normalized to the native scale
+void DepthTextureStreamer::convertRect(const float* depth, const ofRectangle& rect, unsigned char* out) const {
+	int x0 = (int)rect.x;
+	int y0 = (int)rect.y;
+	int w = (int)rect.width;
+	int h = (int)rect.height;
+	if (use16Bit)
+	{
+		unsigned short* dst = reinterpret_cast<unsigned short*>(out);
+		for (int y = y0; y < y0 + h; y++)
+		{
+			const float* src = depth + y*width + x0;
+			for (int x = 0; x < w; x++)
+				*dst++ = (unsigned short)(ofClamp((src[x] - scaleMin)*invScale, 0, 1)*65535.0f + 0.5f);
+		}
+	}
+	else
+	{
+		float* dst = reinterpret_cast<float*>(out);
+		for (int y = y0; y < y0 + h; y++)
+		{
+			const float* src = depth + y*width + x0;
+			for (int x = 0; x < w; x++)
+				*dst++ = (src[x] - scaleMin)*invScale;
+		}
+	}
+}
@@ -0,0 +1,78 @@
+/***********************************************************************
+DepthTextureStreamer - Asynchronous upload of the changed regions of the
+filtered depth to the texture read by the sandbox shaders.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <vector>
+
+#include "ofMain.h"
+
+//! Depth texture updated through two pixel buffer objects
+/** The texture holds the depth normalized to 0..1 between the native scale bounds, which
+    the depthTransformation uniform of the shaders decodes. Only the given rectangles are
+    converted into the current pixel buffer and copied to the texture: the copy is queued
+    on the GPU and the next upload writes into the other buffer, so the main thread does
+    not wait for the transfer. The texture is either 32 bit float or 16 bit normalized,
+    which halves the bandwidth; the depths outside the native scale are then clamped.*/
+class DepthTextureStreamer {
+public:
+	DepthTextureStreamer();
+
+	void allocate(int width, int height, bool use16Bit);
+	bool isAllocated() const {
+		return width > 0;
+	}
+	bool is16Bit() const {
+		return use16Bit;
+	}
+
+	// Depths stored as 0 and 1 in the texture - the texture must be uploaded again
+	void setNativeScale(float scaleMin, float scaleMax);
+
+	// Upload the rectangles (in kinect pixels) of a depth frame in millimeters
+	void upload(const float* depth, const std::vector<ofRectangle>& rects);
+	void upload(const float* depth, ofRectangle rect);
+	// Upload the whole frame - after an allocation or a change of the native scale
+	void upload(const float* depth);
+
+	ofTexture& getTexture(){
+		return texture;
+	}
+	// Bytes sent to the texture by the last upload
+	size_t getUploadedBytes() const {
+		return uploadedBytes;
+	}
+
+private:
+	void convertRect(const float* depth, const ofRectangle& rect, unsigned char* out) const;
+
+	ofTexture texture;
+	ofBufferObject buffers[2];
+	int currentBuffer;
+	int width, height;
+	bool use16Bit;
+	int bytesPerPixel;
+	int glFormat, glType;
+	float scaleMin, invScale;
+	std::vector<ofRectangle> uploadRects; // Reused between uploads
+	std::vector<size_t> uploadOffsets;
+	size_t uploadedBytes;
+};
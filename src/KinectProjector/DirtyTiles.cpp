@@ -0,0 +1,161 @@
+/***********************************************************************
+DirtyTiles - Tiles of the filtered depth frame that changed since a
+previous frame, to update the downstream stages incrementally.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "DirtyTiles.h"
+
+DirtyTiles::DirtyTiles()
+:tileSize(0),
+cols(0),
+rows(0),
+width(0),
+height(0),
+lastAnyChange(0),
+numDirtyTiles(0)
+{
+}
+
+void DirtyTiles::getRectsSince(uint64_t sinceFrameId, std::vector<ofRectangle>& sinceRects) const {
+	std::vector<unsigned char> since(cols*rows);
+	for (int i = 0; i < cols*rows; i++)
+		since[i] = lastChange[i] > sinceFrameId;
+	buildRects(since, sinceRects);
+}
+
+bool DirtyTiles::hasChangedSince(uint64_t sinceFrameId) const {
+	return lastAnyChange > sinceFrameId;
+}
+
+// Merge the runs of dirty tiles of each tile row, then the runs with the same extent in consecutive rows
+void DirtyTiles::buildRects(const std::vector<unsigned char>& tiles, std::vector<ofRectangle>& tileRects) const {
+	tileRects.clear();
+	std::vector<int> open; // Rectangles ending on the previous tile row
+	std::vector<int> current;
+	for (int row = 0; row < rows; row++)
+	{
+		current.clear();
+		int col = 0;
+		while (col < cols)
+		{
+			if (!tiles[row*cols + col])
+			{
+				col++;
+				continue;
+			}
+			int start = col;
+			while (col < cols && tiles[row*cols + col])
+				col++;
+			float x = start*tileSize;
+			float w = min(col*tileSize, width) - x;
+			float y = row*tileSize;
+			float h = min((row + 1)*tileSize, height) - y;
+			// Extend the run of the previous row with the same extent if there is one
+			int merged = -1;
+			for (int i : open)
+			{
+				if (tileRects[i].x == x && tileRects[i].width == w)
+				{
+					merged = i;
+					break;
+				}
+			}
+			if (merged >= 0)
+			{
+				tileRects[merged].height = y + h - tileRects[merged].y;
+				current.push_back(merged);
+			}
+			else
+			{
+				tileRects.push_back(ofRectangle(x, y, w, h));
+				current.push_back(tileRects.size() - 1);
+			}
+		}
+		open.swap(current);
+	}
+}
+
+DirtyTileTracker::DirtyTileTracker()
+:invalidated(true)
+{
+}
+
+void DirtyTileTracker::setup(int width, int height, int tileSize){
+	tiles.tileSize = tileSize;
+	tiles.width = width;
+	tiles.height = height;
+	tiles.cols = (width + tileSize - 1)/tileSize;
+	tiles.rows = (height + tileSize - 1)/tileSize;
+	tiles.dirty.assign(tiles.cols*tiles.rows, 0);
+	tiles.lastChange.assign(tiles.cols*tiles.rows, 0);
+	reference.assign(width*height, 0.0f);
+	invalidated = true;
+}
+
+void DirtyTileTracker::invalidate(){
+	invalidated = true;
+}
+
+void DirtyTileTracker::update(const float* frame, float threshold, uint64_t frameId, WorkerPool& workers){
+	const int width = tiles.width;
+	const int height = tiles.height;
+	const int tileSize = tiles.tileSize;
+	const bool all = invalidated;
+	invalidated = false;
+
+	// One band per row of tiles
+	workers.parallelFor(0, tiles.rows, 1, [&](int row0, int row1, int /*band*/) {
+		for (int row = row0; row < row1; row++)
+		{
+			int y0 = row*tileSize;
+			int y1 = min(y0 + tileSize, height);
+			for (int col = 0; col < tiles.cols; col++)
+			{
+				int x0 = col*tileSize;
+				int x1 = min(x0 + tileSize, width);
+				bool changed = all;
+				for (int y = y0; y < y1 && !changed; y++)
+				{
+					const float* framePtr = frame + y*width;
+					const float* refPtr = &reference[y*width];
+					// No early exit in the row so the comparison vectorizes
+					for (int x = x0; x < x1; x++)
+						changed |= fabs(framePtr[x] - refPtr[x]) > threshold;
+				}
+				tiles.dirty[row*tiles.cols + col] = changed;
+				if (changed)
+				{
+					tiles.lastChange[row*tiles.cols + col] = frameId;
+					for (int y = y0; y < y1; y++)
+						std::copy(frame + y*width + x0, frame + y*width + x1, &reference[y*width + x0]);
+				}
+			}
+		}
+	});
+
+	tiles.numDirtyTiles = std::count(tiles.dirty.begin(), tiles.dirty.end(), 1);
+	if (tiles.numDirtyTiles > 0)
+		tiles.lastAnyChange = frameId;
+	tiles.buildRects(tiles.dirty, tiles.rects);
+}
+
+void DirtyTileTracker::publish(DirtyTiles& out) const {
+	out = tiles;
+}
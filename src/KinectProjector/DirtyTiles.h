@@ -0,0 +1,107 @@
+/***********************************************************************
+DirtyTiles - Tiles of the filtered depth frame that changed since a
+previous frame, to update the downstream stages incrementally.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "ofMain.h"
+#include "WorkerPool.h"
+
+//! Changed tiles published with a filtered depth frame
+/** The frame is divided in tiles of tileSize x tileSize pixels. A tile is dirty if one
+    of its pixels changed by more than the threshold since the tile last changed, so
+    slow drifts are reported once they accumulate. The bitmap and the rectangles cover
+    the changes since the previous published frame. A consumer that missed frames gets
+    the changes since the last frame it processed with getRectsSince().*/
+class DirtyTiles {
+public:
+	DirtyTiles();
+
+	int getTileSize() const {
+		return tileSize;
+	}
+	int getCols() const {
+		return cols;
+	}
+	int getRows() const {
+		return rows;
+	}
+	bool isDirty(int col, int row) const {
+		return dirty[row*cols + col] != 0;
+	}
+	// No tile changed since the previous published frame
+	bool isStatic() const {
+		return rects.empty();
+	}
+	// Dirty tiles merged in rectangles of kinect pixels
+	const std::vector<ofRectangle>& getRects() const {
+		return rects;
+	}
+	int getNumDirtyTiles() const {
+		return numDirtyTiles;
+	}
+
+	// Rectangles of the tiles changed in the frames published after sinceFrameId
+	void getRectsSince(uint64_t sinceFrameId, std::vector<ofRectangle>& sinceRects) const;
+	bool hasChangedSince(uint64_t sinceFrameId) const;
+
+private:
+	friend class DirtyTileTracker;
+
+	void buildRects(const std::vector<unsigned char>& tiles, std::vector<ofRectangle>& tileRects) const;
+
+	int tileSize, cols, rows;
+	int width, height;
+	std::vector<unsigned char> dirty; // 1 for the tiles changed in this frame
+	std::vector<uint64_t> lastChange; // Id of the frame where each tile last changed
+	uint64_t lastAnyChange; // Id of the last frame where any tile changed
+	std::vector<ofRectangle> rects;
+	int numDirtyTiles;
+};
+
+//! Change detection run by the grabber thread on each filtered frame
+/** Each tile is compared with a reference copy of the frame taken the last time the tile
+    was dirty. Tile rows are processed in parallel. The scan of a tile stops after the first
+    pixel row holding a change: each row is compared without branches so it vectorizes.*/
+class DirtyTileTracker {
+public:
+	DirtyTileTracker();
+
+	void setup(int width, int height, int tileSize);
+	// Report every tile as dirty in the next frame (after a reset of the filter or a ROI change)
+	void invalidate();
+
+	void update(const float* frame, float threshold, uint64_t frameId, WorkerPool& workers);
+
+	// Copy the state to a published frame - the buffers of the frame are reused
+	void publish(DirtyTiles& out) const;
+
+	int getNumDirtyTiles() const {
+		return tiles.numDirtyTiles;
+	}
+
+private:
+	DirtyTiles tiles;
+	std::vector<float> reference;
+	bool invalidated;
+};
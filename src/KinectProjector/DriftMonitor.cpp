@@ -0,0 +1,259 @@
+/***********************************************************************
+DriftMonitor - Background estimation of the displacement of the
+sandbox relative to the kinect while the application is running.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "DriftMonitor.h"
+
+#ifndef TARGET_WIN32
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Width of the band around the ROI holding the wall tops
+static const int wallBand = 24;
+// One pixel out of wallSampleStep x wallSampleStep is used for the wall plane
+static const int wallSampleStep = 2;
+// Rows or columns averaged in the depth profiles across the borders
+static const int edgeSampleStep = 4;
+// Search range of the wall edges around the ROI borders
+static const int edgeSearchRange = 16;
+// The depth step of an edge is measured between the edgeHalfWidth pixels on each side
+static const int edgeHalfWidth = 2;
+static const float minWallStep = 15; // Millimeters
+
+DriftMonitor::DriftMonitor()
+:busy(false),
+hasReference(false),
+referenceWallPlane(false),
+referenceWalls(false)
+{
+	planeEstimator.setNumThreads(1);
+	planeEstimator.setRansac(true, 128, 10);
+}
+
+DriftMonitor::~DriftMonitor(){
+	stop();
+}
+
+void DriftMonitor::start(){
+	startThread(true);
+}
+
+void DriftMonitor::stop(){
+	requests.close();
+	reports.close();
+	waitForThread(true);
+}
+
+bool DriftMonitor::request(DriftRequest& frame){
+	bool expected = false;
+	if (!busy.compare_exchange_strong(expected, true))
+		return false;
+	requests.send(std::move(frame));
+	return true;
+}
+
+bool DriftMonitor::getReport(DriftReport& report){
+	return reports.tryReceive(report);
+}
+
+void DriftMonitor::threadedFunction(){
+	// The analysis must never delay the grabber or the rendering
+#ifdef TARGET_WIN32
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(TARGET_LINUX)
+	sched_param param;
+	param.sched_priority = 0;
+	if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+		ofLogVerbose("DriftMonitor") << "threadedFunction(): Could not lower the thread priority";
+#else
+	sched_param param;
+	param.sched_priority = sched_get_priority_min(SCHED_OTHER);
+	if (pthread_setschedparam(pthread_self(), SCHED_OTHER, &param) != 0)
+		ofLogVerbose("DriftMonitor") << "threadedFunction(): Could not lower the thread priority";
+#endif
+	DriftRequest frame;
+	while (requests.receive(frame))
+	{
+		DriftReport report;
+		analyse(frame, report);
+		reports.send(std::move(report));
+		busy = false;
+	}
+}
+
+void DriftMonitor::analyse(const DriftRequest& frame, DriftReport& report){
+	uint64_t start = ofGetElapsedTimeMicros();
+	report.reference = false;
+	report.wallPlaneFound = false;
+	report.angle = 0;
+	report.offset = 0;
+	report.basePlane = frame.basePlane;
+	report.wallsFound = false;
+	report.ROIShift = ofVec2f(0, 0);
+
+	ofVec4f wallPlane;
+	bool wallPlaneFound = findWallPlane(frame, wallPlane);
+	float edges[4];
+	bool wallsFound = findWallEdges(frame, edges);
+	float borders[4] = {frame.ROI.getLeft(), frame.ROI.getRight(), frame.ROI.getTop(), frame.ROI.getBottom()};
+
+	if (frame.resetReference || !hasReference)
+	{
+		hasReference = true;
+		report.reference = true;
+		referenceWallPlane = wallPlaneFound;
+		wallPlane0 = wallPlane;
+		basePlane0 = frame.basePlane;
+		referenceWalls = wallsFound;
+		for (int i = 0; i < 4; i++)
+			edges0[i] = edges[i] - borders[i];
+		ofLogVerbose("DriftMonitor") << "analyse(): New reference - wall plane found: " << wallPlaneFound << " walls found: " << wallsFound;
+	}
+
+	if (referenceWallPlane && wallPlaneFound)
+	{
+		ofVec3f n0(wallPlane0.x, wallPlane0.y, wallPlane0.z);
+		ofVec3f n1(wallPlane.x, wallPlane.y, wallPlane.z);
+		if (n0.dot(n1) < 0)
+		{
+			n1 = n1*-1;
+			wallPlane.w = -wallPlane.w;
+		}
+		report.wallPlaneFound = true;
+		report.angle = ofRadToDeg(acos(ofClamp(n0.dot(n1), -1, 1)));
+
+		// The offset is measured below the center of the ROI, where the rotation moves the sand the least
+		ofVec4f ray4 = frame.worldMatrix*ofVec4f(frame.ROI.getCenter().x, frame.ROI.getCenter().y, 1, 1);
+		ofVec3f ray(ray4.x, ray4.y, ray4.z);
+		ofVec3f wallPoint = ray*(-wallPlane0.w / n0.dot(ray));
+		report.offset = -(n1.dot(wallPoint) + wallPlane.w);
+
+		// First order: the base plane turns like the wall tops around its point below the center of the ROI
+		ofVec3f b0(basePlane0.x, basePlane0.y, basePlane0.z);
+		ofVec3f basePoint = ray*(-basePlane0.w / b0.dot(ray));
+		ofVec3f normal = b0 + (n1 - n0);
+		normal.normalize();
+		report.basePlane = ofVec4f(normal.x, normal.y, normal.z, -normal.dot(basePoint) - report.offset);
+	}
+
+	if (referenceWalls && wallsFound)
+	{
+		report.wallsFound = true;
+		float shift[4];
+		for (int i = 0; i < 4; i++)
+			shift[i] = edges[i] - borders[i] - edges0[i];
+		report.ROIShift = ofVec2f((shift[0] + shift[1]) / 2, (shift[2] + shift[3]) / 2);
+	}
+	report.duration = (ofGetElapsedTimeMicros() - start) / 1000.0f;
+}
+
+// RANSAC fit on the band around the ROI - the sand inside the ROI is excluded
+bool DriftMonitor::findWallPlane(const DriftRequest& frame, ofVec4f& plane){
+	int width = frame.depth.getWidth();
+	int height = frame.depth.getHeight();
+	floatDepth.allocate(width, height, 1);
+	const unsigned short* raw = frame.depth.getData();
+	float* depth = floatDepth.getData();
+	for (int i = 0; i < width*height; i++)
+		depth[i] = raw[i];
+
+	ofRectangle band = frame.ROI;
+	band.x -= wallBand;
+	band.y -= wallBand;
+	band.width += 2*wallBand;
+	band.height += 2*wallBand;
+	planeEstimator.setSampling(wallSampleStep, frame.ROI);
+	return planeEstimator.estimate(depth, width, height, band, frame.worldMatrix, plane);
+}
+
+bool DriftMonitor::findWallEdges(const DriftRequest& frame, float edges[4]){
+	int left = static_cast<int>(frame.ROI.getLeft());
+	int right = static_cast<int>(frame.ROI.getRight());
+	int top = static_cast<int>(frame.ROI.getTop());
+	int bottom = static_cast<int>(frame.ROI.getBottom());
+	// Profiles across the middle half of each border so the corners do not blur the edges
+	int x0 = left + (right - left)/4;
+	int x1 = right - (right - left)/4;
+	int y0 = top + (bottom - top)/4;
+	int y1 = bottom - (bottom - top)/4;
+	// The walls are closer to the kinect than the sand: the depth increases when entering the ROI
+	return findEdge(frame.depth, left - edgeSearchRange, left + edgeSearchRange, y0, y1, true, true, edges[0]) &&
+		findEdge(frame.depth, right - edgeSearchRange, right + edgeSearchRange, y0, y1, true, false, edges[1]) &&
+		findEdge(frame.depth, top - edgeSearchRange, top + edgeSearchRange, x0, x1, false, true, edges[2]) &&
+		findEdge(frame.depth, bottom - edgeSearchRange, bottom + edgeSearchRange, x0, x1, false, false, edges[3]);
+}
+
+// Border in [from, to] between the pixels with the largest difference of mean depth on each side, the
+// profile being averaged over [across0, across1[ - vertical edges have a profile along x
+bool DriftMonitor::findEdge(const ofShortPixels& depth, int from, int to, int across0, int across1, bool vertical, bool increasing, float& position){
+	int width = depth.getWidth();
+	int length = vertical ? width : depth.getHeight();
+	from = max(from, edgeHalfWidth);
+	to = min(to, length - 1 - edgeHalfWidth);
+	if (to < from || across1 <= across0)
+		return false;
+
+	int first = from - edgeHalfWidth;
+	int size = to - from + 1 + 2*edgeHalfWidth;
+	profile.assign(size, 0);
+	profileCount.assign(size, 0);
+	const unsigned short* data = depth.getData();
+	for (int a = across0; a < across1; a += edgeSampleStep)
+		for (int i = 0; i < size; i++)
+		{
+			unsigned short value = vertical ? data[a*width + first + i] : data[(first + i)*width + a];
+			if (value != 0)
+			{
+				profile[i] += value;
+				profileCount[i]++;
+			}
+		}
+	for (int i = 0; i < size; i++)
+		if (profileCount[i] > 0)
+			profile[i] /= profileCount[i];
+
+	float bestStep = minWallStep;
+	bool found = false;
+	for (int i = edgeHalfWidth; i <= size - edgeHalfWidth; i++)
+	{
+		// Mean of the edgeHalfWidth pixels after the border minus the mean of those before it
+		float step = 0;
+		bool valid = true;
+		for (int k = 0; k < edgeHalfWidth; k++)
+		{
+			valid = valid && profileCount[i + k] > 0 && profileCount[i - 1 - k] > 0;
+			step += profile[i + k] - profile[i - 1 - k];
+		}
+		if (!valid)
+			continue;
+		step /= edgeHalfWidth;
+		if (!increasing)
+			step = -step;
+		if (step > bestStep)
+		{
+			bestStep = step;
+			position = first + i;
+			found = true;
+		}
+	}
+	return found;
+}
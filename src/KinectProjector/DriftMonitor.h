@@ -0,0 +1,94 @@
+/***********************************************************************
+DriftMonitor - Background estimation of the displacement of the
+sandbox relative to the kinect while the application is running.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <atomic>
+
+#include "ofMain.h"
+#include "PlaneEstimator.h"
+
+// Raw depth frame to analyse with the current calibration
+struct DriftRequest {
+	ofShortPixels depth;
+	ofRectangle ROI;
+	ofVec4f basePlane; // Current base plane equation
+	ofMatrix4x4 worldMatrix;
+	bool resetReference; // The calibration changed: the frame becomes the reference
+};
+
+// Displacement of the sandbox walls since the reference frame
+struct DriftReport {
+	bool reference; // The frame was taken as the reference
+	bool wallPlaneFound;
+	float angle; // Rotation of the plane of the wall tops in degrees
+	float offset; // Displacement of the wall tops along the base plane normal in millimeters
+	ofVec4f basePlane; // Reference base plane moved like the wall tops
+	bool wallsFound;
+	ofVec2f ROIShift; // Displacement of the inner edges of the walls in kinect pixels
+	float duration; // Milliseconds spent on the analysis
+};
+
+//! Low priority thread measuring the drift of the sandbox
+/** The sand changes all the time so the drift is measured on the walls, which only move
+    when the sandbox is bumped or the kinect mount sags. A plane is fitted to a decimated
+    sample of the band around the ROI and the inner edges of the walls are located on the
+    depth profiles across the ROI borders. Both are compared with the reference frame
+    taken after the last calibration. One frame is analysed at a time on a single thread:
+    request() refuses new frames while an analysis is running.*/
+class DriftMonitor: public ofThread {
+public:
+	DriftMonitor();
+	~DriftMonitor();
+
+	void start();
+	void stop();
+
+	bool isBusy(){
+		return busy;
+	}
+	bool request(DriftRequest& frame); // Takes the content of the frame - false if busy
+	bool getReport(DriftReport& report); // True if a new report is available
+
+private:
+	void threadedFunction() override;
+	void analyse(const DriftRequest& frame, DriftReport& report);
+	bool findWallPlane(const DriftRequest& frame, ofVec4f& plane);
+	bool findWallEdges(const DriftRequest& frame, float edges[4]); // Left, right, top and bottom
+	bool findEdge(const ofShortPixels& depth, int from, int to, int across0, int across1, bool vertical, bool increasing, float& position);
+
+	ofThreadChannel<DriftRequest> requests;
+	ofThreadChannel<DriftReport> reports;
+	std::atomic<bool> busy;
+
+	PlaneEstimator planeEstimator; // Single threaded
+	ofFloatPixels floatDepth;
+	std::vector<float> profile; // Mean depth across a border
+	std::vector<int> profileCount;
+
+	// Reference frame
+	bool hasReference;
+	bool referenceWallPlane;
+	ofVec4f wallPlane0;
+	ofVec4f basePlane0;
+	bool referenceWalls;
+	float edges0[4]; // Relative to the ROI borders
+};
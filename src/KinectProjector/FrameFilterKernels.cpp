@@ -0,0 +1,769 @@
+/***********************************************************************
+FrameFilterKernels - Scalar and SIMD implementations of the temporal
+depth filter of the KinectGrabber with runtime CPU dispatch.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+--- Adapted from FrameFilter of the Augmented Reality Sandbox
+Copyright (c) 2012-2015 Oliver Kreylos
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#include "FrameFilterKernels.h"
+#include "ofMain.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define FILTER_KERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define FILTER_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+// The AVX2 kernel is compiled for AVX2 without changing the flags of the whole project
+#if defined(__GNUC__) || defined(__clang__)
+#define FILTER_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define FILTER_TARGET_AVX2
+#endif
+
+static TemporalFilterRowFunction temporalFilterRow = nullptr;
+static std::string temporalFilterRowName;
+static TemporalFilterRowU16Function temporalFilterRowU16 = nullptr;
+static std::string temporalFilterRowU16Name;
+
+//--------------------------------------------------------------
+// Scalar reference
+//--------------------------------------------------------------
+// Filter the pixels [start, end[ of the row
+static inline void temporalFilterPixels(const TemporalFilterRow& row, int start, int end, const TemporalFilterParams& p){
+	for (int x = start; x < end; ++x)
+	{
+		float* averagingPtr = row.averaging + averagingIndex(x, 0, p.numAveragingSlots); // Slot 0 of the pixel
+		float newVal = static_cast<float>(row.input[x]);
+		float oldVal = averagingPtr[row.slotIndex*temporalFilterLanes];
+		float& count = row.count[x];
+		float& sum = row.sum[x];
+		float& sumSq = row.sumSq[x];
+
+		if (newVal > p.maxOffset) // We are under the ceiling plane
+		{
+			averagingPtr[row.slotIndex*temporalFilterLanes] = newVal; // Store the value
+			if (p.followBigChange && count > 0) // Follow big changes
+			{
+				float oldFiltered = sum / count; // Compare newVal with average
+				if (oldFiltered - newVal >= p.bigChange || newVal - oldFiltered >= p.bigChange)
+				{
+					for (int i = 0; i < p.numAveragingSlots; i++) // Update all averaging slots
+						averagingPtr[i*temporalFilterLanes] = newVal;
+					count = p.numAveragingSlots; // Update statistics
+					sum = newVal*p.numAveragingSlots;
+					sumSq = newVal*newVal*p.numAveragingSlots;
+				}
+			}
+			// Update the pixel's statistics
+			++count;
+			sum += newVal;
+			sumSq += newVal*newVal;
+
+			// Check if the previous value in the averaging buffer was not initiated
+			if (oldVal != p.initialValue)
+			{
+				--count;
+				sum -= oldVal;
+				sumSq -= oldVal*oldVal;
+			}
+		}
+		// Check if the pixel is "stable"
+		if (count >= p.minNumSamples &&
+			sumSq*count <= p.maxVariance*count*count + sum*sum)
+		{
+			// Check if the new running mean is outside the previous value's envelope
+			float newFiltered = sum / count;
+			if (std::fabs(newFiltered - row.valid[x]) >= p.hysteresis)
+				row.valid[x] = newFiltered;
+		}
+		row.filtered[x] = row.valid[x];
+	}
+}
+
+void FrameFilterKernels::temporalFilterRowScalar(const TemporalFilterRow& row, const TemporalFilterParams& params){
+	temporalFilterPixels(row, row.start, row.end, params);
+}
+
+// Largest integer variance numerator count*sumSq - sum*sum of a stable pixel
+// Computed in float like the AVX2 kernel so both kernels agree on the threshold
+static inline int64_t maxVarianceNumerator(uint32_t count, float maxVariance){
+	return (int32_t)(maxVariance * (float)(count*count));
+}
+
+static inline void temporalFilterPixelsU16(const TemporalFilterRowU16& row, int start, int end, const TemporalFilterParams& p){
+	for (int x = start; x < end; ++x)
+	{
+		uint16_t* averagingPtr = row.averaging + averagingIndex(x, 0, p.numAveragingSlots); // Slot 0 of the pixel
+		uint32_t newVal = row.input[x];
+		uint32_t oldVal = averagingPtr[row.slotIndex*temporalFilterLanes];
+		uint32_t& count = row.count[x];
+		uint32_t& sum = row.sum[x];
+		uint64_t& sumSq = row.sumSq[x];
+
+		if (newVal != 0 && (float)newVal > p.maxOffset) // Valid measure under the ceiling plane
+		{
+			averagingPtr[row.slotIndex*temporalFilterLanes] = newVal; // Store the value
+			bool bigChange = false;
+			if (p.followBigChange && count > 0) // Follow big changes
+			{
+				float oldFiltered = (float)sum / (float)count; // Compare newVal with average
+				bigChange = oldFiltered - (float)newVal >= p.bigChange || (float)newVal - oldFiltered >= p.bigChange;
+			}
+			if (bigChange)
+			{
+				for (int i = 0; i < p.numAveragingSlots; i++) // Update all averaging slots
+					averagingPtr[i*temporalFilterLanes] = newVal;
+				count = p.numAveragingSlots; // The statistics are those of the ring
+				sum = newVal*p.numAveragingSlots;
+				sumSq = (uint64_t)(newVal*newVal)*p.numAveragingSlots;
+			}
+			else
+			{
+				// Update the pixel's statistics
+				++count;
+				sum += newVal;
+				sumSq += newVal*newVal;
+
+				// Remove the previous value of the slot if it was set
+				if (oldVal != 0)
+				{
+					--count;
+					sum -= oldVal;
+					sumSq -= oldVal*oldVal;
+				}
+			}
+		}
+		// Check if the pixel is "stable" - count*sumSq-sum*sum is count^2 times the variance
+		if ((float)count >= p.minNumSamples &&
+			(int64_t)(sumSq*count - (uint64_t)sum*sum) <= maxVarianceNumerator(count, p.maxVariance))
+		{
+			// Check if the new running mean is outside the previous value's envelope
+			float newFiltered = (float)sum / (float)count;
+			if (std::fabs(newFiltered - row.valid[x]) >= p.hysteresis)
+				row.valid[x] = newFiltered;
+		}
+		row.filtered[x] = row.valid[x];
+	}
+}
+
+void FrameFilterKernels::temporalFilterRowU16Scalar(const TemporalFilterRowU16& row, const TemporalFilterParams& params){
+	temporalFilterPixelsU16(row, row.start, row.end, params);
+}
+
+// Samples needed before a pixel of the recursive filter can be stable - the variance
+// estimate is exact from the second sample so it does not wait for the ring to fill
+static const float recursiveMinNumSamples = 3;
+
+void FrameFilterKernels::temporalFilterRowRecursive(const TemporalFilterRowRecursive& row, const TemporalFilterParams& p){
+	const float alpha = 2.0f / (p.numAveragingSlots + 1);
+	const float maxCount = (float)p.numAveragingSlots;
+	const float minNumSamples = std::min(p.minNumSamples, recursiveMinNumSamples);
+	for (int x = row.start; x < row.end; ++x)
+	{
+		float newVal = static_cast<float>(row.input[x]);
+		float& count = row.count[x];
+		float& mean = row.mean[x];
+		float& variance = row.variance[x];
+
+		if (newVal > p.maxOffset) // We are under the ceiling plane
+		{
+			float innovation = newVal - mean;
+			if (count == 0)
+			{
+				mean = newVal;
+				variance = 0;
+				count = 1;
+			}
+			else if (p.followBigChange && std::fabs(innovation) >= p.bigChange)
+			{
+				// Innovation gate: restart on the new value with the confidence of a full ring
+				mean = newVal;
+				variance = 0;
+				count = maxCount;
+			}
+			else
+			{
+				count = std::min(count + 1, maxCount);
+				float a = std::max(1.0f / count, alpha);
+				mean += a*innovation;
+				variance = (1 - a)*(variance + a*innovation*innovation);
+			}
+		}
+		// Check if the pixel is "stable"
+		if (count >= minNumSamples && variance <= p.maxVariance)
+		{
+			// Check if the new mean is outside the previous value's envelope
+			if (std::fabs(mean - row.valid[x]) >= p.hysteresis)
+				row.valid[x] = mean;
+		}
+		row.filtered[x] = row.valid[x];
+	}
+}
+
+// First pixel from which a kernel of the given width can use aligned loads
+static inline int alignedStart(int start, int end, int lanes){
+	return std::min(end, (start + lanes - 1) / lanes * lanes);
+}
+
+//--------------------------------------------------------------
+// SSE2 - 8 pixels per iteration
+//--------------------------------------------------------------
+#ifdef FILTER_KERNELS_X86
+static inline __m128 blendSSE2(__m128 a, __m128 b, __m128 mask){
+	return _mm_or_ps(_mm_and_ps(mask, b), _mm_andnot_ps(mask, a));
+}
+
+static void temporalFilterRowSSE2(const TemporalFilterRow& row, const TemporalFilterParams& p){
+	const __m128 maxOffset = _mm_set1_ps(p.maxOffset);
+	const __m128 initialValue = _mm_set1_ps(p.initialValue);
+	const __m128 bigChange = _mm_set1_ps(p.bigChange);
+	const __m128 numSlots = _mm_set1_ps((float)p.numAveragingSlots);
+	const __m128 minNumSamples = _mm_set1_ps(p.minNumSamples);
+	const __m128 maxVariance = _mm_set1_ps(p.maxVariance);
+	const __m128 hysteresis = _mm_set1_ps(p.hysteresis);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	const __m128i zeroi = _mm_setzero_si128();
+
+	// One block of the averaging ring per iteration, as two halves of 4 pixels
+	int x = alignedStart(row.start, row.end, temporalFilterLanes);
+	temporalFilterPixels(row, row.start, x, p);
+	for (; x + temporalFilterLanes <= row.end; x += temporalFilterLanes)
+	{
+		float* averagingPtr = row.averaging + averagingIndex(x, 0, p.numAveragingSlots);
+		float* slotPtr = averagingPtr + row.slotIndex*temporalFilterLanes;
+		__m128i raw = _mm_loadu_si128((const __m128i*)(row.input + x));
+		__m128 newVal[2] = {_mm_cvtepi32_ps(_mm_unpacklo_epi16(raw, zeroi)), _mm_cvtepi32_ps(_mm_unpackhi_epi16(raw, zeroi))};
+		__m128 oldVal[2], count[2], sum[2], sumSq[2], under[2];
+		for (int h = 0; h < 2; h++)
+		{
+			oldVal[h] = _mm_load_ps(slotPtr + 4*h);
+			count[h] = _mm_load_ps(row.count + x + 4*h);
+			sum[h] = _mm_load_ps(row.sum + x + 4*h);
+			sumSq[h] = _mm_load_ps(row.sumSq + x + 4*h);
+			under[h] = _mm_cmpgt_ps(newVal[h], maxOffset);
+			_mm_store_ps(slotPtr + 4*h, blendSSE2(oldVal[h], newVal[h], under[h]));
+		}
+		if (p.followBigChange)
+		{
+			__m128 big[2];
+			for (int h = 0; h < 2; h++)
+			{
+				__m128 oldFiltered = _mm_div_ps(sum[h], count[h]);
+				__m128 diff = _mm_and_ps(_mm_sub_ps(oldFiltered, newVal[h]), absMask);
+				big[h] = _mm_and_ps(_mm_and_ps(under[h], _mm_cmpgt_ps(count[h], zero)), _mm_cmpge_ps(diff, bigChange));
+			}
+			if (_mm_movemask_ps(_mm_or_ps(big[0], big[1])))
+			{
+				for (int i = 0; i < p.numAveragingSlots; i++, averagingPtr += temporalFilterLanes)
+					for (int h = 0; h < 2; h++)
+						_mm_store_ps(averagingPtr + 4*h, blendSSE2(_mm_load_ps(averagingPtr + 4*h), newVal[h], big[h]));
+				for (int h = 0; h < 2; h++)
+				{
+					count[h] = blendSSE2(count[h], numSlots, big[h]);
+					sum[h] = blendSSE2(sum[h], _mm_mul_ps(newVal[h], numSlots), big[h]);
+					sumSq[h] = blendSSE2(sumSq[h], _mm_mul_ps(_mm_mul_ps(newVal[h], newVal[h]), numSlots), big[h]);
+				}
+			}
+		}
+		for (int h = 0; h < 2; h++)
+		{
+			count[h] = _mm_add_ps(count[h], _mm_and_ps(under[h], one));
+			sum[h] = _mm_add_ps(sum[h], _mm_and_ps(under[h], newVal[h]));
+			sumSq[h] = _mm_add_ps(sumSq[h], _mm_and_ps(under[h], _mm_mul_ps(newVal[h], newVal[h])));
+			__m128 wasSet = _mm_and_ps(under[h], _mm_cmpneq_ps(oldVal[h], initialValue));
+			count[h] = _mm_sub_ps(count[h], _mm_and_ps(wasSet, one));
+			sum[h] = _mm_sub_ps(sum[h], _mm_and_ps(wasSet, oldVal[h]));
+			sumSq[h] = _mm_sub_ps(sumSq[h], _mm_and_ps(wasSet, _mm_mul_ps(oldVal[h], oldVal[h])));
+			_mm_store_ps(row.count + x + 4*h, count[h]);
+			_mm_store_ps(row.sum + x + 4*h, sum[h]);
+			_mm_store_ps(row.sumSq + x + 4*h, sumSq[h]);
+
+			__m128 stable = _mm_and_ps(_mm_cmpge_ps(count[h], minNumSamples),
+				_mm_cmple_ps(_mm_mul_ps(sumSq[h], count[h]), _mm_add_ps(_mm_mul_ps(_mm_mul_ps(maxVariance, count[h]), count[h]), _mm_mul_ps(sum[h], sum[h]))));
+			__m128 valid = _mm_loadu_ps(row.valid + x + 4*h);
+			__m128 newFiltered = _mm_div_ps(sum[h], count[h]);
+			__m128 update = _mm_and_ps(stable, _mm_cmpge_ps(_mm_and_ps(_mm_sub_ps(newFiltered, valid), absMask), hysteresis));
+			valid = blendSSE2(valid, newFiltered, update);
+			_mm_storeu_ps(row.valid + x + 4*h, valid);
+			_mm_storeu_ps(row.filtered + x + 4*h, valid);
+		}
+	}
+	temporalFilterPixels(row, x, row.end, p);
+}
+
+//--------------------------------------------------------------
+// AVX2 - 8 pixels per iteration
+//--------------------------------------------------------------
+FILTER_TARGET_AVX2
+static void temporalFilterRowAVX2(const TemporalFilterRow& row, const TemporalFilterParams& p){
+	const __m256 maxOffset = _mm256_set1_ps(p.maxOffset);
+	const __m256 initialValue = _mm256_set1_ps(p.initialValue);
+	const __m256 bigChange = _mm256_set1_ps(p.bigChange);
+	const __m256 numSlots = _mm256_set1_ps((float)p.numAveragingSlots);
+	const __m256 minNumSamples = _mm256_set1_ps(p.minNumSamples);
+	const __m256 maxVariance = _mm256_set1_ps(p.maxVariance);
+	const __m256 hysteresis = _mm256_set1_ps(p.hysteresis);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+
+	int x = alignedStart(row.start, row.end, 8);
+	temporalFilterPixels(row, row.start, x, p);
+	for (; x + 8 <= row.end; x += 8)
+	{
+		float* averagingPtr = row.averaging + averagingIndex(x, 0, p.numAveragingSlots);
+		float* slotPtr = averagingPtr + row.slotIndex*temporalFilterLanes;
+		__m128i raw = _mm_loadu_si128((const __m128i*)(row.input + x));
+		__m256 newVal = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(raw));
+		__m256 oldVal = _mm256_load_ps(slotPtr);
+		__m256 count = _mm256_load_ps(row.count + x);
+		__m256 sum = _mm256_load_ps(row.sum + x);
+		__m256 sumSq = _mm256_load_ps(row.sumSq + x);
+
+		__m256 under = _mm256_cmp_ps(newVal, maxOffset, _CMP_GT_OQ);
+		_mm256_store_ps(slotPtr, _mm256_blendv_ps(oldVal, newVal, under));
+		if (p.followBigChange)
+		{
+			__m256 oldFiltered = _mm256_div_ps(sum, count);
+			__m256 diff = _mm256_and_ps(_mm256_sub_ps(oldFiltered, newVal), absMask);
+			__m256 big = _mm256_and_ps(_mm256_and_ps(under, _mm256_cmp_ps(count, zero, _CMP_GT_OQ)), _mm256_cmp_ps(diff, bigChange, _CMP_GE_OQ));
+			if (_mm256_movemask_ps(big))
+			{
+				for (int i = 0; i < p.numAveragingSlots; i++, averagingPtr += temporalFilterLanes)
+					_mm256_store_ps(averagingPtr, _mm256_blendv_ps(_mm256_load_ps(averagingPtr), newVal, big));
+				count = _mm256_blendv_ps(count, numSlots, big);
+				sum = _mm256_blendv_ps(sum, _mm256_mul_ps(newVal, numSlots), big);
+				sumSq = _mm256_blendv_ps(sumSq, _mm256_mul_ps(_mm256_mul_ps(newVal, newVal), numSlots), big);
+			}
+		}
+		count = _mm256_add_ps(count, _mm256_and_ps(under, one));
+		sum = _mm256_add_ps(sum, _mm256_and_ps(under, newVal));
+		sumSq = _mm256_add_ps(sumSq, _mm256_and_ps(under, _mm256_mul_ps(newVal, newVal)));
+		__m256 wasSet = _mm256_and_ps(under, _mm256_cmp_ps(oldVal, initialValue, _CMP_NEQ_UQ));
+		count = _mm256_sub_ps(count, _mm256_and_ps(wasSet, one));
+		sum = _mm256_sub_ps(sum, _mm256_and_ps(wasSet, oldVal));
+		sumSq = _mm256_sub_ps(sumSq, _mm256_and_ps(wasSet, _mm256_mul_ps(oldVal, oldVal)));
+		_mm256_store_ps(row.count + x, count);
+		_mm256_store_ps(row.sum + x, sum);
+		_mm256_store_ps(row.sumSq + x, sumSq);
+
+		__m256 stable = _mm256_and_ps(_mm256_cmp_ps(count, minNumSamples, _CMP_GE_OQ),
+			_mm256_cmp_ps(_mm256_mul_ps(sumSq, count), _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(maxVariance, count), count), _mm256_mul_ps(sum, sum)), _CMP_LE_OQ));
+		__m256 valid = _mm256_loadu_ps(row.valid + x);
+		__m256 newFiltered = _mm256_div_ps(sum, count);
+		__m256 update = _mm256_and_ps(stable, _mm256_cmp_ps(_mm256_and_ps(_mm256_sub_ps(newFiltered, valid), absMask), hysteresis, _CMP_GE_OQ));
+		valid = _mm256_blendv_ps(valid, newFiltered, update);
+		_mm256_storeu_ps(row.valid + x, valid);
+		_mm256_storeu_ps(row.filtered + x, valid);
+	}
+	temporalFilterPixels(row, x, row.end, p);
+}
+
+//--------------------------------------------------------------
+// AVX2 - 8 pixels per iteration of the uint16 storage
+//--------------------------------------------------------------
+// Gather the low 32 bits of the 64 bit lanes of lo and hi in one vector
+FILTER_TARGET_AVX2
+static inline __m256i narrowMasksAVX2(__m256i lo, __m256i hi){
+	const __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	lo = _mm256_permutevar8x32_epi32(lo, even);
+	hi = _mm256_permutevar8x32_epi32(hi, even);
+	return _mm256_inserti128_si256(lo, _mm256_castsi256_si128(hi), 1);
+}
+
+// a*b for a 64 bit and b below 2^32
+FILTER_TARGET_AVX2
+static inline __m256i mul64x32AVX2(__m256i a, __m256i b){
+	__m256i low = _mm256_mul_epu32(a, b);
+	__m256i high = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b);
+	return _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+}
+
+FILTER_TARGET_AVX2
+static void temporalFilterRowU16AVX2(const TemporalFilterRowU16& row, const TemporalFilterParams& p){
+	const __m256 maxOffset = _mm256_set1_ps(p.maxOffset);
+	const __m256 bigChange = _mm256_set1_ps(p.bigChange);
+	const __m256 minNumSamples = _mm256_set1_ps(p.minNumSamples);
+	const __m256 maxVariance = _mm256_set1_ps(p.maxVariance);
+	const __m256 hysteresis = _mm256_set1_ps(p.hysteresis);
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+	const __m256i numSlots = _mm256_set1_epi32(p.numAveragingSlots);
+	const __m256i numSlots64 = _mm256_set1_epi64x(p.numAveragingSlots);
+	const __m256i zero = _mm256_setzero_si256();
+
+	int x = alignedStart(row.start, row.end, 8);
+	temporalFilterPixelsU16(row, row.start, x, p);
+	for (; x + 8 <= row.end; x += 8)
+	{
+		uint16_t* averagingPtr = row.averaging + averagingIndex(x, 0, p.numAveragingSlots);
+		uint16_t* slotPtr = averagingPtr + row.slotIndex*temporalFilterLanes;
+		__m128i newVal16 = _mm_loadu_si128((const __m128i*)(row.input + x));
+		__m128i oldVal16 = _mm_load_si128((const __m128i*)slotPtr);
+		__m256i newVal = _mm256_cvtepu16_epi32(newVal16);
+		__m256i oldVal = _mm256_cvtepu16_epi32(oldVal16);
+		__m256i count = _mm256_load_si256((const __m256i*)(row.count + x));
+		__m256i sum = _mm256_load_si256((const __m256i*)(row.sum + x));
+		__m256i sumSqLo = _mm256_load_si256((const __m256i*)(row.sumSq + x));
+		__m256i sumSqHi = _mm256_load_si256((const __m256i*)(row.sumSq + x + 4));
+
+		__m256i under = _mm256_andnot_si256(_mm256_cmpeq_epi32(newVal, zero),
+			_mm256_castps_si256(_mm256_cmp_ps(_mm256_cvtepi32_ps(newVal), maxOffset, _CMP_GT_OQ)));
+		__m128i under16 = _mm_packs_epi32(_mm256_castsi256_si128(under), _mm256_extracti128_si256(under, 1));
+		_mm_store_si128((__m128i*)slotPtr, _mm_blendv_epi8(oldVal16, newVal16, under16));
+
+		// Squares are below 2^32 so the low 32 bits of the product are exact
+		__m256i newSq = _mm256_mullo_epi32(newVal, newVal);
+		__m256i oldSq = _mm256_mullo_epi32(oldVal, oldVal);
+
+		// Incremental update - a mask is -1 in the selected lanes
+		__m256i wasSet = _mm256_andnot_si256(_mm256_cmpeq_epi32(oldVal, zero), under);
+		__m256i newCount = _mm256_add_epi32(_mm256_sub_epi32(count, under), wasSet);
+		__m256i newSum = _mm256_sub_epi32(_mm256_add_epi32(sum, _mm256_and_si256(under, newVal)), _mm256_and_si256(wasSet, oldVal));
+		__m256i addSq = _mm256_and_si256(under, newSq);
+		__m256i subSq = _mm256_and_si256(wasSet, oldSq);
+		__m256i newSumSqLo = _mm256_sub_epi64(_mm256_add_epi64(sumSqLo, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(addSq))),
+			_mm256_cvtepu32_epi64(_mm256_castsi256_si128(subSq)));
+		__m256i newSumSqHi = _mm256_sub_epi64(_mm256_add_epi64(sumSqHi, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(addSq, 1))),
+			_mm256_cvtepu32_epi64(_mm256_extracti128_si256(subSq, 1)));
+
+		if (p.followBigChange)
+		{
+			__m256 countF = _mm256_cvtepi32_ps(count);
+			__m256 oldFiltered = _mm256_div_ps(_mm256_cvtepi32_ps(sum), countF);
+			__m256 diff = _mm256_and_ps(_mm256_sub_ps(oldFiltered, _mm256_cvtepi32_ps(newVal)), absMask);
+			__m256i big = _mm256_and_si256(_mm256_and_si256(under, _mm256_cmpgt_epi32(count, zero)),
+				_mm256_castps_si256(_mm256_cmp_ps(diff, bigChange, _CMP_GE_OQ)));
+			if (!_mm256_testz_si256(big, big))
+			{
+				__m128i big16 = _mm_packs_epi32(_mm256_castsi256_si128(big), _mm256_extracti128_si256(big, 1));
+				for (int i = 0; i < p.numAveragingSlots; i++, averagingPtr += temporalFilterLanes)
+					_mm_store_si128((__m128i*)averagingPtr, _mm_blendv_epi8(_mm_load_si128((const __m128i*)averagingPtr), newVal16, big16));
+				newCount = _mm256_blendv_epi8(newCount, numSlots, big);
+				newSum = _mm256_blendv_epi8(newSum, _mm256_mullo_epi32(newVal, numSlots), big);
+				__m256i bigLo = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(big));
+				__m256i bigHi = _mm256_cvtepi32_epi64(_mm256_extracti128_si256(big, 1));
+				newSumSqLo = _mm256_blendv_epi8(newSumSqLo, _mm256_mul_epu32(_mm256_cvtepu32_epi64(_mm256_castsi256_si128(newSq)), numSlots64), bigLo);
+				newSumSqHi = _mm256_blendv_epi8(newSumSqHi, _mm256_mul_epu32(_mm256_cvtepu32_epi64(_mm256_extracti128_si256(newSq, 1)), numSlots64), bigHi);
+			}
+		}
+		_mm256_store_si256((__m256i*)(row.count + x), newCount);
+		_mm256_store_si256((__m256i*)(row.sum + x), newSum);
+		_mm256_store_si256((__m256i*)(row.sumSq + x), newSumSqLo);
+		_mm256_store_si256((__m256i*)(row.sumSq + x + 4), newSumSqHi);
+
+		// Stability: count*sumSq - sum*sum <= maxVariance*count^2 in 64 bits
+		__m256 countF = _mm256_cvtepi32_ps(newCount);
+		__m256i threshold = _mm256_cvttps_epi32(_mm256_mul_ps(maxVariance, _mm256_cvtepi32_ps(_mm256_mullo_epi32(newCount, newCount))));
+		__m256i countLo = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(newCount));
+		__m256i countHi = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(newCount, 1));
+		__m256i sumLo = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(newSum));
+		__m256i sumHi = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(newSum, 1));
+		__m256i varianceLo = _mm256_sub_epi64(mul64x32AVX2(newSumSqLo, countLo), _mm256_mul_epu32(sumLo, sumLo));
+		__m256i varianceHi = _mm256_sub_epi64(mul64x32AVX2(newSumSqHi, countHi), _mm256_mul_epu32(sumHi, sumHi));
+		__m256i unstable = narrowMasksAVX2(
+			_mm256_cmpgt_epi64(varianceLo, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(threshold))),
+			_mm256_cmpgt_epi64(varianceHi, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(threshold, 1))));
+		__m256 stable = _mm256_andnot_ps(_mm256_castsi256_ps(unstable), _mm256_cmp_ps(countF, minNumSamples, _CMP_GE_OQ));
+
+		__m256 valid = _mm256_loadu_ps(row.valid + x);
+		__m256 newFiltered = _mm256_div_ps(_mm256_cvtepi32_ps(newSum), countF);
+		__m256 update = _mm256_and_ps(stable, _mm256_cmp_ps(_mm256_and_ps(_mm256_sub_ps(newFiltered, valid), absMask), hysteresis, _CMP_GE_OQ));
+		valid = _mm256_blendv_ps(valid, newFiltered, update);
+		_mm256_storeu_ps(row.valid + x, valid);
+		_mm256_storeu_ps(row.filtered + x, valid);
+	}
+	temporalFilterPixelsU16(row, x, row.end, p);
+}
+
+static bool cpuSupportsAVX2(){
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) // The OS must save the AVX registers
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+//--------------------------------------------------------------
+// NEON - 8 pixels per iteration
+//--------------------------------------------------------------
+#ifdef FILTER_KERNELS_NEON
+static void temporalFilterRowNEON(const TemporalFilterRow& row, const TemporalFilterParams& p){
+	const float32x4_t maxOffset = vdupq_n_f32(p.maxOffset);
+	const float32x4_t initialValue = vdupq_n_f32(p.initialValue);
+	const float32x4_t bigChange = vdupq_n_f32(p.bigChange);
+	const float32x4_t numSlots = vdupq_n_f32((float)p.numAveragingSlots);
+	const float32x4_t minNumSamples = vdupq_n_f32(p.minNumSamples);
+	const float32x4_t maxVariance = vdupq_n_f32(p.maxVariance);
+	const float32x4_t hysteresis = vdupq_n_f32(p.hysteresis);
+	const float32x4_t one = vdupq_n_f32(1.0f);
+	const float32x4_t zero = vdupq_n_f32(0.0f);
+
+	// One block of the averaging ring per iteration, as two halves of 4 pixels
+	int x = alignedStart(row.start, row.end, temporalFilterLanes);
+	temporalFilterPixels(row, row.start, x, p);
+	for (; x + temporalFilterLanes <= row.end; x += temporalFilterLanes)
+	{
+		float* averagingPtr = row.averaging + averagingIndex(x, 0, p.numAveragingSlots);
+		float* slotPtr = averagingPtr + row.slotIndex*temporalFilterLanes;
+		uint16x8_t raw = vld1q_u16(row.input + x);
+		float32x4_t newVal[2] = {vcvtq_f32_u32(vmovl_u16(vget_low_u16(raw))), vcvtq_f32_u32(vmovl_u16(vget_high_u16(raw)))};
+		float32x4_t oldVal[2], count[2], sum[2], sumSq[2];
+		uint32x4_t under[2];
+		for (int h = 0; h < 2; h++)
+		{
+			oldVal[h] = vld1q_f32(slotPtr + 4*h);
+			count[h] = vld1q_f32(row.count + x + 4*h);
+			sum[h] = vld1q_f32(row.sum + x + 4*h);
+			sumSq[h] = vld1q_f32(row.sumSq + x + 4*h);
+			under[h] = vcgtq_f32(newVal[h], maxOffset);
+			vst1q_f32(slotPtr + 4*h, vbslq_f32(under[h], newVal[h], oldVal[h]));
+		}
+		if (p.followBigChange)
+		{
+			uint32x4_t big[2];
+			for (int h = 0; h < 2; h++)
+			{
+				float32x4_t oldFiltered = vdivq_f32(sum[h], count[h]);
+				big[h] = vandq_u32(vandq_u32(under[h], vcgtq_f32(count[h], zero)), vcgeq_f32(vabdq_f32(oldFiltered, newVal[h]), bigChange));
+			}
+			if (vmaxvq_u32(vorrq_u32(big[0], big[1])))
+			{
+				for (int i = 0; i < p.numAveragingSlots; i++, averagingPtr += temporalFilterLanes)
+					for (int h = 0; h < 2; h++)
+						vst1q_f32(averagingPtr + 4*h, vbslq_f32(big[h], newVal[h], vld1q_f32(averagingPtr + 4*h)));
+				for (int h = 0; h < 2; h++)
+				{
+					count[h] = vbslq_f32(big[h], numSlots, count[h]);
+					sum[h] = vbslq_f32(big[h], vmulq_f32(newVal[h], numSlots), sum[h]);
+					sumSq[h] = vbslq_f32(big[h], vmulq_f32(vmulq_f32(newVal[h], newVal[h]), numSlots), sumSq[h]);
+				}
+			}
+		}
+		for (int h = 0; h < 2; h++)
+		{
+			count[h] = vaddq_f32(count[h], vbslq_f32(under[h], one, zero));
+			sum[h] = vaddq_f32(sum[h], vbslq_f32(under[h], newVal[h], zero));
+			sumSq[h] = vaddq_f32(sumSq[h], vbslq_f32(under[h], vmulq_f32(newVal[h], newVal[h]), zero));
+			uint32x4_t wasSet = vandq_u32(under[h], vmvnq_u32(vceqq_f32(oldVal[h], initialValue)));
+			count[h] = vsubq_f32(count[h], vbslq_f32(wasSet, one, zero));
+			sum[h] = vsubq_f32(sum[h], vbslq_f32(wasSet, oldVal[h], zero));
+			sumSq[h] = vsubq_f32(sumSq[h], vbslq_f32(wasSet, vmulq_f32(oldVal[h], oldVal[h]), zero));
+			vst1q_f32(row.count + x + 4*h, count[h]);
+			vst1q_f32(row.sum + x + 4*h, sum[h]);
+			vst1q_f32(row.sumSq + x + 4*h, sumSq[h]);
+
+			uint32x4_t stable = vandq_u32(vcgeq_f32(count[h], minNumSamples),
+				vcleq_f32(vmulq_f32(sumSq[h], count[h]), vaddq_f32(vmulq_f32(vmulq_f32(maxVariance, count[h]), count[h]), vmulq_f32(sum[h], sum[h]))));
+			float32x4_t valid = vld1q_f32(row.valid + x + 4*h);
+			float32x4_t newFiltered = vdivq_f32(sum[h], count[h]);
+			uint32x4_t update = vandq_u32(stable, vcgeq_f32(vabdq_f32(newFiltered, valid), hysteresis));
+			valid = vbslq_f32(update, newFiltered, valid);
+			vst1q_f32(row.valid + x + 4*h, valid);
+			vst1q_f32(row.filtered + x + 4*h, valid);
+		}
+	}
+	temporalFilterPixels(row, x, row.end, p);
+}
+#endif
+
+//--------------------------------------------------------------
+// Buffers
+//--------------------------------------------------------------
+void* FrameFilterKernels::allocateAlignedBytes(size_t numBytes){
+	void* ptr = nullptr;
+#ifdef _MSC_VER
+	ptr = _aligned_malloc(numBytes, 64);
+#else
+	if (posix_memalign(&ptr, 64, numBytes) != 0)
+		ptr = nullptr;
+#endif
+	return ptr;
+}
+
+void FrameFilterKernels::freeAligned(void* buffer){
+#ifdef _MSC_VER
+	_aligned_free(buffer);
+#else
+	free(buffer);
+#endif
+}
+
+//--------------------------------------------------------------
+// Dispatch
+//--------------------------------------------------------------
+// Run a kernel and the reference on the same synthetic sequence covering unset slots,
+// pixels above the ceiling, noise and big changes. Row is TemporalFilterRow or
+// TemporalFilterRowU16 and unsetValue the value of their unset slots.
+template<class Row, class Kernel>
+static bool checkAgainstReference(Kernel kernel, Kernel reference, float unsetValue){
+	typedef typename std::remove_pointer<decltype(Row::averaging)>::type Sample;
+	typedef typename std::remove_pointer<decltype(Row::count)>::type Count;
+	typedef typename std::remove_pointer<decltype(Row::sum)>::type Sum;
+	typedef typename std::remove_pointer<decltype(Row::sumSq)>::type SumSq;
+
+	const int width = 75;
+	const int stride = FrameFilterKernels::paddedStride(width);
+	TemporalFilterParams params;
+	params.numAveragingSlots = 5;
+	params.minNumSamples = 3;
+	params.maxVariance = 4;
+	params.initialValue = 4000;
+	params.hysteresis = 0.5f;
+	params.followBigChange = true;
+	params.bigChange = 10.0f;
+	params.maxOffset = 500;
+
+	Row rows[2];
+	std::vector<uint16_t> input(stride);
+	for (int k = 0; k < 2; k++)
+	{
+		rows[k].input = input.data();
+		rows[k].averaging = FrameFilterKernels::allocateAligned<Sample>(stride*params.numAveragingSlots);
+		rows[k].count = FrameFilterKernels::allocateAligned<Count>(stride);
+		rows[k].sum = FrameFilterKernels::allocateAligned<Sum>(stride);
+		rows[k].sumSq = FrameFilterKernels::allocateAligned<SumSq>(stride);
+		rows[k].valid = FrameFilterKernels::allocateAligned<float>(stride);
+		rows[k].filtered = FrameFilterKernels::allocateAligned<float>(stride);
+		std::fill(rows[k].averaging, rows[k].averaging + stride*params.numAveragingSlots, (Sample)unsetValue);
+		std::fill(rows[k].count, rows[k].count + stride, (Count)0);
+		std::fill(rows[k].sum, rows[k].sum + stride, (Sum)0);
+		std::fill(rows[k].sumSq, rows[k].sumSq + stride, (SumSq)0);
+		std::fill(rows[k].valid, rows[k].valid + stride, params.initialValue);
+		std::fill(rows[k].filtered, rows[k].filtered + stride, 0.0f);
+		rows[k].start = 3; // Unaligned start and end to test the scalar head and tail
+		rows[k].end = width - 2;
+	}
+
+	bool match = true;
+	unsigned int seed = 12345;
+	for (int frame = 0; frame < 40 && match; frame++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			seed = seed * 1103515245 + 12345;
+			int noise = (seed >> 16) % 5;
+			int base = frame < 20 ? 800 + x : 780 + x; // Big change at frame 20
+			input[x] = (x % 11 == 0) ? 300 : base + noise; // Some pixels above the ceiling
+			if (x % 13 == 0 && frame % 3 == 0)
+				input[x] = 0; // and without measure
+		}
+		for (int k = 0; k < 2; k++)
+		{
+			rows[k].slotIndex = frame % params.numAveragingSlots;
+			(k == 0 ? reference : kernel)(rows[k], params);
+		}
+		for (int x = 0; x < width; x++)
+		{
+			if (std::fabs(rows[0].filtered[x] - rows[1].filtered[x]) > 0.01f)
+				match = false;
+		}
+	}
+	for (int k = 0; k < 2; k++)
+	{
+		FrameFilterKernels::freeAligned(rows[k].averaging);
+		FrameFilterKernels::freeAligned(rows[k].count);
+		FrameFilterKernels::freeAligned(rows[k].sum);
+		FrameFilterKernels::freeAligned(rows[k].sumSq);
+		FrameFilterKernels::freeAligned(rows[k].valid);
+		FrameFilterKernels::freeAligned(rows[k].filtered);
+	}
+	return match;
+}
+
+// Keep the first candidate matching the reference - the candidates are sorted fastest first
+template<class Row, class Kernel>
+static void selectKernel(const std::vector<std::pair<Kernel, std::string> >& candidates, Kernel reference, float unsetValue, Kernel& kernel, std::string& name){
+	kernel = reference;
+	name = "scalar";
+	for (auto & candidate : candidates)
+	{
+		if (checkAgainstReference<Row>(candidate.first, reference, unsetValue))
+		{
+			kernel = candidate.first;
+			name = candidate.second;
+			return;
+		}
+		ofLogWarning("FrameFilterKernels") << "selectKernels(): " << candidate.second << " kernel does not match the scalar reference - not used";
+	}
+}
+
+void FrameFilterKernels::selectKernels(){
+	std::vector<std::pair<TemporalFilterRowFunction, std::string> > candidates;
+	std::vector<std::pair<TemporalFilterRowU16Function, std::string> > candidatesU16;
+#ifdef FILTER_KERNELS_X86
+	if (cpuSupportsAVX2())
+	{
+		candidates.push_back(std::make_pair(&temporalFilterRowAVX2, std::string("AVX2")));
+		candidatesU16.push_back(std::make_pair(&temporalFilterRowU16AVX2, std::string("AVX2")));
+	}
+	candidates.push_back(std::make_pair(&temporalFilterRowSSE2, std::string("SSE2")));
+#endif
+#ifdef FILTER_KERNELS_NEON
+	candidates.push_back(std::make_pair(&temporalFilterRowNEON, std::string("NEON")));
+#endif
+
+	selectKernel<TemporalFilterRow>(candidates, &FrameFilterKernels::temporalFilterRowScalar, 4000.0f, temporalFilterRow, temporalFilterRowName);
+	selectKernel<TemporalFilterRowU16>(candidatesU16, &FrameFilterKernels::temporalFilterRowU16Scalar, 0.0f, temporalFilterRowU16, temporalFilterRowU16Name);
+	ofLogVerbose("FrameFilterKernels") << "selectKernels(): Using " << temporalFilterRowName << " float and " << temporalFilterRowU16Name << " uint16 temporal filter kernels";
+}
+
+TemporalFilterRowFunction FrameFilterKernels::getTemporalFilterRow(){
+	static bool selected = (selectKernels(), true);
+	(void)selected;
+	return temporalFilterRow;
+}
+
+std::string FrameFilterKernels::getTemporalFilterRowName(){
+	getTemporalFilterRow();
+	return temporalFilterRowName;
+}
+
+TemporalFilterRowU16Function FrameFilterKernels::getTemporalFilterRowU16(){
+	getTemporalFilterRow();
+	return temporalFilterRowU16;
+}
+
+std::string FrameFilterKernels::getTemporalFilterRowU16Name(){
+	getTemporalFilterRow();
+	return temporalFilterRowU16Name;
+}
@@ -0,0 +1,140 @@
+/***********************************************************************
+FrameFilterKernels - Scalar and SIMD implementations of the temporal
+depth filter of the KinectGrabber with runtime CPU dispatch.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+--- Adapted from FrameFilter of the Augmented Reality Sandbox
+Copyright (c) 2012-2015 Oliver Kreylos
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+***********************************************************************/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Parameters of the temporal filter
+struct TemporalFilterParams {
+	int numAveragingSlots;
+	float minNumSamples; // Minimum number of valid samples needed to consider a pixel stable
+	float maxVariance; // Maximum variance to consider a pixel stable
+	float initialValue; // Value of the averaging slots that have not received a sample
+	float hysteresis; // Amount by which a new filtered value has to differ from the current value to update the display
+	bool followBigChange;
+	float bigChange; // Amount of change over which the averaging slots are reset to new value
+	float maxOffset; // Depth values not over this offset are above the ceiling and ignored
+};
+
+// Storage of the averaging ring and of the running statistics
+enum Filter_storage {
+	FILTER_STORAGE_FLOAT, // float samples and statistics
+	FILTER_STORAGE_UINT16, // uint16 samples and exact integer statistics
+	FILTER_STORAGE_RECURSIVE // No ring: exponentially weighted mean and variance of each pixel
+};
+
+// Number of pixels interleaved in a block of the averaging ring
+const int temporalFilterLanes = 8;
+
+/* Layout of the filter buffers:
+   - count, sum and sumSq are separate planes whose rows are padded to a multiple of 16 floats
+     (64 bytes) and start on a cache line
+   - the averaging ring is stored by blocks of temporalFilterLanes pixels: all the slots of a block
+     are contiguous, each slot holding the values of the pixels of the block
+     [block][slot][lane] so resetting all the slots of a pixel touches neighbouring memory
+   All the pointers of a row point on its first pixel. */
+struct TemporalFilterRow {
+	const uint16_t* input; // Raw depth
+	float* averaging; // First block of the row in the averaging ring
+	int slotIndex; // Slot receiving the new values
+	float* count; // Running statistics: number of valid samples,
+	float* sum; // sum of the samples
+	float* sumSq; // and sum of their squares
+	float* valid; // Most recent stable value
+	float* filtered; // Output
+	int start, end; // Range [start, end[ of the pixels to filter in the row
+};
+
+// Index of the value of pixel x in slot slot in the averaging ring of a row
+inline size_t averagingIndex(int x, int slot, int numAveragingSlots){
+	return ((size_t)(x / temporalFilterLanes)*numAveragingSlots + slot)*temporalFilterLanes + x % temporalFilterLanes;
+}
+
+typedef void (*TemporalFilterRowFunction)(const TemporalFilterRow& row, const TemporalFilterParams& params);
+
+/* Row of the uint16 storage with the same layout. Unset slots hold 0 (no measurement) and
+   the statistics are exact: they always equal the sums over the samples in the ring.
+   sum stays below 65535*numAveragingSlots and sumSq needs 64 bits. */
+struct TemporalFilterRowU16 {
+	const uint16_t* input;
+	uint16_t* averaging;
+	int slotIndex;
+	uint32_t* count;
+	uint32_t* sum;
+	uint64_t* sumSq;
+	float* valid;
+	float* filtered;
+	int start, end;
+};
+
+typedef void (*TemporalFilterRowU16Function)(const TemporalFilterRowU16& row, const TemporalFilterParams& params);
+
+/* Row of the recursive filter. The state of a pixel is three floats: its number of samples
+   (capped to numAveragingSlots) and the exponentially weighted mean and variance of the
+   samples. The weight of a new sample is 1/count while the pixel fills so the mean is exact,
+   then 2/(numAveragingSlots+1) so the noise of the mean matches the ring. */
+struct TemporalFilterRowRecursive {
+	const uint16_t* input;
+	float* count;
+	float* mean;
+	float* variance;
+	float* valid;
+	float* filtered;
+	int start, end;
+};
+
+//! Temporal filter kernels
+/** The SIMD kernels process a block of 8 pixels of the averaging ring at a time with aligned
+    loads, as two halves of 4 (SSE2, NEON) or at once (AVX2), and replace the branches of
+    the scalar reference by masked blends. The fastest kernels
+    supported by the CPU are chosen on first use and checked against the scalar references.
+    The uint16 storage has a scalar and an AVX2 kernel.*/
+class FrameFilterKernels {
+public:
+	// Best kernels for this CPU
+	static TemporalFilterRowFunction getTemporalFilterRow();
+	static std::string getTemporalFilterRowName();
+	static TemporalFilterRowU16Function getTemporalFilterRowU16();
+	static std::string getTemporalFilterRowU16Name();
+
+	// Reference implementations
+	static void temporalFilterRowScalar(const TemporalFilterRow& row, const TemporalFilterParams& params);
+	static void temporalFilterRowU16Scalar(const TemporalFilterRowU16& row, const TemporalFilterParams& params);
+	// The recursive filter has no memory traffic to save with SIMD and only has a scalar kernel
+	static void temporalFilterRowRecursive(const TemporalFilterRowRecursive& row, const TemporalFilterParams& params);
+
+	// Cache line aligned buffers
+	template<class T>
+	static T* allocateAligned(size_t count){
+		return static_cast<T*>(allocateAlignedBytes(count*sizeof(T)));
+	}
+	static void* allocateAlignedBytes(size_t numBytes);
+	static void freeAligned(void* buffer);
+	// Row stride of the statistics planes
+	static int paddedStride(int width){
+		return (width + 15) & ~15;
+	}
+
+private:
+	static void selectKernels();
+};
@@ -0,0 +1,143 @@
+/***********************************************************************
+FramePool - Fixed pool of reference-counted frames recycled once
+every consumer has released them.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <atomic>
+#include <memory>
+#include <vector>
+
+template<class T> class FramePool;
+
+// A frame of the pool with its intrusive reference count
+template<class T>
+struct PooledFrame {
+	PooledFrame()
+	:refCount(0)
+	{
+	}
+
+	T data;
+	std::atomic<int> refCount;
+};
+
+//! Shared handle on a pooled frame
+/** Frames are immutable once shared: only the producer that acquired the frame
+    writes in it (with edit()) before handing copies of the handle to the consumers.
+    The frame returns to its pool when the last handle is released.*/
+template<class T>
+class FrameRef {
+public:
+	FrameRef()
+	:frame(nullptr)
+	{
+	}
+	FrameRef(const FrameRef& other)
+	:frame(other.frame)
+	{
+		if (frame != nullptr)
+			frame->refCount.fetch_add(1, std::memory_order_relaxed);
+	}
+	FrameRef(FrameRef&& other)
+	:frame(other.frame)
+	{
+		other.frame = nullptr;
+	}
+	~FrameRef(){
+		release();
+	}
+
+	FrameRef& operator=(const FrameRef& other){
+		if (other.frame != nullptr)
+			other.frame->refCount.fetch_add(1, std::memory_order_relaxed);
+		release();
+		frame = other.frame;
+		return *this;
+	}
+	FrameRef& operator=(FrameRef&& other){
+		if (this != &other)
+		{
+			release();
+			frame = other.frame;
+			other.frame = nullptr;
+		}
+		return *this;
+	}
+
+	void release(){
+		if (frame != nullptr)
+			frame->refCount.fetch_sub(1, std::memory_order_acq_rel);
+		frame = nullptr;
+	}
+
+	bool isValid() const {
+		return frame != nullptr;
+	}
+	const T& operator*() const {
+		return frame->data;
+	}
+	const T* operator->() const {
+		return &frame->data;
+	}
+	// Write access for the producer before the frame is shared
+	T& edit(){
+		return frame->data;
+	}
+
+private:
+	friend class FramePool<T>;
+	explicit FrameRef(PooledFrame<T>* sframe)
+	:frame(sframe)
+	{
+	}
+
+	PooledFrame<T>* frame;
+};
+
+//! Fixed size pool of frames
+/** acquire() is called by the producer thread and the frames can be released from any thread.
+    The frame content is kept when a frame is recycled so the buffers are allocated only once.*/
+template<class T>
+class FramePool {
+public:
+	FramePool(int size){
+		for (int i = 0; i < size; i++)
+			frames.push_back(std::unique_ptr<PooledFrame<T> >(new PooledFrame<T>()));
+	}
+
+	// Get a free frame - the handle is invalid if every frame is in use
+	FrameRef<T> acquire(){
+		for (auto & frame : frames)
+		{
+			int expected = 0;
+			if (frame->refCount.compare_exchange_strong(expected, 1, std::memory_order_acquire))
+				return FrameRef<T>(frame.get());
+		}
+		return FrameRef<T>();
+	}
+
+	int getSize(){
+		return frames.size();
+	}
+
+private:
+	std::vector<std::unique_ptr<PooledFrame<T> > > frames;
+};
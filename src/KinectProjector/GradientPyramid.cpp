@@ -0,0 +1,169 @@
+/***********************************************************************
+GradientPyramid - Full resolution Scharr gradient of the filtered depth
+with mip levels and bilinear sampling.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "GradientPyramid.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define GRADIENT_SSE2
+#include <emmintrin.h>
+#endif
+
+// Rows of the frame in a band processed by a worker
+static const int gradientBandRows = 16;
+
+// The Scharr kernel (3 10 3 smoothing, central difference) sums to 32 per unit of slope
+static const float scharrNormalisation = 1.0f / 32.0f;
+
+GradientPyramid::GradientPyramid()
+:maxGradient(0)
+{
+}
+
+void GradientPyramid::compute(const float* depth, int width, int height, int minX, int maxX, int minY, int maxY, float smaxGradient, WorkerPool& workers){
+	maxGradient = smaxGradient;
+	// The level buffers are kept between frames
+	int numLevels = 1;
+	for (int w = width, h = height; w > 1 || h > 1; w = (w + 1)/2, h = (h + 1)/2)
+		numLevels++;
+	levels.resize(numLevels);
+	for (int l = 0; l < numLevels; l++)
+	{
+		levels[l].width = l == 0 ? width : (levels[l-1].width + 1)/2;
+		levels[l].height = l == 0 ? height : (levels[l-1].height + 1)/2;
+		levels[l].gx.resize(levels[l].width*levels[l].height);
+		levels[l].gy.resize(levels[l].width*levels[l].height);
+	}
+
+	workers.parallelFor(0, height, gradientBandRows, [&](int y0, int y1, int /*band*/) {
+		computeRows(depth, width, minX, maxX, minY, maxY, y0, y1);
+	});
+	for (int l = 1; l < numLevels; l++)
+	{
+		workers.parallelFor(0, levels[l].height, gradientBandRows, [&](int y0, int y1, int /*band*/) {
+			downsample(l, y0, y1);
+		});
+	}
+}
+
+void GradientPyramid::computeRows(const float* depth, int width, int minX, int maxX, int minY, int maxY, int y0, int y1){
+	Level& base = levels[0];
+	for (int y = y0; y < y1; y++)
+	{
+		float* gxPtr = &base.gx[y*width];
+		float* gyPtr = &base.gy[y*width];
+		std::fill(gxPtr, gxPtr + width, 0.0f);
+		std::fill(gyPtr, gyPtr + width, 0.0f);
+		if (y < minY || y >= maxY || maxX - minX < 1)
+			continue;
+
+		// Rows above and below are clamped to the ROI
+		const float* above = depth + max(minY, y - 1)*width;
+		const float* row = depth + y*width;
+		const float* below = depth + min(maxY - 1, y + 1)*width;
+
+		// Gradient of the pixel x from the columns xl, x and xr
+		auto scharr = [&](int xl, int x, int xr) {
+			if (above[xl] == 0 || above[x] == 0 || above[xr] == 0 ||
+				row[xl] == 0 || row[x] == 0 || row[xr] == 0 ||
+				below[xl] == 0 || below[x] == 0 || below[xr] == 0)
+				return;
+			float dx = 3*(above[xr] - above[xl]) + 10*(row[xr] - row[xl]) + 3*(below[xr] - below[xl]);
+			float dy = 3*(below[xl] - above[xl]) + 10*(below[x] - above[x]) + 3*(below[xr] - above[xr]);
+			gxPtr[x] = -dx*scharrNormalisation;
+			gyPtr[x] = -dy*scharrNormalisation;
+		};
+
+		// Border columns are clamped to the ROI
+		scharr(minX, minX, min(maxX - 1, minX + 1));
+		int x = minX + 1;
+#ifdef GRADIENT_SSE2
+		const __m128 three = _mm_set1_ps(3.0f);
+		const __m128 ten = _mm_set1_ps(10.0f);
+		const __m128 minusNorm = _mm_set1_ps(-scharrNormalisation);
+		const __m128 zero = _mm_setzero_ps();
+		for (; x + 4 < maxX; x += 4)
+		{
+			__m128 al = _mm_loadu_ps(above + x - 1), ac = _mm_loadu_ps(above + x), ar = _mm_loadu_ps(above + x + 1);
+			__m128 rl = _mm_loadu_ps(row + x - 1), rc = _mm_loadu_ps(row + x), rr = _mm_loadu_ps(row + x + 1);
+			__m128 bl = _mm_loadu_ps(below + x - 1), bc = _mm_loadu_ps(below + x), br = _mm_loadu_ps(below + x + 1);
+			// Pixels next to a pixel without depth get no gradient
+			__m128 valid = _mm_and_ps(_mm_and_ps(_mm_and_ps(_mm_cmpneq_ps(al, zero), _mm_cmpneq_ps(ac, zero)), _mm_and_ps(_mm_cmpneq_ps(ar, zero), _mm_cmpneq_ps(rl, zero))),
+				_mm_and_ps(_mm_and_ps(_mm_cmpneq_ps(rc, zero), _mm_cmpneq_ps(rr, zero)), _mm_and_ps(_mm_and_ps(_mm_cmpneq_ps(bl, zero), _mm_cmpneq_ps(bc, zero)), _mm_cmpneq_ps(br, zero))));
+			__m128 dx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(three, _mm_sub_ps(ar, al)), _mm_mul_ps(ten, _mm_sub_ps(rr, rl))), _mm_mul_ps(three, _mm_sub_ps(br, bl)));
+			__m128 dy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(three, _mm_sub_ps(bl, al)), _mm_mul_ps(ten, _mm_sub_ps(bc, ac))), _mm_mul_ps(three, _mm_sub_ps(br, ar)));
+			_mm_storeu_ps(gxPtr + x, _mm_and_ps(valid, _mm_mul_ps(dx, minusNorm)));
+			_mm_storeu_ps(gyPtr + x, _mm_and_ps(valid, _mm_mul_ps(dy, minusNorm)));
+		}
+#endif
+		for (; x < maxX - 1; x++)
+			scharr(x - 1, x, x + 1);
+		if (maxX - 1 > minX)
+			scharr(maxX - 2, maxX - 1, maxX - 1);
+	}
+}
+
+void GradientPyramid::downsample(int level, int y0, int y1){
+	const Level& fine = levels[level - 1];
+	Level& coarse = levels[level];
+	for (int y = y0; y < y1; y++)
+	{
+		// The last row and column of a level with an odd size are repeated
+		const int fy0 = 2*y;
+		const int fy1 = min(2*y + 1, fine.height - 1);
+		for (int x = 0; x < coarse.width; x++)
+		{
+			int fx0 = 2*x;
+			int fx1 = min(2*x + 1, fine.width - 1);
+			coarse.gx[y*coarse.width + x] = 0.25f*(fine.gx[fy0*fine.width + fx0] + fine.gx[fy0*fine.width + fx1] + fine.gx[fy1*fine.width + fx0] + fine.gx[fy1*fine.width + fx1]);
+			coarse.gy[y*coarse.width + x] = 0.25f*(fine.gy[fy0*fine.width + fx0] + fine.gy[fy0*fine.width + fx1] + fine.gy[fy1*fine.width + fx0] + fine.gy[fy1*fine.width + fx1]);
+		}
+	}
+}
+
+ofVec2f GradientPyramid::sample(float x, float y, int level) const {
+	if (levels.empty())
+		return ofVec2f(0);
+	level = min(max(level, 0), (int)levels.size() - 1);
+	const Level& l = levels[level];
+	// Pixel (i, j) of level l covers the kinect pixels [i*2^l, (i+1)*2^l[
+	float scale = 1.0f / (1 << level);
+	float u = ofClamp((x + 0.5f)*scale - 0.5f, 0, l.width - 1);
+	float v = ofClamp((y + 0.5f)*scale - 0.5f, 0, l.height - 1);
+	int u0 = (int)u;
+	int v0 = (int)v;
+	int u1 = min(u0 + 1, l.width - 1);
+	int v1 = min(v0 + 1, l.height - 1);
+	float fu = u - u0;
+	float fv = v - v0;
+	float w00 = (1 - fu)*(1 - fv), w10 = fu*(1 - fv), w01 = (1 - fu)*fv, w11 = fu*fv;
+	int i00 = v0*l.width + u0, i10 = v0*l.width + u1, i01 = v1*l.width + u0, i11 = v1*l.width + u1;
+	ofVec2f gradient(w00*l.gx[i00] + w10*l.gx[i10] + w01*l.gx[i01] + w11*l.gx[i11],
+		w00*l.gy[i00] + w10*l.gy[i10] + w01*l.gy[i01] + w11*l.gy[i11]);
+	if (gradient.length() > maxGradient)
+		gradient.scale(maxGradient);
+	return gradient;
+}
+
+ofVec2f GradientPyramid::sampleAtScale(float x, float y, float scale) const {
+	int level = scale > 1 ? (int)floor(log2(scale) + 0.5f) : 0;
+	return sample(x, y, level);
+}
@@ -0,0 +1,65 @@
+/***********************************************************************
+GradientPyramid - Full resolution Scharr gradient of the filtered depth
+with mip levels and bilinear sampling.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <vector>
+
+#include "ofMain.h"
+#include "WorkerPool.h"
+
+//! Gradient of the sand surface at every scale
+/** Level 0 is the Scharr gradient of the depth at every kinect pixel of the ROI and
+    level l averages it over blocks of 2^l x 2^l pixels. The gradient points toward
+    decreasing depth (uphill) in depth units per kinect pixel and is 0 outside the ROI
+    and next to pixels without depth. The x and y components are stored in separate
+    planes so the rows are filtered with SIMD.*/
+class GradientPyramid {
+public:
+	GradientPyramid();
+
+	// Gradient of the depth frame in the ROI [minX, maxX[ x [minY, maxY[ - the sampled gradients are clamped to maxGradient
+	void compute(const float* depth, int width, int height, int minX, int maxX, int minY, int maxY, float maxGradient, WorkerPool& workers);
+
+	int getNumLevels() const {
+		return levels.size();
+	}
+	bool isEmpty() const {
+		return levels.empty();
+	}
+
+	// Bilinear interpolation of the gradient of a level at kinect coordinates - clamped to the frame
+	ofVec2f sample(float x, float y, int level) const;
+	// Same with the level whose blocks are the closest to scale kinect pixels
+	ofVec2f sampleAtScale(float x, float y, float scale) const;
+
+private:
+	struct Level {
+		int width, height;
+		std::vector<float> gx, gy;
+	};
+
+	void computeRows(const float* depth, int width, int minX, int maxX, int minY, int maxY, int y0, int y1);
+	void downsample(int level, int y0, int y1);
+
+	std::vector<Level> levels;
+	float maxGradient;
+};
@@ -22,8 +22,69 @@ General Public License for more details.
 #include "KinectGrabber.h"
 #include "ofConstants.h"
 
+// Frames in the triple buffer, the one being written and a few kept by the consumer
+static const int framePoolSize = 8;
+// Rows of the kinect frame in a band processed by a worker
+static const int filterBandRows = 16;
+// Activity detection: number of dirty tiles of an active frame
+static const int activeDirtyTiles = 4;
+// and raw frame comparison on one pixel out of idleSampleStep x idleSampleStep
+static const int idleSampleStep = 4;
+static const int idleRawThreshold = 20; // Millimeters
+
+// Copy the most recent samples of each pixel of an averaging ring to a ring with another number of slots
+// The kept samples are stored in chronological order from slot 0 and the other slots are unset
+template<class T>
+static void resizeAveragingRing(const T* oldRing, int oldSlots, int oldSlotIndex, T* newRing, int newSlots, T unset, int height, int stride){
+	int numKept = min(oldSlots, newSlots);
+	for (int y = 0; y < height; ++y)
+	{
+		const T* oldRow = oldRing + (size_t)y*stride*oldSlots;
+		T* newRow = newRing + (size_t)y*stride*newSlots;
+		for (int x = 0; x < stride; ++x)
+			for (int i = 0; i < newSlots; ++i)
+			{
+				T value = unset;
+				if (i < numKept)
+					value = oldRow[averagingIndex(x, (oldSlotIndex - numKept + i + oldSlots) % oldSlots, oldSlots)];
+				newRow[averagingIndex(x, i, newSlots)] = value;
+			}
+	}
+}
+
+// Statistics of the samples set in an averaging ring - accumulated in double so they are exact
+template<class T, class C, class S, class SQ>
+static void computeRingStatistics(const T* ring, int slots, T unset, C* count, S* sum, SQ* sumSq, int height, int stride){
+	for (int y = 0; y < height; ++y)
+	{
+		const T* row = ring + (size_t)y*stride*slots;
+		for (int x = 0; x < stride; ++x)
+		{
+			double n = 0, s = 0, s2 = 0;
+			for (int i = 0; i < slots; ++i)
+			{
+				T value = row[averagingIndex(x, i, slots)];
+				if (value != unset)
+				{
+					n += 1;
+					s += value;
+					s2 += (double)value*value;
+				}
+			}
+			count[y*stride + x] = static_cast<C>(n);
+			sum[y*stride + x] = static_cast<S>(s);
+			sumSq[y*stride + x] = static_cast<SQ>(s2);
+		}
+	}
+}
+
 KinectGrabber::KinectGrabber()
-:newFrame(true),
+:depthPool(framePoolSize),
+colorPool(framePoolSize),
+gradientPool(framePoolSize),
+dirtyPool(framePoolSize),
+pyramidPool(framePoolSize),
+newFrame(true),
 bufferInitiated(false),
 kinectOpened(false)
 {
@@ -47,40 +108,62 @@ void KinectGrabber::stop(){
     stopThread();
 }
 
-bool KinectGrabber::setup(){
+bool KinectGrabber::setup(std::unique_ptr<DepthSource> source){
 	// settings and defaults
-	storedframes = 0;
-	ROIAverageValue = 0;
+	frameId = 0;
 	setToGlobalAvg = 0;
 	setToLocalAvg = 0;
 	doInPaint = 0;
 	doFullFrameFiltering = false;
-
-	kinect.init();
-	kinect.setRegistration(true); // To have correspondance between RGB and depth images
-	kinect.setUseTexture(false);
-	width = kinect.getWidth();
-	height = kinect.getHeight();
+	minX = maxX = minY = maxY = 0;
+	elevationPlane = ofVec4f(0, 0, 1, 0);
+	colorEnabled = true;
+	filterStorage = FILTER_STORAGE_FLOAT;
+	setSpatialFilterParameters(1, 2);
+	dirtyTileSize = 16;
+	idleModeEnabled = false;
+	idleDelay = 30;
+	idleFilterInterval = 6;
+	idle = false;
+	idleSkippedFrames = 0;
+
+	depthSource = std::move(source);
+	if (!depthSource)
+		depthSource.reset(new KinectDepthSource());
+	if (!depthSource->setup())
+		return false;
+	width = depthSource->getWidth();
+	height = depthSource->getHeight();
+	temporalFilterRow = FrameFilterKernels::getTemporalFilterRow();
+	temporalFilterRowU16 = FrameFilterKernels::getTemporalFilterRowU16();
 
 	kinectDepthImage.allocate(width, height, 1);
     filteredframe.allocate(width, height, 1);
-    kinectColorImage.allocate(width, height);
-    kinectColorImage.setUseTexture(false);
 	return openKinect();
 }
 
 bool KinectGrabber::openKinect() {
-	kinectOpened = kinect.open();
+	kinectOpened = depthSource->open();
 	return kinectOpened;
 }
-void KinectGrabber::setupFramefilter(int sgradFieldresolution, float newMaxOffset, ofRectangle ROI, bool sspatialFilter, bool sfollowBigChange, int snumAveragingSlots) {
-    gradFieldresolution = sgradFieldresolution;
-    ofLogVerbose("kinectGrabber") << "setupFramefilter(): Gradient Field resolution: " << gradFieldresolution;
-    gradFieldcols = width / gradFieldresolution;
-    ofLogVerbose("kinectGrabber") << "setupFramefilter(): Width: " << width << " Gradient Field Cols: " << gradFieldcols;
-    gradFieldrows = height / gradFieldresolution;
-    ofLogVerbose("kinectGrabber") << "setupFramefilter(): Height: " << height << " Gradient Field Rows: " << gradFieldrows;
-    
+
+void KinectGrabber::stepReplay() {
+	depthSource->step();
+}
+
+bool KinectGrabber::startRecording(std::string path, bool recordColor, bool compressDepth) {
+	ofVec3f a = depthSource->getWorldCoordinateAt(0, 0, 1);
+	ofVec3f b = depthSource->getWorldCoordinateAt(1, 1, 1);
+	return recorder.start(path, width, height, recordColor, compressDepth, b - a, a);
+}
+
+void KinectGrabber::stopRecording() {
+	recorder.stop();
+}
+
+void KinectGrabber::setupFramefilter(float newMaxOffset, ofRectangle ROI, bool sspatialFilter, bool sfollowBigChange, int snumAveragingSlots) {
+    // Full reset - the previous buffers have the previous number of slots
+    freeBuffers();
     spatialFilter = sspatialFilter;
     followBigChange = sfollowBigChange;
     numAveragingSlots = snumAveragingSlots;
@@ -97,7 +180,7 @@ void KinectGrabber::setupFramefilter(int sgradFieldresolution, float newMaxOffse
 //    outsideROIValue = 3999;
     minInitFrame = 60;
     
-    //Setup ROI
+    //Setup ROI - nothing to remap before the buffers are initiated
     setKinectROI(ROI);
     
     //setting buffers
@@ -107,23 +190,52 @@ void KinectGrabber::setupFramefilter(int sgradFieldresolution, float newMaxOffse
 void KinectGrabber::initiateBuffers(void){
 	filteredframe.set(0);
 
-    averagingBuffer=new float[numAveragingSlots*height*width];
-    float* averagingBufferPtr=averagingBuffer;
-    for(int i=0;i<numAveragingSlots;++i)
-        for(unsigned int y=0;y<height;++y)
-            for(unsigned int x=0;x<width;++x,++averagingBufferPtr)
-                *averagingBufferPtr=initialValue;
+    /* Rows of the statistics planes and of the averaging ring are padded to whole cache lines: */
+    bufferStride = FrameFilterKernels::paddedStride(width);
+    size_t planeSize = height*bufferStride;
+    averagingBuffer = nullptr;
+    statCount = statSum = statSumSq = nullptr;
+    averagingBufferU16 = nullptr;
+    statCountU16 = statSumU16 = nullptr;
+    statSumSqU16 = nullptr;
+    if (filterStorage == FILTER_STORAGE_UINT16)
+    {
+        /* Unset slots hold 0 and the statistics are exact integers: */
+        averagingBufferU16 = FrameFilterKernels::allocateAligned<uint16_t>(numAveragingSlots*planeSize);
+        std::fill(averagingBufferU16, averagingBufferU16 + numAveragingSlots*planeSize, 0);
+        statCountU16 = FrameFilterKernels::allocateAligned<uint32_t>(planeSize);
+        statSumU16 = FrameFilterKernels::allocateAligned<uint32_t>(planeSize);
+        statSumSqU16 = FrameFilterKernels::allocateAligned<uint64_t>(planeSize);
+        std::fill(statCountU16, statCountU16 + planeSize, 0);
+        std::fill(statSumU16, statSumU16 + planeSize, 0);
+        std::fill(statSumSqU16, statSumSqU16 + planeSize, 0);
+    }
+    else if (filterStorage == FILTER_STORAGE_RECURSIVE)
+    {
+        /* No averaging ring - the statistics planes hold the number of samples, mean and variance: */
+        statCount = FrameFilterKernels::allocateAligned<float>(planeSize);
+        statSum = FrameFilterKernels::allocateAligned<float>(planeSize);
+        statSumSq = FrameFilterKernels::allocateAligned<float>(planeSize);
+        std::fill(statCount, statCount + planeSize, 0.0f);
+        std::fill(statSum, statSum + planeSize, 0.0f);
+        std::fill(statSumSq, statSumSq + planeSize, 0.0f);
+    }
+    else
+    {
+        averagingBuffer = FrameFilterKernels::allocateAligned<float>(numAveragingSlots*planeSize);
+        std::fill(averagingBuffer, averagingBuffer + numAveragingSlots*planeSize, initialValue);
+
+        /* Initialize the statistics planes: */
+        statCount = FrameFilterKernels::allocateAligned<float>(planeSize);
+        statSum = FrameFilterKernels::allocateAligned<float>(planeSize);
+        statSumSq = FrameFilterKernels::allocateAligned<float>(planeSize);
+        std::fill(statCount, statCount + planeSize, 0.0f);
+        std::fill(statSum, statSum + planeSize, 0.0f);
+        std::fill(statSumSq, statSumSq + planeSize, 0.0f);
+    }
     
     averagingSlotIndex=0;
     
-    /* Initialize the statistics buffer: */
-    statBuffer=new float[height*width*3];
-    float* sbPtr=statBuffer;
-    for(unsigned int y=0;y<height;++y)
-        for(unsigned int x=0;x<width;++x)
-            for(int i=0;i<3;++i,++sbPtr)
-                *sbPtr=0.0;
-    
     /* Initialize the valid buffer: */
     validBuffer=new float[height*width];
     float* vbPtr=validBuffer;
@@ -131,26 +243,35 @@ void KinectGrabber::initiateBuffers(void){
         for(unsigned int x=0;x<width;++x,++vbPtr)
             *vbPtr=initialValue;
     
-    /* Initialize the gradient field buffer: */
-    gradField = new ofVec2f[gradFieldcols*gradFieldrows];
-    ofVec2f* gfPtr=gradField;
-    for(unsigned int y=0;y<gradFieldrows;++y)
-        for(unsigned int x=0;x<gradFieldcols;++x,++gfPtr)
-            *gfPtr=ofVec2f(0);
+    /* Every tile is reported as changed in the first frame: */
+    dirtyTracker.setup(width, height, dirtyTileSize);
+    
+    /* The filter has to stabilize again before going idle: */
+    idle = false;
+    lastActivityTime = ofGetElapsedTimef();
     
     bufferInitiated = true;
     currentInitFrame = 0;
     firstImageReady = false;
 }
 
-void KinectGrabber::resetBuffers(void){
+void KinectGrabber::freeBuffers(void){
     if (bufferInitiated){
         bufferInitiated = false;
-        delete[] averagingBuffer;
-        delete[] statBuffer;
+        FrameFilterKernels::freeAligned(averagingBuffer);
+        FrameFilterKernels::freeAligned(statCount);
+        FrameFilterKernels::freeAligned(statSum);
+        FrameFilterKernels::freeAligned(statSumSq);
+        FrameFilterKernels::freeAligned(averagingBufferU16);
+        FrameFilterKernels::freeAligned(statCountU16);
+        FrameFilterKernels::freeAligned(statSumU16);
+        FrameFilterKernels::freeAligned(statSumSqU16);
         delete[] validBuffer;
-        delete[] gradField;
     }
+}
+
+void KinectGrabber::resetBuffers(void){
+    freeBuffers();
     initiateBuffers();
 }
 
@@ -163,30 +284,86 @@ void KinectGrabber::threadedFunction() {
         this->actions.clear();
         this->actionsLock.unlock();
         
-        kinect.update();
-        if(kinect.isFrameNew()){
-            kinectDepthImage = kinect.getRawDepthPixels();
+        depthSource->update();
+        if(depthSource->isFrameNew()){
+            frameGrabTime = ofGetElapsedTimeMicros();
+            kinectDepthImage = depthSource->getRawDepthPixels();
+            if (recorder.isRecording())
+                recorder.addFrame(kinectDepthImage, colorEnabled ? depthSource->getColorPixels() : noColor, depthSource->getTimestamp());
+            // While idle only the raw frame is checked until something moves
+            if (idle && !hasRawActivity() && ++idleSkippedFrames < idleFilterInterval)
+                continue;
+            idleSkippedFrames = 0;
             filter();
+            frameFilterTime = ofGetElapsedTimeMicros();
             filteredframe.setImageType(OF_IMAGE_GRAYSCALE);
-            updateGradientField();
-			kinectColorImage.setFromPixels(kinect.getPixels());
+            publishFrame();
         }
-        if (storedframes == 0)
-        {
-            filtered.send(std::move(filteredframe));
-			gradient.send(std::move(gradField));
-            colored.send(std::move(kinectColorImage.getPixels()));
-            lock();
-            storedframes += 1;
-            unlock();
-        }
-        
     }
-    kinect.close();
-    delete[] averagingBuffer;
-    delete[] statBuffer;
-    delete[] validBuffer;
-    delete[] gradField;
+    recorder.stop();
+    depthSource->close();
+    freeBuffers();
+}
+
+void KinectGrabber::publishFrame() {
+	// Tiles are compared with the frame where they last changed so a skipped frame is not lost
+	// The activity is tracked even when the frame cannot be published
+	dirtyTracker.update(filteredframe.getData(), hysteresis, frameId, workers);
+	updateActivity();
+
+	// Frames are recycled with their buffers so copying does not reallocate
+	FrameRef<ofFloatPixels> depth = depthPool.acquire();
+	// Without color stream the frame has no color
+	bool hasColor = colorEnabled && depthSource->isColorReady();
+	FrameRef<ofPixels> color;
+	if (hasColor)
+		color = colorPool.acquire();
+	FrameRef<GradientPyramid> gradient = gradientPool.acquire();
+	FrameRef<DirtyTiles> dirty = dirtyPool.acquire();
+	FrameRef<DepthPyramid> pyramid = pyramidPool.acquire();
+	if (!depth.isValid() || (hasColor && !color.isValid()) || !gradient.isValid() || !dirty.isValid() || !pyramid.isValid())
+	{
+		// The consumer keeps all the frames: skip this one rather than allocating
+		ofLogVerbose("kinectGrabber") << "publishFrame(): Frame pool exhausted - frame " << frameId << " not published";
+		frameId++;
+		return;
+	}
+	depth.edit() = filteredframe;
+	if (hasColor)
+		color.edit() = depthSource->getColorPixels();
+	// The gradient is computed in the pooled frame whose levels are reused
+	gradient.edit().compute(filteredframe.getData(), width, height, minX, maxX, minY, maxY, maxgradfield, workers);
+	pyramid.edit().compute(filteredframe.getData(), width, height, minX, maxX, minY, maxY, elevationWorldMatrix, elevationPlane, workers);
+	dirtyTracker.publish(dirty.edit());
+
+	FrameBundle& bundle = frames.getWriteBuffer();
+	bundle.depth = std::move(depth);
+	bundle.color = std::move(color);
+	bundle.gradient = std::move(gradient);
+	bundle.dirty = std::move(dirty);
+	bundle.pyramid = std::move(pyramid);
+	bundle.frameId = frameId++;
+	bundle.timestamp = depthSource->getTimestamp();
+	bundle.stabilized = firstImageReady;
+	bundle.idle = idle;
+	bundle.grabTime = frameGrabTime;
+	bundle.filterTime = frameFilterTime;
+	frames.publish();
+}
+
+bool KinectGrabber::setColorEnabled(bool enabled) {
+	if (enabled == colorEnabled)
+		return true;
+	colorEnabled = enabled;
+	if (!depthSource->setColorEnabled(enabled))
+	{
+		// The kinect is closed: the projector tries to open it again
+		kinectOpened = false;
+		ofLogError("kinectGrabber") << "setColorEnabled(): Kinect lost while switching the color stream";
+		return false;
+	}
+	ofLogVerbose("kinectGrabber") << "setColorEnabled(): Color stream " << (colorEnabled ? "enabled" : "disabled");
+	return true;
 }
 
 void KinectGrabber::performInThread(std::function<void(KinectGrabber&)> action) {
@@ -200,24 +377,15 @@ void KinectGrabber::filter()
 	if (bufferInitiated && numAveragingSlots < 2)
 	{
 		// Just copy raw kinect data
-		const RawDepth* inputFramePtr = static_cast<const RawDepth*>(kinectDepthImage.getData());
-		float* filteredFramePtr = filteredframe.getData();
-		inputFramePtr += minY*width;  // We only scan kinect ROI
-		filteredFramePtr += minY*width;
-
-		for (unsigned int y = minY; y < maxY; ++y)
-		{
-			inputFramePtr += minX;
-			filteredFramePtr += minX;
-
-			for (unsigned int x = minX; x < maxX; ++x, ++inputFramePtr, ++filteredFramePtr)
+		workers.parallelFor(minY, maxY, filterBandRows, [this](int y0, int y1, int /*band*/) {
+			for (int y = y0; y < y1; ++y)
 			{
-				float newVal = static_cast<float>(*inputFramePtr);
-				*filteredFramePtr = newVal;
+				const RawDepth* inputFramePtr = static_cast<const RawDepth*>(kinectDepthImage.getData()) + y*width;
+				float* filteredFramePtr = filteredframe.getData() + y*width;
+				for (int x = minX; x < maxX; ++x)
+					filteredFramePtr[x] = static_cast<float>(inputFramePtr[x]);
 			}
-			inputFramePtr += width - maxX;
-			filteredFramePtr += width - maxX;
-		}
+		});
 
 		if (doInPaint)
 		{
@@ -231,83 +399,71 @@ void KinectGrabber::filter()
 	}
 	else if (bufferInitiated)
     {
-        const RawDepth* inputFramePtr = static_cast<const RawDepth*>(kinectDepthImage.getData());
-        float* averagingBufferPtr = averagingBuffer+averagingSlotIndex*height*width;
-        float* statBufferPtr = statBuffer;
-        float* validBufferPtr = validBuffer;
-        float* filteredFramePtr = filteredframe.getData();
-        
-        inputFramePtr += minY*width;  // We only scan kinect ROI
-        averagingBufferPtr += minY*width;
-        statBufferPtr += minY*width*3;
-        validBufferPtr += minY*width;
-        filteredFramePtr += minY*width;
-
-		for(unsigned int y=minY ; y<maxY ; ++y)
-        {
-            inputFramePtr += minX;
-            averagingBufferPtr += minX;
-            statBufferPtr += minX*3;
-            validBufferPtr += minX;
-            filteredFramePtr += minX;
-            for(unsigned int x=minX ; x<maxX ; ++x,++inputFramePtr,++averagingBufferPtr,statBufferPtr+=3,++validBufferPtr,++filteredFramePtr)
+        // Filter the ROI with the fastest kernel available
+        TemporalFilterParams params;
+        params.numAveragingSlots = numAveragingSlots;
+        params.minNumSamples = minNumSamples;
+        params.maxVariance = maxVariance;
+        params.initialValue = initialValue;
+        params.hysteresis = hysteresis;
+        params.followBigChange = followBigChange;
+        params.bigChange = bigChange;
+        params.maxOffset = maxOffset;
+
+        // Filter the ROI by bands of rows in parallel - the rows are independent
+        workers.parallelFor(minY, maxY, filterBandRows, [&](int y0, int y1, int /*band*/) {
+            if (filterStorage == FILTER_STORAGE_UINT16)
             {
-                float newVal = static_cast<float>(*inputFramePtr);
-                float oldVal = *averagingBufferPtr;
-                
-				if(newVal > maxOffset)//we are under the ceiling plane
+                TemporalFilterRowU16 row;
+                row.slotIndex = averagingSlotIndex;
+                row.start = minX;
+                row.end = maxX;
+                for (int y = y0; y < y1; ++y)
                 {
-                    *averagingBufferPtr = newVal; // Store the value
-                    if (followBigChange && statBufferPtr[0] > 0){ // Follow big changes
-                        float oldFiltered = statBufferPtr[1]/statBufferPtr[0]; // Compare newVal with average
-                        if(oldFiltered-newVal >= bigChange || newVal-oldFiltered >= bigChange)
-                        {
-                            float* aaveragingBufferPtr;
-                            for (int i = 0; i < numAveragingSlots; i++){ // update all averaging slots
-                                aaveragingBufferPtr = averagingBuffer + i*height*width + y*width +x;
-                                *aaveragingBufferPtr = newVal;
-                            }
-                            statBufferPtr[0] = numAveragingSlots; //Update statistics
-                            statBufferPtr[1] = newVal*numAveragingSlots;
-                            statBufferPtr[2] = newVal*newVal*numAveragingSlots;
-                        }
-                    }
-                    /* Update the pixel's statistics: */
-                    ++statBufferPtr[0]; // Number of valid samples
-                    statBufferPtr[1] += newVal; // Sum of valid samples
-                    statBufferPtr[2] += newVal*newVal; // Sum of squares of valid samples
-                    
-                    /* Check if the previous value in the averaging buffer was not initiated */
-                    if(oldVal != initialValue)
-                    {
-                        --statBufferPtr[0]; // Number of valid samples
-                        statBufferPtr[1] -= oldVal; // Sum of valid samples
-                        statBufferPtr[2] -= oldVal * oldVal; // Sum of squares of valid samples
-                    }
+                    row.input = static_cast<const RawDepth*>(kinectDepthImage.getData()) + y*width;
+                    row.averaging = averagingBufferU16 + y*bufferStride*numAveragingSlots;
+                    row.count = statCountU16 + y*bufferStride;
+                    row.sum = statSumU16 + y*bufferStride;
+                    row.sumSq = statSumSqU16 + y*bufferStride;
+                    row.valid = validBuffer + y*width;
+                    row.filtered = filteredframe.getData() + y*width;
+                    temporalFilterRowU16(row, params);
                 }
-                // Check if the pixel is "stable": */
-                if(statBufferPtr[0] >= minNumSamples &&
-                   statBufferPtr[2]*statBufferPtr[0] <= maxVariance*statBufferPtr[0]*statBufferPtr[0] + statBufferPtr[1]*statBufferPtr[1])
+                return;
+            }
+            if (filterStorage == FILTER_STORAGE_RECURSIVE)
+            {
+                TemporalFilterRowRecursive row;
+                row.start = minX;
+                row.end = maxX;
+                for (int y = y0; y < y1; ++y)
                 {
-                    /* Check if the new running mean is outside the previous value's envelope: */
-                    float newFiltered = statBufferPtr[1]/statBufferPtr[0];
-                    if(abs(newFiltered-*validBufferPtr) >= hysteresis)
-                    {
-                        /* Set the output pixel value to the depth-corrected running mean: */
-                        *filteredFramePtr = *validBufferPtr = newFiltered;
-                    } else {
-                        /* Leave the pixel at its previous value: */
-                        *filteredFramePtr = *validBufferPtr;
-                    }
+                    row.input = static_cast<const RawDepth*>(kinectDepthImage.getData()) + y*width;
+                    row.count = statCount + y*bufferStride;
+                    row.mean = statSum + y*bufferStride;
+                    row.variance = statSumSq + y*bufferStride;
+                    row.valid = validBuffer + y*width;
+                    row.filtered = filteredframe.getData() + y*width;
+                    FrameFilterKernels::temporalFilterRowRecursive(row, params);
                 }
-                *filteredFramePtr = *validBufferPtr;
-			}
-            inputFramePtr += width-maxX;
-            averagingBufferPtr += width-maxX;
-            statBufferPtr += (width-maxX)*3;
-            validBufferPtr += width-maxX;
-            filteredFramePtr += width-maxX;
-        }
+                return;
+            }
+            TemporalFilterRow row;
+            row.slotIndex = averagingSlotIndex;
+            row.start = minX;
+            row.end = maxX;
+            for (int y = y0; y < y1; ++y)
+            {
+                row.input = static_cast<const RawDepth*>(kinectDepthImage.getData()) + y*width;
+                row.averaging = averagingBuffer + y*bufferStride*numAveragingSlots;
+                row.count = statCount + y*bufferStride;
+                row.sum = statSum + y*bufferStride;
+                row.sumSq = statSumSq + y*bufferStride;
+                row.valid = validBuffer + y*width;
+                row.filtered = filteredframe.getData() + y*width;
+                temporalFilterRow(row, params);
+            }
+        });
 
         /* Go to the next averaging slot: */
         if(++averagingSlotIndex==numAveragingSlots)
@@ -341,211 +497,118 @@ void KinectGrabber::setFullFrameFiltering(bool ff, ofRectangle ROI)
 	}
 	else 
 	{
-		setKinectROI(ROI);
-		float *data = filteredframe.getData();
-
-		// Clear all pixels outside ROI
-		for (unsigned int y = 0; y < height; y++)
-		{
-			for (unsigned int x = 0; x < width; x++)
-			{
-				if (y < minY || y >= maxY || x < minX || x >= maxX)
-				{
-					int idx = y * width + x;
-					data[idx] = 0;
-				}
-			}
-		}
-
+		setKinectROI(ROI); // Clears the pixels leaving the ROI
 	}
 }
 
-void KinectGrabber::applySpaceFilter()
-{
-    for(int filterPass=0;filterPass<2;++filterPass)
-    {
-		// Pointer to first pixel of ROI
-		float *ptrOffset = filteredframe.getData() + minY * width + minX;
-
-        // Low-pass filter the values in the ROI
-		// First a horisontal pass
-        for(unsigned int x = 0; x < width; x++)
-        {
-			// Pointer to current pixel
-            float* colPtr = ptrOffset + x;
-			float lastVal = *colPtr;
-
-            // Top border pixels 
-            *colPtr = (colPtr[0]*2.0f + colPtr[width]) / 3.0f;
-            colPtr += width;
-            
-            // Filter the interior pixels in the column
-            for(unsigned int y = minY+1; y < maxY-1; ++y, colPtr += width)
-            {
-				float nextLastVal = *colPtr;
-                *colPtr=(lastVal + colPtr[0]*2.0f + colPtr[width])*0.25f;
-				lastVal = nextLastVal; // To avoid using already updated pixels
-            }
-            
-            // Filter the last pixel in the column: 
-            *colPtr=(lastVal + colPtr[0] * 2.0f)/3.0f;
-        }
-
-		// then a vertical pass
-        for(unsigned int y = 0; y < height; y++)
-        {
-			// Pointer to current pixel
-			float* rowPtr = ptrOffset + y * width;
-			
-			// Filter the first pixel in the row: 
-            float lastVal=*rowPtr;
-            *rowPtr=(rowPtr[0]*2.0f + rowPtr[1]) / 3.0f;
-            rowPtr++;
-       
-            // Filter the interior pixels in the row: 
-            for(unsigned int x = minX+1; x < maxX-1; ++x,++rowPtr)
-            {
-                float nextLastVal=*rowPtr;
-                *rowPtr=(lastVal+rowPtr[0]*2.0f+rowPtr[1])*0.25f;
-                lastVal=nextLastVal;
-            }
-            
-            // Filter the last pixel in the row: 
-            *rowPtr=(lastVal+rowPtr[0]*2.0f)/3.0f;
-        }
-    }
-}
-
-void KinectGrabber::updateGradientField()
-{
-    int ind = 0;
-    float gx;
-    float gy;
-    int gvx, gvy;
-    float lgth = 0;
-    float* filteredFramePtr=filteredframe.getData();
-    for(unsigned int y=0;y<gradFieldrows;++y) {
-        for(unsigned int x=0;x<gradFieldcols;++x) {
-            if (isInsideROI(x*gradFieldresolution, y*gradFieldresolution) && isInsideROI((x+1)*gradFieldresolution, (y+1)*gradFieldresolution) ){
-                gx = 0;
-                gvx = 0;
-                gy = 0;
-                gvy = 0;
-                for (unsigned int i=0; i<gradFieldresolution; i++) {
-                    ind = y*gradFieldresolution*width+i*width+x*gradFieldresolution;
-                    if (filteredFramePtr[ind]!= 0 && filteredFramePtr[ind+gradFieldresolution-1]!=0){
-                        gvx+=1;
-                        gx+=filteredFramePtr[ind]-filteredFramePtr[ind+gradFieldresolution-1];
-                    }
-                    ind = y*gradFieldresolution*width+i+x*gradFieldresolution;
-                    if (filteredFramePtr[ind]!= 0 && filteredFramePtr[ind+(gradFieldresolution-1)*width]!=0){
-                        gvy+=1;
-                        gy+=filteredFramePtr[ind]-filteredFramePtr[ind+(gradFieldresolution-1)*width];
-                    }
-                }
-                if (gvx !=0 && gvy !=0)
-                    gradField[y*gradFieldcols+x]=ofVec2f(gx/gradFieldresolution/gvx, gy/gradFieldresolution/gvy);
-                if (gradField[y*gradFieldcols+x].length() > maxgradfield){
-                    gradField[y*gradFieldcols+x].scale(maxgradfield);// /= gradField[y*gradFieldcols+x].length()*maxgradfield;
-                    lgth+=1;
-                }
-            } else {
-                gradField[y*gradFieldcols+x] = ofVec2f(0);
-            }
-        }
-    }
+void KinectGrabber::setSpatialFilterParameters(int sradius, int spasses){
+	spatialFilterRadius = max(1, min(sradius, 5));
+	spatialFilterPasses = max(1, spasses);
+	// Binomial weights - radius 1 gives the 1 2 1 kernel
+	spatialFilterWeights.assign(2*spatialFilterRadius+1, 1.0f);
+	for (int k = 1; k < 2*spatialFilterRadius; k++)
+		spatialFilterWeights[k] = spatialFilterWeights[k-1] * (2*spatialFilterRadius-k+1) / k;
+	ofLogVerbose("kinectGrabber") << "setSpatialFilterParameters(): Radius: " << spatialFilterRadius << " Passes: " << spatialFilterPasses;
 }
 
-
-float KinectGrabber::findInpaintValue(float *data, int x, int y)
+// Filter the pixels [minX, maxX[ of a row with a binomial kernel
+// Taps outside [minX, maxX[ are dropped and the weights of the remaining ones renormalised
+static void filterRowBinomial(const float* in, float* out, int minX, int maxX, const std::vector<float>& weights)
 {
-	int sideLength = 5;
-
-	// We do not search outside ROI
-	int tminx = max(minX, x - sideLength);
-	int tmaxx = min(maxX, x + sideLength);
-	int tminy = max(minY, y - sideLength);
-	int tmaxy = min(maxY, y + sideLength);
-
-	int samples = 0;
-	double sumval = 0;
-	for (int y = tminy; y < tmaxy; y++)
+	int radius = weights.size()/2;
+	float scale = 1.0f / (1 << 2*radius); // Sum of the weights - exact power of two
+	int interiorMin = min(maxX, minX + radius);
+	int interiorMax = max(interiorMin, maxX - radius);
+	for (int x = minX; x < maxX; x++)
 	{
-		for (int x = tminx; x < tmaxy; x++)
+		if (x == interiorMin) // Interior pixels - every tap is inside
 		{
-			int idx = y * width + x;
-			float val = data[idx];
-			if (val != 0 && val != initialValue)
+			for (; x < interiorMax; x++)
 			{
-				samples++;
-				sumval += val;
+				const float* inPtr = in + x - radius;
+				float sum = 0;
+				for (int k = 0; k <= 2*radius; k++)
+					sum += weights[k] * inPtr[k];
+				out[x] = sum * scale;
 			}
+			if (x == maxX)
+				break;
+		}
+		float sum = 0;
+		float norm = 0;
+		for (int k = max(0, radius - (x - minX)); k <= min(2*radius, radius + (maxX - 1 - x)); k++)
+		{
+			sum += weights[k] * in[x - radius + k];
+			norm += weights[k];
 		}
+		out[x] = sum / norm;
 	}
-	// No valid samples found in neighboorhood
-	if (samples == 0)
-		return 0;
-
-	return sumval / samples;
 }
 
-void KinectGrabber::applySimpleOutlierInpainting()
+void KinectGrabber::applySpaceFilter()
 {
-	float *data = filteredframe.getData();
-
-	// Estimate overall average inside ROI
-	int samples = 0;
-	ROIAverageValue = 0;
-	for (unsigned int y = minY; y < maxY; y++)
-	{
-		for (unsigned int x = minX; x < maxX; x++)
-		{
-			int idx = y * width + x;
-			float val = data[idx];
-			if (val != 0 && val != initialValue)
-			{
-				samples++;
-				ROIAverageValue += val;
-			}
-		}
-	}
-	// No valid samples found in ROI - strange situation
-	if (samples == 0)
-		ROIAverageValue = initialValue;
-	
-	ROIAverageValue /= samples;
+	if (maxY <= minY || maxX <= minX)
+		return;
+	if (spaceFilterBuffer.getWidth() != width || spaceFilterBuffer.getHeight() != height)
+		spaceFilterBuffer.allocate(width, height, 1);
+
+	// Separable binomial low-pass filter restricted to the ROI
+	// Both passes stream along the rows: the vertical pass combines whole rows of
+	// the frame into a row of the buffer and the horizontal pass filters the rows
+	// of the buffer back into the frame. The rows read around a band (its halo) are
+	// only read, so the bands are independent.
+	const std::vector<float>& weights = spatialFilterWeights;
+	int radius = spatialFilterRadius;
+	float scale = 1.0f / (1 << 2*radius);
+	int ROIwidth = maxX - minX;
+    for(int filterPass=0;filterPass<spatialFilterPasses;++filterPass)
+    {
+		float* data = filteredframe.getData();
+		float* buffer = spaceFilterBuffer.getData();
 
-	setToLocalAvg = 0;
-	setToGlobalAvg = 0;
-	// Filter ROI
-	for (unsigned int y = max(0, minY-2); y < min((int)height, maxY+2); y++)
-	{
-		for (unsigned int x = max(0, minX-2); x < min((int)width, maxX+2); x++)
-		{
-	//for (unsigned int y = minY; y < maxY; y++)
-	//{
-	//	for (unsigned int x = minX; x < maxX; x++)
-	//	{
-			int idx = y * width + x;
-			float val = data[idx];
-
-			if (val == 0 || val == initialValue)
+		// Vertical pass from the frame to the buffer
+		workers.parallelFor(minY, maxY, filterBandRows, [&](int y0, int y1, int /*band*/) {
+			for (int y = y0; y < y1; ++y)
 			{
-				float newval = findInpaintValue(data, x, y);
-				if (newval == 0)
+				float* outPtr = buffer + y*width + minX;
+				int kmin = max(0, radius - (y - minY));
+				int kmax = min(2*radius, radius + (maxY - 1 - y));
+				float norm = 0;
+				for (int k = kmin; k <= kmax; k++)
 				{
-					newval = ROIAverageValue;
-					setToGlobalAvg++;
+					const float* rowPtr = data + (y - radius + k)*width + minX;
+					float weight = weights[k];
+					if (k == kmin)
+						for (int x = 0; x < ROIwidth; ++x)
+							outPtr[x] = weight * rowPtr[x];
+					else
+						for (int x = 0; x < ROIwidth; ++x)
+							outPtr[x] += weight * rowPtr[x];
+					norm += weight;
 				}
-				else
-				{
-
-					setToLocalAvg++;
-				}
-				data[idx] = newval;
+				if (kmin == 0 && kmax == 2*radius) // Interior rows
+					for (int x = 0; x < ROIwidth; ++x)
+						outPtr[x] *= scale;
+				else // Border rows
+					for (int x = 0; x < ROIwidth; ++x)
+						outPtr[x] /= norm;
 			}
-		}
-	}
+		});
+
+		// then a horizontal pass from the buffer back to the frame
+		workers.parallelFor(minY, maxY, filterBandRows, [&](int y0, int y1, int /*band*/) {
+			for (int y = y0; y < y1; ++y)
+				filterRowBinomial(buffer + y*width, data + y*width, minX, maxX, weights);
+		});
+    }
+}
+
+void KinectGrabber::applySimpleOutlierInpainting()
+{
+	// Fill the ROI and a margin of 2 pixels around it
+	inpainter.inpaint(filteredframe.getData(), width, height, minX, maxX, minY, maxY, 2, initialValue, workers);
+	setToLocalAvg = inpainter.getNumLocalFills();
+	setToGlobalAvg = inpainter.getNumPyramidFills();
 }
 
 bool KinectGrabber::isInsideROI(int x, int y){
@@ -555,6 +618,10 @@ bool KinectGrabber::isInsideROI(int x, int y){
 }
 
 void KinectGrabber::setKinectROI(ofRectangle ROI){
+	int oldMinX = minX;
+	int oldMaxX = maxX;
+	int oldMinY = minY;
+	int oldMaxY = maxY;
 	if (doFullFrameFiltering)
 	{
 		minX = 0;
@@ -576,54 +643,192 @@ void KinectGrabber::setKinectROI(ofRectangle ROI){
 	}
     //ROIwidth = maxX-minX;
     //ROIheight = maxY-minY;
-    resetBuffers();
+    if (bufferInitiated)
+        remapROI(oldMinX, oldMaxX, oldMinY, oldMaxY);
+}
+
+// Keep the filter state inside both ROIs, restart the pixels entering the ROI on their raw depth
+// and clear the output of the pixels leaving it
+void KinectGrabber::remapROI(int oldMinX, int oldMaxX, int oldMinY, int oldMaxY){
+    float* data = filteredframe.getData();
+    int entering = 0;
+    for (int y = 0; y < (int)height; y++)
+    {
+        bool inNewRows = y >= minY && y < maxY;
+        bool inOldRows = y >= oldMinY && y < oldMaxY;
+        if (!inNewRows && !inOldRows)
+            continue;
+        for (int x = 0; x < (int)width; x++)
+        {
+            bool inNew = inNewRows && x >= minX && x < maxX;
+            bool inOld = inOldRows && x >= oldMinX && x < oldMaxX;
+            if (inNew && !inOld)
+            {
+                seedPixel(x, y);
+                entering++;
+            }
+            else if (!inNew && inOld)
+                data[y*width + x] = 0;
+        }
+    }
+    ofLogVerbose("kinectGrabber") << "remapROI(): ROI " << minX << " " << minY << " " << maxX << " " << maxY << " - " << entering << " pixels restarted";
+}
+
+void KinectGrabber::seedPixel(int x, int y){
+    float value = kinectDepthImage.getData()[y*width + x];
+    bool set = value != 0 && value > maxOffset;
+    int offset = x + y*bufferStride;
+    if (filterStorage == FILTER_STORAGE_UINT16)
+    {
+        uint16_t* averagingPtr = averagingBufferU16 + (size_t)y*bufferStride*numAveragingSlots;
+        for (int i = 0; i < numAveragingSlots; i++)
+            averagingPtr[averagingIndex(x, i, numAveragingSlots)] = set ? (uint16_t)value : 0;
+        uint32_t n = set ? numAveragingSlots : 0;
+        statCountU16[offset] = n;
+        statSumU16[offset] = n*(uint32_t)value;
+        statSumSqU16[offset] = (uint64_t)n*(uint64_t)value*(uint64_t)value;
+    }
+    else if (filterStorage == FILTER_STORAGE_RECURSIVE)
+    {
+        statCount[offset] = set ? numAveragingSlots : 0;
+        statSum[offset] = set ? value : 0;
+        statSumSq[offset] = 0;
+    }
+    else
+    {
+        float* averagingPtr = averagingBuffer + (size_t)y*bufferStride*numAveragingSlots;
+        for (int i = 0; i < numAveragingSlots; i++)
+            averagingPtr[averagingIndex(x, i, numAveragingSlots)] = set ? value : initialValue;
+        float n = set ? numAveragingSlots : 0;
+        statCount[offset] = n;
+        statSum[offset] = n*value;
+        statSumSq[offset] = n*value*value;
+    }
+    validBuffer[y*width + x] = set ? value : initialValue;
+    filteredframe.getData()[y*width + x] = validBuffer[y*width + x];
 }
 
 void KinectGrabber::setAveragingSlotsNumber(int snumAveragingSlots){
-    if (bufferInitiated){
-            bufferInitiated = false;
-            delete[] averagingBuffer;
-            delete[] statBuffer;
-            delete[] validBuffer;
-            delete[] gradField;
+    if (bufferInitiated && filterStorage != FILTER_STORAGE_RECURSIVE && snumAveragingSlots != numAveragingSlots)
+    {
+        // Resize the ring with the most recent samples and recompute the statistics from them
+        size_t planeSize = height*bufferStride;
+        if (filterStorage == FILTER_STORAGE_UINT16)
+        {
+            uint16_t* ring = FrameFilterKernels::allocateAligned<uint16_t>(snumAveragingSlots*planeSize);
+            resizeAveragingRing(averagingBufferU16, numAveragingSlots, averagingSlotIndex, ring, snumAveragingSlots, (uint16_t)0, height, bufferStride);
+            FrameFilterKernels::freeAligned(averagingBufferU16);
+            averagingBufferU16 = ring;
+            computeRingStatistics(ring, snumAveragingSlots, (uint16_t)0, statCountU16, statSumU16, statSumSqU16, height, bufferStride);
         }
+        else
+        {
+            float* ring = FrameFilterKernels::allocateAligned<float>(snumAveragingSlots*planeSize);
+            resizeAveragingRing(averagingBuffer, numAveragingSlots, averagingSlotIndex, ring, snumAveragingSlots, initialValue, height, bufferStride);
+            FrameFilterKernels::freeAligned(averagingBuffer);
+            averagingBuffer = ring;
+            computeRingStatistics(ring, snumAveragingSlots, initialValue, statCount, statSum, statSumSq, height, bufferStride);
+        }
+        averagingSlotIndex = min(numAveragingSlots, snumAveragingSlots) % snumAveragingSlots;
+    }
+    // The recursive filter caps its number of samples on the next frame
     numAveragingSlots = snumAveragingSlots;
     minNumSamples=(numAveragingSlots+1)/2;
-    initiateBuffers();
+    ofLogVerbose("kinectGrabber") << "setAveragingSlotsNumber(): " << numAveragingSlots << " averaging slots";
 }
 
-void KinectGrabber::setGradFieldResolution(int sgradFieldresolution){
-    if (bufferInitiated){
-        bufferInitiated = false;
-        delete[] averagingBuffer;
-        delete[] statBuffer;
-        delete[] validBuffer;
-        delete[] gradField;
+void KinectGrabber::setDirtyTileSize(int stileSize){
+    dirtyTileSize = stileSize <= 16 ? 16 : 32;
+    ofLogVerbose("kinectGrabber") << "setDirtyTileSize(): Dirty tile size: " << dirtyTileSize;
+    // The filter state is kept - only the change tracking restarts
+    dirtyTracker.setup(width, height, dirtyTileSize);
+}
+
+void KinectGrabber::setIdleMode(bool enabled, float delay, int filterInterval){
+    idleModeEnabled = enabled;
+    idleDelay = delay;
+    idleFilterInterval = max(1, filterInterval);
+    idle = false;
+    lastActivityTime = ofGetElapsedTimef();
+    ofLogVerbose("kinectGrabber") << "setIdleMode(): Enabled: " << idleModeEnabled << " Delay: " << idleDelay << " Filter interval: " << idleFilterInterval;
+}
+
+bool KinectGrabber::hasRawActivity(){
+    const RawDepth* raw = kinectDepthImage.getData();
+    const RawDepth* reference = idleReference.getData();
+    int numSamples = 0;
+    int numChanged = 0;
+    for (int y = minY; y < maxY; y += idleSampleStep)
+    {
+        for (int x = minX; x < maxX; x += idleSampleStep)
+        {
+            int ind = y*width + x;
+            // Pixels without depth flicker in the shadows and are ignored
+            if (raw[ind] == 0 || reference[ind] == 0)
+                continue;
+            numSamples++;
+            if (abs((int)raw[ind] - (int)reference[ind]) > idleRawThreshold)
+                numChanged++;
+        }
     }
-    gradFieldresolution = sgradFieldresolution;
+    if (numChanged <= numSamples/200 + 4)
+        return false;
+    ofLogVerbose("kinectGrabber") << "hasRawActivity(): " << numChanged << " pixels moved - leaving idle mode";
+    idle = false;
+    lastActivityTime = ofGetElapsedTimef();
+    return true;
+}
+
+void KinectGrabber::updateActivity(){
+    float now = ofGetElapsedTimef();
+    if (!firstImageReady || dirtyTracker.getNumDirtyTiles() >= activeDirtyTiles)
+        lastActivityTime = now;
+    bool wasIdle = idle;
+    idle = idleModeEnabled && now - lastActivityTime > idleDelay;
+    if (idle && !wasIdle)
+    {
+        // The raw frames are compared with the sand as it was when it stopped moving
+        idleReference = kinectDepthImage;
+        ofLogVerbose("kinectGrabber") << "updateActivity(): No change for " << idleDelay << " s - entering idle mode";
+    }
+}
+
+void KinectGrabber::setFilterStorage(Filter_storage sfilterStorage){
+    if (sfilterStorage == filterStorage)
+        return;
+    freeBuffers();
+    filterStorage = sfilterStorage;
+    const char* storageNames[] = {"float", "uint16", "recursive"};
+    ofLogVerbose("kinectGrabber") << "setFilterStorage(): Using " << storageNames[filterStorage] << " filter buffers";
     initiateBuffers();
 }
 
 void KinectGrabber::setFollowBigChange(bool newfollowBigChange){
-    if (bufferInitiated){
-        bufferInitiated = false;
-        delete[] averagingBuffer;
-        delete[] statBuffer;
-        delete[] validBuffer;
-        delete[] gradField;
-    }
+    // Only changes how the next samples are filtered
     followBigChange = newfollowBigChange;
-    initiateBuffers();
 }
 
 ofVec3f KinectGrabber::getStatBuffer(int x, int y){
-    float* statBufferPtr = statBuffer+3*(x + y*width);
-    return ofVec3f(statBufferPtr[0], statBufferPtr[1], statBufferPtr[2]);
+    int offset = x + y*bufferStride;
+    if (filterStorage == FILTER_STORAGE_UINT16)
+        return ofVec3f(statCountU16[offset], statSumU16[offset], statSumSqU16[offset]);
+    if (filterStorage == FILTER_STORAGE_RECURSIVE)
+    {
+        // Same sums as the ring would hold for the current mean and variance
+        float count = statCount[offset];
+        float mean = statSum[offset];
+        return ofVec3f(count, mean*count, (statSumSq[offset] + mean*mean)*count);
+    }
+    return ofVec3f(statCount[offset], statSum[offset], statSumSq[offset]);
 }
 
 float KinectGrabber::getAveragingBuffer(int x, int y, int slotNum){
-    float* averagingBufferPtr = averagingBuffer + slotNum*height*width + (x + y*width);
-    return *averagingBufferPtr;
+    size_t index = y*bufferStride*numAveragingSlots + averagingIndex(x, slotNum, numAveragingSlots);
+    if (filterStorage == FILTER_STORAGE_UINT16)
+        return averagingBufferU16[index] != 0 ? averagingBufferU16[index] : initialValue;
+    if (filterStorage == FILTER_STORAGE_RECURSIVE) // No samples are kept: every slot holds the mean
+        return statCount[x + y*bufferStride] > 0 ? statSum[x + y*bufferStride] : initialValue;
+    return averagingBuffer[index];
 }
 
 float KinectGrabber::getValidBuffer(int x, int y){
@@ -634,8 +839,8 @@ float KinectGrabber::getValidBuffer(int x, int y){
 ofMatrix4x4 KinectGrabber::getWorldMatrix() {
 	auto mat = ofMatrix4x4();
 	if (kinectOpened) {
-		ofVec3f a = kinect.getWorldCoordinateAt(0, 0, 1);// Trick to access kinect internal parameters without having to modify ofxKinect
-		ofVec3f b = kinect.getWorldCoordinateAt(1, 1, 1);
+		ofVec3f a = depthSource->getWorldCoordinateAt(0, 0, 1);// Trick to access kinect internal parameters without having to modify ofxKinect
+		ofVec3f b = depthSource->getWorldCoordinateAt(1, 1, 1);
 		ofLogVerbose("kinectGrabber") << "getWorldMatrix(): Computing kinect world matrix";
 		mat = ofMatrix4x4(b.x - a.x, 0, 0, a.x,
 			0, b.y - a.y, 0, a.y,
@@ -25,8 +25,43 @@ General Public License for more details.
 #include "ofxCv.h"
 #include "ofxKinect.h"
 
+#include "DepthSource.h"
+#include "DepthRecording.h"
+#include "TripleBuffer.h"
+#include "FramePool.h"
+#include "FrameFilterKernels.h"
+#include "WorkerPool.h"
+#include "DepthInpainter.h"
+#include "GradientPyramid.h"
+#include "DirtyTiles.h"
+#include "DepthPyramid.h"
 #include "Utils.h"
 
+// A complete frame handed from the grabber thread to the main thread
+// The frames are shared with the pools of the grabber and can be kept by the consumer
+struct FrameBundle {
+	FrameRef<ofFloatPixels> depth; // Filtered depth
+	FrameRef<ofPixels> color; // Invalid while the color stream is disabled
+	FrameRef<GradientPyramid> gradient; // Gradient of the filtered depth
+	FrameRef<DirtyTiles> dirty; // Tiles of the depth changed since the previous frame
+	FrameRef<DepthPyramid> pyramid; // Min, max and mean of the depth and elevation over blocks of the ROI
+	uint64_t frameId;
+	uint64_t timestamp; // Time stamp of the raw frame in microseconds
+	bool stabilized; // Has the filter received enough frames to be stable
+	bool idle; // Has the sand been static for the idle delay
+	uint64_t grabTime; // Time stamps of the grabber in microseconds (ofGetElapsedTimeMicros):
+	uint64_t filterTime; // frame received from the kinect and filtered
+
+	// Give all the frames back to the pools of the grabber
+	void release(){
+		depth.release();
+		color.release();
+		gradient.release();
+		dirty.release();
+		pyramid.release();
+	}
+};
+
 class KinectGrabber: public ofThread {
 public:
 	typedef unsigned short RawDepth; // Data type for raw depth values
@@ -37,24 +72,29 @@ public:
     void start();
     void stop();
     void performInThread(std::function<void(KinectGrabber&)> action);
-    bool setup();
+    bool setup(std::unique_ptr<DepthSource> source = nullptr); // Default to a live kinect if no source is given
 	bool openKinect();
-	void setupFramefilter(int gradFieldresolution, float newMaxOffset, ofRectangle ROI, bool spatialFilter, bool followBigChange, int numAveragingSlots);
+	void stepReplay(); // Request the next frame of a recording replayed in step mode
+	// Record the raw frames - to be called in the grabber thread with performInThread
+	bool startRecording(std::string path, bool recordColor, bool compressDepth);
+	void stopRecording();
+	// Reallocate the filter buffers - to be called in the grabber thread with performInThread
+	void setupFramefilter(float newMaxOffset, ofRectangle ROI, bool spatialFilter, bool followBigChange, int numAveragingSlots);
     void initiateBuffers(void); // Reinitialise buffers
     void resetBuffers(void);
+    void freeBuffers(void);
     
     ofVec3f getStatBuffer(int x, int y);
     float getAveragingBuffer(int x, int y, int slotNum);
     float getValidBuffer(int x, int y);
     
     void setFollowBigChange(bool newfollowBigChange);
+    void setFilterStorage(Filter_storage sfilterStorage); // Reinitialise the buffers in the new storage
+    // The filter state is kept: pixels entering the ROI start from their raw depth and
+    // the averaging ring is resized with its most recent samples
     void setKinectROI(ofRectangle skinectROI);
     void setAveragingSlotsNumber(int snumAveragingSlots);
-    void setGradFieldResolution(int sgradFieldresolution);
-    
-    void decStoredframes(){
-        storedframes -= 1;
-    }
+    void setDirtyTileSize(int stileSize); // 16 or 32 pixels
     
     bool isImageStabilized(){
         return firstImageReady;
@@ -63,6 +103,11 @@ public:
     bool isFrameNew(){
         return newFrame;
     }
+
+    // False once the kinect is lost in the grabber thread
+    bool isKinectOpened(){
+        return kinectOpened;
+    }
     
     ofVec2f getKinectSize(){
         return ofVec2f(width, height);
@@ -72,6 +117,11 @@ public:
         return kinectDepthImage.getData()[(int)(y*width+x)];
     }
     
+    // Latest raw frame - only valid in the grabber thread (with performInThread)
+    const ofShortPixels& getRawDepthImage(){
+        return kinectDepthImage;
+    }
+    
 	ofMatrix4x4 getWorldMatrix();
     
     int getNumAveragingSlots(){
@@ -85,66 +135,114 @@ public:
     void setSpatialFiltering(bool newspatialFilter){
         spatialFilter = newspatialFilter;
     }
+    // Binomial kernel of radius 1 to 5 applied passes times
+    void setSpatialFilterParameters(int radius, int passes);
     
 	void setInPainting(bool inp)
 	{
 		doInPaint = inp;
 	}
 
+	// Number of threads running the filter - 0 for one per core
+	void setNumFilterThreads(int numThreads){
+		workers.setNumThreads(numThreads);
+	}
+
+	// Filter only one frame out of filterInterval after delay seconds without change
+	// A frame is still filtered as soon as the raw depth moves
+	void setIdleMode(bool enabled, float delay, int filterInterval);
+
+	// Depth only acquisition: the color stream is stopped and no color frame is published
+	// Returns false if the kinect could not be reopened in the new mode
+	bool setColorEnabled(bool enabled);
+
+	// Base plane and kinect world matrix giving the elevation of the depth pyramid
+	void setElevationPlane(ofVec4f basePlane, ofMatrix4x4 worldMatrix){
+		elevationPlane = basePlane;
+		elevationWorldMatrix = worldMatrix;
+	}
+
 	// Should the entire frame be filtered and thereby ignoring the KinectROI
 	void setFullFrameFiltering(bool ff, ofRectangle ROI);
 
-	ofThreadChannel<ofFloatPixels> filtered;
-	ofThreadChannel<ofPixels> colored;
-	ofThreadChannel<ofVec2f*> gradient;
+	// Pools of the published frames - declared before frames so they outlive the bundles
+	FramePool<ofFloatPixels> depthPool;
+	FramePool<ofPixels> colorPool;
+	FramePool<GradientPyramid> gradientPool;
+	FramePool<DirtyTiles> dirtyPool;
+	FramePool<DepthPyramid> pyramidPool;
+
+	// Latest filtered frame - only read by the main thread
+	TripleBuffer<FrameBundle> frames;
     
 private:
 	void threadedFunction() override;
     void filter();
     bool isInsideROI(int x, int y); // test is x, y is inside ROI
     void applySpaceFilter();
-    void updateGradientField();
+    void publishFrame();
+    bool hasRawActivity(); // Cheap comparison of the raw frame with the idle reference
+    void updateActivity();
+    // In place reconfiguration of the filter state
+    void remapROI(int oldMinX, int oldMaxX, int oldMinY, int oldMaxY);
+    void seedPixel(int x, int y); // Restart the filter of a pixel on its current raw depth
     
-	// A simple inpainting algorithm to remove outliers in the depth
+	// Inpainting to remove outliers in the depth
 	// Since the shader has no way of filtering outliers (0 and 4000 values mainly) it creates visual artifacts if they are not 
 	// removed prior to the shader pass
 	void applySimpleOutlierInpainting();
-	float findInpaintValue(float *data, int x, int y);
-	double ROIAverageValue = 0;
-	int setToLocalAvg = 0;
-	int setToGlobalAvg = 0;
+	DepthInpainter inpainter;
+	int setToLocalAvg = 0; // Pixels filled from their neighbourhood
+	int setToGlobalAvg = 0; // Pixels filled from the push-pull pyramid
 
 
 	bool newFrame;
+    uint64_t frameGrabTime, frameFilterTime; // Latency time stamps of the current frame
     bool bufferInitiated;
     bool firstImageReady;
-    int storedframes;
+    uint64_t frameId;
     
     // Thread lambda functions (actions)
 	vector<std::function<void(KinectGrabber&)> > actions;
 	ofMutex actionsLock;
     
     // Kinect parameters
-	bool kinectOpened;
-    ofxKinect               kinect;
+	std::atomic<bool> kinectOpened;
+	std::unique_ptr<DepthSource> depthSource;
+	DepthRecorder recorder;
     unsigned int width, height; // Width and height of kinect frames
 	int minX, maxX; // , ROIwidth; // ROI definition
 	int minY, maxY; //, ROIheight;
     
     // General buffers
-    ofxCvColorImage         kinectColorImage;
     ofShortPixels     kinectDepthImage;
     ofFloatPixels filteredframe;
-    ofVec2f* gradField;
+    ofFloatPixels spaceFilterBuffer; // Vertical pass of the spatial filter
     
     // Filtering buffers
 	float* averagingBuffer; // Buffer to calculate running averages of each pixel's depth value
-	float* statBuffer; // Buffer retaining the running means and variances of each pixel's depth value
+	float* statCount; // Planes retaining the running means and variances of each pixel's depth value:
+	float* statSum; // number of valid samples, sum of the samples
+	float* statSumSq; // and sum of their squares
+	// The recursive storage has no averaging ring and uses the planes for the number of samples, mean and variance
+	int bufferStride; // Padded row length of the averaging and statistics buffers
+	Filter_storage filterStorage;
+	uint16_t* averagingBufferU16; // Same buffers in the uint16 storage
+	uint32_t* statCountU16;
+	uint32_t* statSumU16;
+	uint64_t* statSumSqU16;
 	float* validBuffer; // Buffer holding the most recent stable depth value for each pixel
+	TemporalFilterRowFunction temporalFilterRow; // Filter kernels selected for the CPU
+	TemporalFilterRowU16Function temporalFilterRowU16;
+	WorkerPool workers; // Threads running the filter stages on bands of rows
+	DirtyTileTracker dirtyTracker; // Tiles changed by more than the hysteresis
+	ofVec4f elevationPlane; // Base plane of the elevation in the depth pyramid
+	bool colorEnabled;
+	ofPixels noColor; // Recorded while the color stream is disabled
+	ofMatrix4x4 elevationWorldMatrix;
+	int dirtyTileSize;
     
     // Gradient computation variables
-    int gradFieldcols, gradFieldrows;
-    int gradFieldresolution;           //Resolution of grid relative to window width and height in pixels
     float maxgradfield, depthrange;
     
     // Frame filter parameters
@@ -159,6 +257,9 @@ private:
     float bigChange; // Amount of change over which the averaging slot is reset to new value
 //	float instableValue; // Value to assign to instable pixels if retainValids is false
 	bool spatialFilter; // Flag whether to apply a spatial filter to time-averaged depth values
+	int spatialFilterRadius;
+	int spatialFilterPasses;
+	std::vector<float> spatialFilterWeights;
     float maxOffset;
     
     int minInitFrame; // Minimal number of frame to consider the kinect initialized
@@ -167,6 +268,15 @@ private:
 	bool doInPaint;
 
 	bool doFullFrameFiltering;
+
+	// Idle mode
+	bool idleModeEnabled;
+	float idleDelay; // Seconds without activity before entering the idle mode
+	int idleFilterInterval;
+	bool idle;
+	float lastActivityTime;
+	int idleSkippedFrames;
+	ofShortPixels idleReference; // Raw frame when the idle mode was entered
     // Debug
 //    int blockX, blockY;
 };
@@ -37,7 +37,42 @@ projKinectCalibrationUpdated (false),
 imageStabilized (false),
 waitingForFlattenSand (false),
 drawKinectView(false),
-drawKinectColorView(true)
+drawKinectColorView(true),
+recordingSession(false),
+recordColor(true),
+compressRecordedDepth(true),
+numFilterThreads(0),
+integerFilterBuffers(false),
+recursiveFilter(false),
+depthTexture16Bit(false),
+spatialFilterRadius(1),
+spatialFilterPasses(2),
+dirtyTileSize(16),
+idleMode(false),
+idleDelay(30),
+idleFrameRate(10),
+idle(false),
+grabberIdleMode(false),
+depthOnlyAcquisition(false),
+colorStreaming(true),
+latencyDumpInterval(0),
+lastLatencyUpdate(0),
+lastLatencyDump(0),
+basePlaneRansac(true),
+driftMonitoring(true),
+driftCorrection(false),
+driftCheckInterval(60),
+driftCorrectionTime(10),
+maxDriftAngle(2),
+maxDriftOffset(20),
+maxDriftROIShift(8),
+lastDriftCheck(0),
+driftReset(true),
+driftTargetValid(false),
+elevationPlaneSent(false),
+depthUploaded(false),
+uploadedFrameId(0),
+depthRevision(0)
 {
 	doShowROIonProjector = false;
 	applicationState = APPLICATION_STATE_SETUP;
@@ -87,7 +122,7 @@ void KinectProjector::setup(bool sdisplayGui)
     maxOffsetSafeRange = 50; // Range above the autocalib measured max offset
 
     // kinectgrabber: start & default setup
-	kinectOpened = kinectgrabber.setup();
+	kinectOpened = kinectgrabber.setup(createDepthSource());
 	lastKinectOpenTry = ofGetElapsedTimef(); 
 	if (!kinectOpened)
 	{
@@ -109,15 +144,19 @@ void KinectProjector::setup(bool sdisplayGui)
 	ofLogVerbose("KinectProjector") << "KinectProjector.setup(): kinectROI " << kinectROI;
 
     // Initialize the fbos and images
+    // The depth texture is streamed separately: the image only keeps the depth on the CPU
+    FilteredDepthImage.setUseTexture(false);
     FilteredDepthImage.allocate(kinectRes.x, kinectRes.y);
+    depthStreamer.allocate(kinectRes.x, kinectRes.y, depthTexture16Bit);
     kinectColorImage.allocate(kinectRes.x, kinectRes.y);
     thresholdedImage.allocate(kinectRes.x, kinectRes.y);
     
 	kpt = new ofxKinectProjectorToolkit(projRes, kinectRes);
 
 	// finish kinectgrabber setup and start the grabber
-    kinectgrabber.setupFramefilter(gradFieldResolution, maxOffset, kinectROI, spatialFiltering, followBigChanges, numAveragingSlots);
+    setupKinectGrabberFramefilter();
     kinectWorldMatrix = kinectgrabber.getWorldMatrix();
+    elevationPlaneSent = false;
     ofLogVerbose("KinectProjector") << "KinectProjector.setup(): kinectWorldMatrix: " << kinectWorldMatrix ;
     
     // Setup gradient field
@@ -138,6 +177,7 @@ void KinectProjector::setup(bool sdisplayGui)
         setupGui();
 
     kinectgrabber.start(); // Start the acquisition
+    driftMonitor.start();
 
 	updateStatusGUI();
 }
@@ -156,23 +196,15 @@ void KinectProjector::exit(ofEventArgs& e)
 	}
 }
 
+// The gradient pyramid covers every resolution: only the grid of the drawn arrows depends on it
 void KinectProjector::setupGradientField(){
     gradFieldcols = kinectRes.x / gradFieldResolution;
     gradFieldrows = kinectRes.y / gradFieldResolution;
-    
-    gradField = new ofVec2f[gradFieldcols*gradFieldrows];
-    ofVec2f* gfPtr=gradField;
-    for(unsigned int y=0;y<gradFieldrows;++y)
-        for(unsigned int x=0;x<gradFieldcols;++x,++gfPtr)
-            *gfPtr=ofVec2f(0);
 }
 
 void KinectProjector::setGradFieldResolution(int sgradFieldResolution){
     gradFieldResolution = sgradFieldResolution;
     setupGradientField();
-    kinectgrabber.performInThread([sgradFieldResolution](KinectGrabber & kg) {
-        kg.setGradFieldResolution(sgradFieldResolution);
-    });
 }
 
 // For some reason this call eats milliseconds - so it should only be called when something is changed
@@ -241,6 +273,11 @@ void KinectProjector::updateStatusGUI()
 	gui->getToggle("Quick reaction")->setChecked(followBigChanges);
 	gui->getToggle("Inpaint outliers")->setChecked(doInpainting);
 	gui->getToggle("Full Frame Filtering")->setChecked(doFullFrameFiltering);
+	gui->getToggle("Integer filter buffers")->setChecked(integerFilterBuffers);
+	gui->getToggle("Recursive filter")->setChecked(recursiveFilter);
+	gui->getToggle("16 bit depth texture")->setChecked(depthTexture16Bit);
+	gui->getToggle("Idle mode")->setChecked(idleMode);
+	gui->getToggle("Drift correction")->setChecked(driftCorrection);
 }
 
 void KinectProjector::update()
@@ -250,6 +287,15 @@ void KinectProjector::update()
 //    ROIUpdated = false;
     projKinectCalibrationUpdated = false;
 
+	// The kinect can be lost in the grabber thread when the color stream is switched
+	if (kinectOpened && !kinectgrabber.isKinectOpened())
+	{
+		ofLogVerbose("KinectProjector") << "KinectProjector.update(): Kinect lost - trying again later";
+		kinectOpened = false;
+		lastKinectOpenTry = ofGetElapsedTimef();
+		updateStatusGUI();
+	}
+
 	// Try to open the kinect every 3. second if it is not yet open
 	float TimeStamp = ofGetElapsedTimef();
 	if (!kinectOpened && TimeStamp-lastKinectOpenTry > 3)
@@ -264,8 +310,11 @@ void KinectProjector::update()
 			kinectROI = ofRectangle(0, 0, kinectRes.x, kinectRes.y);
 			ofLogVerbose("KinectProjector") << "KinectProjector.update(): kinectROI " << kinectROI;
 
-			kinectgrabber.setupFramefilter(gradFieldResolution, maxOffset, kinectROI, spatialFiltering, followBigChanges, numAveragingSlots);
+			setupKinectGrabberFramefilter();
 			kinectWorldMatrix = kinectgrabber.getWorldMatrix();
+			elevationPlaneSent = false;
+			depthStreamer.allocate(kinectRes.x, kinectRes.y, depthTexture16Bit);
+			depthUploaded = false;
 			ofLogVerbose("KinectProjector") << "KinectProjector.update(): kinectWorldMatrix: " << kinectWorldMatrix;
 
 			updateStatusGUI();
@@ -278,41 +327,68 @@ void KinectProjector::update()
 		StatusGUI->update();
 	}
 
-    // Get images from kinect grabber
-    ofFloatPixels filteredframe;
-    if (kinectOpened && kinectgrabber.filtered.tryReceive(filteredframe)) 
+    updateGrabberIdleMode();
+    updateColorStreaming();
+    updateTemporalFrameFilter();
+    updateLatencyStatus();
+    updateDriftMonitor();
+    updateElevationPlane();
+
+    // Get the latest frame from kinect grabber
+    if (kinectOpened && kinectgrabber.frames.update()) 
 	{
+		FrameBundle& frame = kinectgrabber.frames.getReadBuffer();
+		latencyTracker.frameReceived(frame.grabTime, frame.filterTime);
 		fpsKinect.newFrame();
 		fpsKinectText->setText(ofToString(fpsKinect.getFps(), 2));
 
-		FilteredDepthImage.setFromPixels(filteredframe.getData(), kinectRes.x, kinectRes.y);
-        FilteredDepthImage.updateTexture();
+		// The depth image and texture are only updated if a tile changed since the last update
+		if (!depthUploaded || frame.dirty->hasChangedSince(uploadedFrameId))
+		{
+			FilteredDepthImage.setFromPixels(frame.depth->getData(), kinectRes.x, kinectRes.y);
+			// Only the tiles changed since the last uploaded frame are streamed to the texture
+			if (depthUploaded)
+			{
+				frame.dirty->getRectsSince(uploadedFrameId, depthUploadRects);
+				depthStreamer.upload(frame.depth->getData(), depthUploadRects);
+			}
+			else
+			{
+				// The texture was just allocated: every texel outside the sand region is also set
+				depthStreamer.upload(frame.depth->getData());
+			}
+			latencyTracker.mark(LATENCY_STAGE_UPLOAD);
+			depthUploaded = true;
+			depthRevision++;
+		}
+		uploadedFrameId = frame.frameId;
+		dirtyFrame = frame.dirty;
         
-        // Get color image from kinect grabber
-        ofPixels coloredframe;
-        if (kinectgrabber.colored.tryReceive(coloredframe)) 
+        // Get color image - there is none in depth only acquisition
+        if (frame.color.isValid() && frame.color->isAllocated()) 
 		{
-            kinectColorImage.setFromPixels(coloredframe);
+            kinectColorImage.setFromPixels(*frame.color);
 		
-			if (TemporalFilteringType == 0)
-				TemporalFrameFilter.NewFrame(kinectColorImage.getPixels().getData(), kinectColorImage.width, kinectColorImage.height);
-			else if (TemporalFilteringType == 1)
-				TemporalFrameFilter.NewColFrame(kinectColorImage.getPixels().getData(), kinectColorImage.width, kinectColorImage.height);
+			// Only buffered while the chessboards are acquired
+			if (TemporalFrameFilter.isActive())
+			{
+				if (TemporalFilteringType == 0)
+					TemporalFrameFilter.NewFrame(kinectColorImage.getPixels().getData(), kinectColorImage.width, kinectColorImage.height);
+				else if (TemporalFilteringType == 1)
+					TemporalFrameFilter.NewColFrame(kinectColorImage.getPixels().getData(), kinectColorImage.width, kinectColorImage.height);
+			}
 		}
 
-        // Get gradient field from kinect grabber
-        kinectgrabber.gradient.tryReceive(gradField);
-        
-        // Update grabber stored frame number
-        kinectgrabber.lock();
-        kinectgrabber.decStoredframes();
-        kinectgrabber.unlock();
+        // Keep the gradient frame until the next one is received
+        gradientFrame = frame.gradient;
+        pyramidFrame = frame.pyramid;
         
         // Is the depth image stabilized
-        imageStabilized = kinectgrabber.isImageStabilized();
+        imageStabilized = frame.stabilized;
+        idle = frame.idle && grabberIdleMode;
         
-        // Are we calibrating ?
-        if (applicationState == APPLICATION_STATE_CALIBRATING && !waitingForFlattenSand) 
+        // Are we calibrating ? The calibration waits for the color stream to restart after depth only acquisition
+        if (applicationState == APPLICATION_STATE_CALIBRATING && !waitingForFlattenSand && frame.color.isValid()) 
 		{
             updateCalibration();
         } 
@@ -329,7 +405,7 @@ void KinectProjector::update()
 				}
 				else
 				{
-					FilteredDepthImage.draw(0, 0);
+					depthStreamer.getTexture().draw(0, 0);
 				}
 				ofNoFill();
 				
@@ -701,12 +777,25 @@ void KinectProjector::setNewKinectROI()
 
     // Update states variables
     ROIcalibrated = true;
+    driftReset = true;
 //    ROIUpdated = true;
     saveCalibrationAndSettings();
     updateKinectGrabberROI(kinectROI);
 	updateStatusGUI();
 }
 
+void KinectProjector::setupKinectGrabberFramefilter(){
+	// The grabber thread is already running: the buffers are freed and reallocated between two frames
+	float newMaxOffset = maxOffset;
+	ofRectangle ROI = kinectROI;
+	bool sspatialFiltering = spatialFiltering;
+	bool sfollowBigChanges = followBigChanges;
+	int nAvg = numAveragingSlots;
+	kinectgrabber.performInThread([newMaxOffset, ROI, sspatialFiltering, sfollowBigChanges, nAvg](KinectGrabber & kg) {
+		kg.setupFramefilter(newMaxOffset, ROI, sspatialFiltering, sfollowBigChanges, nAvg);
+	});
+}
+
 void KinectProjector::updateKinectGrabberROI(ofRectangle ROI){
     kinectgrabber.performInThread([ROI](KinectGrabber & kg) {
         kg.setKinectROI(ROI);
@@ -804,6 +893,9 @@ void KinectProjector::updateProjKinectAutoCalibration()
         upframe = false;
         trials = 0;
 		TemporalFrameCounter = 0;
+		// The temporal buffers only hold the ROI where the chessboards are searched
+		int nFrames = TemporalFilteringType == 0 ? CTemporalFrameFilter::defaultMedianFrames : CTemporalFrameFilter::defaultAverageFrames;
+		TemporalFrameFilter.Init(kinectRes.x, kinectRes.y, nFrames, kinectROI.x, kinectROI.y, kinectROI.width, kinectROI.height);
 
 		ofPoint dispPt = ofPoint(projRes.x / 2, projRes.y / 2) + autoCalibPts[currentCalibPts]; //
 		drawChessboard(dispPt.x, dispPt.y, chessboardSize); // We can now draw the next chess board
@@ -822,6 +914,16 @@ void KinectProjector::updateProjKinectAutoCalibration()
 			TemporalFrameCounter = 0;
 		}
 	}
+	else if (autoCalibState == AUTOCALIB_STATE_DETECT_CHESSBOARD && imageStabilized)
+	{
+		// The GUI and the projector keep running while the chessboard is searched
+		ChessboardResult result;
+		if (chessboardDetector.getResult(result))
+		{
+			ProcessChessboardResult(result);
+			TemporalFrameCounter = 0;
+		}
+	}
 	else if (autoCalibState == AUTOCALIB_STATE_COMPUTE) 
 	{
         updateKinectGrabberROI(kinectROI); // Goes back to kinectROI and maxoffset
@@ -943,9 +1045,6 @@ void KinectProjector::CalibrateNextPoint()
 			updateStatusGUI();
 		}
 
-		// Current RGB frame - probably with rolling shutter problems
-		cvRgbImage = ofxCv::toCv(kinectColorImage.getPixels());
-
 		ofxCvGrayscaleImage tempImage;
 		if (TemporalFilteringType == 0)
 			tempImage.setFromPixels(TemporalFrameFilter.getMedianFilteredImage(), kinectColorImage.width, kinectColorImage.height);
@@ -962,84 +1061,81 @@ void KinectProjector::CalibrateNextPoint()
 
 		cvGrayImage = ofxCv::toCv(tempImage.getPixels());
 
-		cv::Rect tempROI((int)kinectROI.x, (int)kinectROI.y,(int)kinectROI.width, (int)kinectROI.height);
-		cv::Mat cvGrayROI = cvGrayImage(tempROI);
-
-		cv::Size patternSize = cv::Size(chessboardX - 1, chessboardY - 1);
-	//	int chessFlags = cv::CALIB_CB_ADAPTIVE_THRESH + cv::CALIB_CB_FAST_CHECK;
-		int chessFlags = 0;
-
-		//bool foundChessboard = findChessboardCorners(cvGrayImage, patternSize, cvPoints, chessFlags);
-		bool foundChessboard = findChessboardCorners(cvGrayROI, patternSize, cvPoints, chessFlags);
-
-		if (!foundChessboard)
-		{
-			int chessFlags = cv::CALIB_CB_ADAPTIVE_THRESH + cv::CALIB_CB_FAST_CHECK;
-			foundChessboard = findChessboardCorners(cvGrayROI, patternSize, cvPoints, chessFlags);
+		// The search runs on a worker and ProcessChessboardResult() goes on when it is done
+		ChessboardRequest request;
+		request.image = cvGrayImage;
+		request.ROI = cv::Rect((int)kinectROI.x, (int)kinectROI.y, (int)kinectROI.width, (int)kinectROI.height);
+		request.patternSize = cv::Size(chessboardX - 1, chessboardY - 1);
+		if (chessboardDetector.start(request))
+			autoCalibState = AUTOCALIB_STATE_DETECT_CHESSBOARD;
+		else
+			ofLogVerbose("KinectProjector") << "autoCalib(): The previous chessboard search is still running";
+	}
+	else
+	{
+		if (upframe)
+		{ // We are done
+			calibrationText = "Updating acquisition ceiling";
+			updateMaxOffset(); // Find max offset
+			autoCalibState = AUTOCALIB_STATE_COMPUTE;
+			updateStatusGUI();
+		}
+		else
+		{ // We ask for higher points
+			calibModal->hide();
+			confirmModal->show();
+			confirmModal->setMessage("Please cover the sandbox with a board and press ok.");
 		}
+	}
+}
 
-		// Changed logic so the "cleared" flag is not used - we do a long frame average instead
-		if (foundChessboard)
-		{
-			for (int i = 0; i < cvPoints.size(); i++)
-			{
-				cvPoints[i].x += tempROI.x;
-				cvPoints[i].y += tempROI.y;
-			}
+void KinectProjector::ProcessChessboardResult(const ChessboardResult& result)
+{
+	autoCalibState = AUTOCALIB_STATE_NEXT_POINT;
 
-			cornerSubPix(cvGrayImage, cvPoints, cv::Size(2, 2), cv::Size(-1, -1),   // Rasmus: changed search size to 2 from 11 - since this caused false findings
-				cv::TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 30, 0.1));
+	// Current RGB frame - probably with rolling shutter problems
+	cvRgbImage = ofxCv::toCv(kinectColorImage.getPixels());
+	cv::Size patternSize = cv::Size(chessboardX - 1, chessboardY - 1);
+	bool foundChessboard = result.found;
 
-			drawChessboardCorners(cvRgbImage, patternSize, cv::Mat(cvPoints), foundChessboard);
+	// Changed logic so the "cleared" flag is not used - we do a long frame average instead
+	if (foundChessboard)
+	{
+		cvPoints = result.corners;
 
-			if (DumpDebugFiles)
-			{
-				std::string tname = DebugFileOutDir + "FoundChessboard_" + GetTimeAndDateString() + "_" + ofToString(currentCalibPts) + "_try_" + ofToString(trials) + ".png";
-				ofSaveImage(kinectColorImage.getPixels(), tname);
-			}
+		drawChessboardCorners(cvRgbImage, patternSize, cv::Mat(cvPoints), foundChessboard);
 
-			kinectColorImage.updateTexture();
-			fboMainWindow.begin();
-			kinectColorImage.draw(0, 0);
-			fboMainWindow.end();
+		if (DumpDebugFiles)
+		{
+			std::string tname = DebugFileOutDir + "FoundChessboard_" + GetTimeAndDateString() + "_" + ofToString(currentCalibPts) + "_try_" + ofToString(trials) + ".png";
+			ofSaveImage(kinectColorImage.getPixels(), tname);
+		}
 
-			ofLogVerbose("KinectProjector") << "autoCalib(): Chessboard found for point :" << currentCalibPts;
-			bool okchess = addPointPair();
+		kinectColorImage.updateTexture();
+		fboMainWindow.begin();
+		kinectColorImage.draw(0, 0);
+		fboMainWindow.end();
 
-			if (okchess)
-			{
-				trials = 0;
-				currentCalibPts++;
-				ofPoint dispPt = ofPoint(projRes.x / 2, projRes.y / 2) + autoCalibPts[currentCalibPts]; // Compute next chessboard position
-				drawChessboard(dispPt.x, dispPt.y, chessboardSize); // We can now draw the next chess board
-			}
-			else
-			{
-				// We cannot get all depth points for the chessboard
-				trials++;
-				ofLogVerbose("KinectProjector") << "autoCalib(): Depth points of chessboard not allfound on trial : " << trials;
-				if (trials > 3)
-				{
-					// Move the chessboard closer to the center of the screen
-					ofLogVerbose("KinectProjector") << "autoCalib(): Chessboard could not be found moving chessboard closer to center ";
-					autoCalibPts[currentCalibPts] = 4 * autoCalibPts[currentCalibPts] / 5;
-					ofPoint dispPt = ofPoint(projRes.x / 2, projRes.y / 2) + autoCalibPts[currentCalibPts]; // Compute next chessboard position
-					drawChessboard(dispPt.x, dispPt.y, chessboardSize); // We can now draw the next chess board
-					trials = 0;
-				}
-			}
+		ofLogVerbose("KinectProjector") << "autoCalib(): Chessboard found for point :" << currentCalibPts;
+		bool okchess = addPointPair();
+
+		if (okchess)
+		{
+			trials = 0;
+			currentCalibPts++;
+			ofPoint dispPt = ofPoint(projRes.x / 2, projRes.y / 2) + autoCalibPts[currentCalibPts]; // Compute next chessboard position
+			drawChessboard(dispPt.x, dispPt.y, chessboardSize); // We can now draw the next chess board
 		}
 		else
 		{
-			// We cannot find the chessboard
+			// We cannot get all depth points for the chessboard
 			trials++;
-			ofLogVerbose("KinectProjector") << "autoCalib(): Chessboard not found on trial : " << trials;
-			if (trials > 3) 
+			ofLogVerbose("KinectProjector") << "autoCalib(): Depth points of chessboard not allfound on trial : " << trials;
+			if (trials > 3)
 			{
 				// Move the chessboard closer to the center of the screen
 				ofLogVerbose("KinectProjector") << "autoCalib(): Chessboard could not be found moving chessboard closer to center ";
-				autoCalibPts[currentCalibPts] = 3 * autoCalibPts[currentCalibPts] / 4;
-
+				autoCalibPts[currentCalibPts] = 4 * autoCalibPts[currentCalibPts] / 5;
 				ofPoint dispPt = ofPoint(projRes.x / 2, projRes.y / 2) + autoCalibPts[currentCalibPts]; // Compute next chessboard position
 				drawChessboard(dispPt.x, dispPt.y, chessboardSize); // We can now draw the next chess board
 				trials = 0;
@@ -1048,18 +1144,18 @@ void KinectProjector::CalibrateNextPoint()
 	}
 	else
 	{
-		if (upframe)
-		{ // We are done
-			calibrationText = "Updating acquisition ceiling";
-			updateMaxOffset(); // Find max offset
-			autoCalibState = AUTOCALIB_STATE_COMPUTE;
-			updateStatusGUI();
-		}
-		else
-		{ // We ask for higher points
-			calibModal->hide();
-			confirmModal->show();
-			confirmModal->setMessage("Please cover the sandbox with a board and press ok.");
+		// We cannot find the chessboard
+		trials++;
+		ofLogVerbose("KinectProjector") << "autoCalib(): Chessboard not found on trial : " << trials;
+		if (trials > 3) 
+		{
+			// Move the chessboard closer to the center of the screen
+			ofLogVerbose("KinectProjector") << "autoCalib(): Chessboard could not be found moving chessboard closer to center ";
+			autoCalibPts[currentCalibPts] = 3 * autoCalibPts[currentCalibPts] / 4;
+
+			ofPoint dispPt = ofPoint(projRes.x / 2, projRes.y / 2) + autoCalibPts[currentCalibPts]; // Compute next chessboard position
+			drawChessboard(dispPt.x, dispPt.y, chessboardSize); // We can now draw the next chess board
+			trials = 0;
 		}
 	}
 }
@@ -1099,20 +1195,10 @@ void KinectProjector::updateBasePlane()
         ofLogVerbose("KinectProjector") << "updateBasePlane(): smallROI is null, cannot compute base plane normal" ;
         return;
     }
-    ofVec4f pt;
-    ofVec3f* points;
-    points = new ofVec3f[sw*sh];
-    ofLogVerbose("KinectProjector") << "updateBasePlane(): Computing points in smallROI : " << sw*sh ;
-    for (int x = 0; x<sw; x++){
-        for (int y = 0; y<sh; y ++){
-            points[x+y*sw] = kinectCoordToWorldCoord(x+sl, y+st);
-        }
-    }
     ofLogVerbose("KinectProjector") << "updateBasePlane(): Computing plane from points" ;
-    basePlaneEq = plane_from_points(points, sw*sh);
-	if (basePlaneEq.x == 0 && basePlaneEq.y == 0 && basePlaneEq.z == 0)
+	if (!planeEstimator.estimate(FilteredDepthImage.getFloatPixelsRef().getData(), kinectRes.x, kinectRes.y, smallROI, kinectWorldMatrix, basePlaneEq))
 	{
-		ofLogVerbose("KinectProjector") << "updateBasePlane(): plane_from_points could not compute basePlane";
+		ofLogVerbose("KinectProjector") << "updateBasePlane(): planeEstimator could not compute basePlane";
 		return;
 	}
 
@@ -1122,6 +1208,8 @@ void KinectProjector::updateBasePlane()
     basePlaneOffsetBack = basePlaneOffset;
     basePlaneUpdated = true;
 	basePlaneComputed = true;
+	driftReset = true;
+	driftTargetValid = false;
 	updateStatusGUI();
 }
 
@@ -1138,17 +1226,13 @@ void KinectProjector::updateMaxOffset(){
         ofLogVerbose("KinectProjector") << "updateMaxOffset(): smallROI is null, cannot compute base plane normal" ;
         return;
     }
-    ofVec4f pt;
-    ofVec3f* points;
-    points = new ofVec3f[sw*sh];
-    ofLogVerbose("KinectProjector") << "updateMaxOffset(): Computing points in smallROI : " << sw*sh ;
-    for (int x = 0; x<sw; x++){
-        for (int y = 0; y<sh; y ++){
-            points[x+y*sw] = kinectCoordToWorldCoord(x+sl, y+st);//vertexCcvertexCc;
-        }
-    }
     ofLogVerbose("KinectProjector") << "updateMaxOffset(): Computing plane from points" ;
-    ofVec4f eqoff = plane_from_points(points, sw*sh);
+    ofVec4f eqoff;
+	if (!planeEstimator.estimate(FilteredDepthImage.getFloatPixelsRef().getData(), kinectRes.x, kinectRes.y, smallROI, kinectWorldMatrix, eqoff))
+	{
+		ofLogVerbose("KinectProjector") << "updateMaxOffset(): planeEstimator could not compute the plane";
+		return;
+	}
     maxOffset = -eqoff.w-maxOffsetSafeRange;
     maxOffsetBack = maxOffset;
     // Update max Offset
@@ -1259,7 +1343,7 @@ void KinectProjector::drawGradField()
             float y = rowPos*gradFieldResolution  + gradFieldResolution/2;
             ofVec2f projectedPoint = kinectCoordToProjCoord(x, y);
             int ind = colPos + rowPos * gradFieldcols;
-            ofVec2f v2 = gradField[ind];
+            ofVec2f v2 = gradientAtScale(x, y);
             v2 *= arrowLength;
 
             ofSetColor(255,0,0,255);
@@ -1288,6 +1372,11 @@ void KinectProjector::drawArrow(ofVec2f projectedPoint, ofVec2f v1)
 
 void KinectProjector::updateNativeScale(float scaleMin, float scaleMax){
     FilteredDepthImage.setNativeScale(scaleMin, scaleMax);
+    depthStreamer.setNativeScale(scaleMin, scaleMax);
+    // The whole texture holds the depth scaled to 0..1 - upload it again even if the sand is static
+    if (depthUploaded)
+        depthStreamer.upload(FilteredDepthImage.getFloatPixelsRef().getData());
+    depthRevision++;
 }
 
 ofVec2f KinectProjector::kinectCoordToProjCoord(float x, float y) // x, y in kinect pixel coord
@@ -1391,7 +1480,14 @@ float KinectProjector::elevationToKinectDepth(float elevation, float x, float y)
 ofVec2f KinectProjector::gradientAtKinectCoord(float x, float y){
     int ind = static_cast<int>(floor(x/gradFieldResolution)) + gradFieldcols*static_cast<int>(floor(y/gradFieldResolution));
     fishInd = ind;
-    return gradField[ind];
+    return gradientAtScale(x, y);
+}
+
+// Gradient interpolated in the pyramid level matching the gradient field resolution
+ofVec2f KinectProjector::gradientAtScale(float x, float y){
+    if (!gradientFrame.isValid())
+        return ofVec2f(0);
+    return gradientFrame->sampleAtScale(x, y, gradFieldResolution);
 }
 
 void KinectProjector::setupGui(){
@@ -1407,11 +1503,17 @@ void KinectProjector::setupGui(){
     advancedFolder->addToggle("Display kinect depth view", drawKinectView)->setName("Draw kinect depth view");
 	advancedFolder->addToggle("Display kinect color view", drawKinectColorView)->setName("Draw kinect color view");
 	advancedFolder->addToggle("Dump Debug", DumpDebugFiles);
+	advancedFolder->addToggle("Record session", recordingSession);
 	advancedFolder->addSlider("Ceiling", -300, 300, 0);
     advancedFolder->addToggle("Spatial filtering", spatialFiltering);
 	advancedFolder->addToggle("Inpaint outliers", doInpainting);
 	advancedFolder->addToggle("Full Frame Filtering", doFullFrameFiltering);
 	advancedFolder->addToggle("Quick reaction", followBigChanges);
+	advancedFolder->addToggle("Integer filter buffers", integerFilterBuffers);
+	advancedFolder->addToggle("Recursive filter", recursiveFilter);
+	advancedFolder->addToggle("16 bit depth texture", depthTexture16Bit);
+	advancedFolder->addToggle("Idle mode", idleMode);
+	advancedFolder->addToggle("Drift correction", driftCorrection);
     advancedFolder->addSlider("Averaging", 1, 40, numAveragingSlots)->setPrecision(0);
 	advancedFolder->addSlider("Tilt X", -30, 30, 0);
 	advancedFolder->addSlider("Tilt Y", -30, 30, 0);
@@ -1452,6 +1554,9 @@ void KinectProjector::setupGui(){
 	StatusGUI->addLabel("Calibration Status");
 	StatusGUI->addLabel("Calibration Step");
 	StatusGUI->addLabel("Projector Status");
+	for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++)
+		StatusGUI->addLabel("Latency " + LatencyTracker::getStageName((Latency_stage)stage));
+	StatusGUI->addLabel("Drift Status");
 	StatusGUI->addHeader(":: Status ::", false);
 	StatusGUI->setAutoDraw(false);
 }
@@ -1510,11 +1615,25 @@ void KinectProjector::startApplication()
 			setInPainting(doInpainting);
 			setFollowBigChanges(followBigChanges);
 			setSpatialFiltering(spatialFiltering);
+			updateFilterStorage();
+			setDepthTexture16Bit(depthTexture16Bit);
+			setIdleMode(idleMode);
+			setSpatialFilterParameters(spatialFilterRadius, spatialFilterPasses);
 
 			int nAvg = numAveragingSlots;
 			kinectgrabber.performInThread([nAvg](KinectGrabber & kg) {
 				kg.setAveragingSlotsNumber(nAvg); });
 
+			int nThreads = numFilterThreads;
+			planeEstimator.setNumThreads(nThreads);
+			planeEstimator.setRansac(basePlaneRansac);
+			kinectgrabber.performInThread([nThreads](KinectGrabber & kg) {
+				kg.setNumFilterThreads(nThreads); });
+
+			int tileSize = dirtyTileSize;
+			kinectgrabber.performInThread([tileSize](KinectGrabber & kg) {
+				kg.setDirtyTileSize(tileSize); });
+
 			updateStatusGUI();
 		}
 		else 
@@ -1640,6 +1759,224 @@ void KinectProjector::setFollowBigChanges(bool sfollowBigChanges){
 	updateStatusGUI();
 }
 
+void KinectProjector::setSpatialFilterParameters(int sradius, int spasses){
+	spatialFilterRadius = sradius;
+	spatialFilterPasses = spasses;
+	kinectgrabber.performInThread([sradius, spasses](KinectGrabber & kg) {
+		kg.setSpatialFilterParameters(sradius, spasses);
+	});
+}
+
+void KinectProjector::setIntegerFilterBuffers(bool sintegerFilterBuffers){
+	integerFilterBuffers = sintegerFilterBuffers;
+	updateFilterStorage();
+}
+
+void KinectProjector::setDepthTexture16Bit(bool sdepthTexture16Bit){
+	depthTexture16Bit = sdepthTexture16Bit;
+	if (depthStreamer.isAllocated() && depthStreamer.is16Bit() == depthTexture16Bit)
+		return;
+	depthStreamer.allocate(kinectRes.x, kinectRes.y, depthTexture16Bit);
+	if (depthUploaded)
+	{
+		depthStreamer.upload(FilteredDepthImage.getFloatPixelsRef().getData());
+		depthRevision++;
+	}
+	updateStatusGUI();
+}
+
+void KinectProjector::setRecursiveFilter(bool srecursiveFilter){
+	recursiveFilter = srecursiveFilter;
+	updateFilterStorage();
+}
+
+// The recursive filter has no ring so it takes precedence over the storage of the ring
+void KinectProjector::updateFilterStorage(){
+	Filter_storage storage = integerFilterBuffers ? FILTER_STORAGE_UINT16 : FILTER_STORAGE_FLOAT;
+	if (recursiveFilter)
+		storage = FILTER_STORAGE_RECURSIVE;
+	kinectgrabber.performInThread([storage](KinectGrabber & kg) {
+		kg.setFilterStorage(storage);
+	});
+	updateStatusGUI();
+}
+
+// Refresh the latency labels every second and dump the statistics every latencyDumpInterval seconds
+void KinectProjector::updateLatencyStatus(){
+	float now = ofGetElapsedTimef();
+	if (displayGui && now - lastLatencyUpdate > 1)
+	{
+		lastLatencyUpdate = now;
+		for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++)
+		{
+			std::string name = LatencyTracker::getStageName((Latency_stage)stage);
+			LatencyStats stats = latencyTracker.getStats((Latency_stage)stage);
+			StatusGUI->getLabel("Latency " + name)->setLabel("Latency " + name + " ms: " + ofToString(stats.p50, 1) + " / " + ofToString(stats.p95, 1) + " / " + ofToString(stats.p99, 1));
+		}
+	}
+	if (latencyDumpInterval > 0 && now - lastLatencyDump > latencyDumpInterval)
+	{
+		lastLatencyDump = now;
+		if (!latencyTracker.appendCSV("latency.csv") || !latencyTracker.saveJSON("latency.json"))
+			ofLogVerbose("KinectProjector") << "updateLatencyStatus(): Latency statistics could not be saved";
+	}
+}
+
+void KinectProjector::setIdleMode(bool sidleMode){
+	idleMode = sidleMode;
+	updateStatusGUI();
+}
+
+void KinectProjector::setDriftCorrection(bool sdriftCorrection){
+	driftCorrection = sdriftCorrection;
+	if (!driftCorrection)
+		driftTargetValid = false;
+	updateStatusGUI();
+}
+
+// Measure the drift of the sandbox every driftCheckInterval seconds while the application runs
+void KinectProjector::updateDriftMonitor(){
+	if (!driftMonitoring || applicationState != APPLICATION_STATE_RUNNING || !ROIcalibrated || !basePlaneComputed)
+		return;
+
+	DriftReport report;
+	if (driftMonitor.getReport(report))
+		handleDriftReport(report);
+	applyDriftCorrection();
+
+	float now = ofGetElapsedTimef();
+	if (now - lastDriftCheck < driftCheckInterval || driftMonitor.isBusy())
+		return;
+	lastDriftCheck = now;
+	// The raw frame is copied in the grabber thread and analysed in the monitor thread
+	DriftMonitor* monitor = &driftMonitor;
+	ofRectangle ROI = kinectROI;
+	ofVec4f basePlane = getPlaneEquation(basePlaneOffsetBack, basePlaneNormalBack);
+	ofMatrix4x4 worldMatrix = kinectWorldMatrix;
+	bool reset = driftReset;
+	driftReset = false;
+	kinectgrabber.performInThread([monitor, ROI, basePlane, worldMatrix, reset](KinectGrabber & kg) {
+		DriftRequest frame;
+		frame.depth = kg.getRawDepthImage();
+		frame.ROI = ROI;
+		frame.basePlane = basePlane;
+		frame.worldMatrix = worldMatrix;
+		frame.resetReference = reset;
+		monitor->request(frame);
+	});
+}
+
+// The grabber computes the elevation of the depth pyramid with the current base plane
+void KinectProjector::updateElevationPlane(){
+	if (elevationPlaneSent && basePlaneEq == elevationPlane)
+		return;
+	elevationPlane = basePlaneEq;
+	elevationPlaneSent = true;
+	ofVec4f basePlane = basePlaneEq;
+	ofMatrix4x4 worldMatrix = kinectWorldMatrix;
+	kinectgrabber.performInThread([basePlane, worldMatrix](KinectGrabber & kg) {
+		kg.setElevationPlane(basePlane, worldMatrix);
+	});
+}
+
+void KinectProjector::handleDriftReport(const DriftReport& report){
+	if (driftReset) // Measured against the previous calibration
+		return;
+	ofLogVerbose("KinectProjector") << "handleDriftReport(): Angle: " << report.angle << " Offset: " << report.offset << " ROI shift: " << report.ROIShift << " (" << report.duration << " ms)";
+	string status = "Drift: ";
+	if (report.wallPlaneFound)
+		status += ofToString(report.angle, 2) + " deg " + ofToString(report.offset, 1) + " mm ";
+	if (report.wallsFound)
+		status += "ROI " + ofToString(report.ROIShift.x, 1) + ", " + ofToString(report.ROIShift.y, 1) + " px";
+	if (!report.wallPlaneFound && !report.wallsFound)
+		status += "walls not found";
+	if (displayGui)
+		StatusGUI->getLabel("Drift Status")->setLabel(status);
+	if (!driftCorrection || report.reference)
+		return;
+
+	if (report.wallPlaneFound)
+	{
+		if (report.angle <= maxDriftAngle && std::abs(report.offset) <= maxDriftOffset)
+		{
+			driftTargetNormal = ofVec3f(report.basePlane.x, report.basePlane.y, report.basePlane.z);
+			driftTargetOffset = ofVec3f(0, 0, -report.basePlane.w / report.basePlane.z);
+			driftTargetValid = true;
+		}
+		else
+			ofLogVerbose("KinectProjector") << "handleDriftReport(): The base plane drift is too large to be corrected - please recalibrate";
+	}
+	if (report.wallsFound)
+	{
+		int dx = static_cast<int>(ofClamp(round(report.ROIShift.x), -maxDriftROIShift, maxDriftROIShift));
+		int dy = static_cast<int>(ofClamp(round(report.ROIShift.y), -maxDriftROIShift, maxDriftROIShift));
+		if (std::abs(report.ROIShift.x) > maxDriftROIShift || std::abs(report.ROIShift.y) > maxDriftROIShift)
+			ofLogVerbose("KinectProjector") << "handleDriftReport(): The ROI drift is too large to be corrected - please recalibrate";
+		else if (dx != 0 || dy != 0)
+		{
+			kinectROI.x += dx;
+			kinectROI.y += dy;
+			setNewKinectROI();
+			driftReset = false; // The reference walls moved with the ROI
+		}
+	}
+}
+
+// Move the base plane a bit toward the drift target each frame so the projection does not jump
+void KinectProjector::applyDriftCorrection(){
+	if (!driftTargetValid)
+		return;
+	float amount = min(1.0f, (float)ofGetLastFrameTime() / driftCorrectionTime);
+	ofVec3f normalStep = (driftTargetNormal - basePlaneNormalBack)*amount;
+	float offsetStep = (driftTargetOffset.z - basePlaneOffsetBack.z)*amount;
+	// The manual tilt and vertical offset of the sea level are kept
+	basePlaneNormalBack = (basePlaneNormalBack + normalStep).getNormalized();
+	basePlaneNormal = (basePlaneNormal + normalStep).getNormalized();
+	basePlaneOffsetBack.z += offsetStep;
+	basePlaneOffset.z += offsetStep;
+	basePlaneEq = getPlaneEquation(basePlaneOffset, basePlaneNormal);
+	basePlaneUpdated = true;
+	if (basePlaneNormalBack.distance(driftTargetNormal) < 1e-4 && std::abs(basePlaneOffsetBack.z - driftTargetOffset.z) < 0.05)
+	{
+		driftTargetValid = false;
+		ofLogVerbose("KinectProjector") << "applyDriftCorrection(): Base plane corrected: " << basePlaneNormalBack << " " << basePlaneOffsetBack;
+		saveCalibrationAndSettings();
+	}
+}
+
+// The grabber only goes idle while the application runs - the calibration needs every frame
+void KinectProjector::updateGrabberIdleMode(){
+	bool enabled = idleMode && applicationState == APPLICATION_STATE_RUNNING;
+	if (enabled == grabberIdleMode)
+		return;
+	grabberIdleMode = enabled;
+	// The grabber filters at the idle frame rate while the sand is static
+	float delay = idleDelay;
+	int filterInterval = max(1, 30 / max(1, idleFrameRate));
+	kinectgrabber.performInThread([enabled, delay, filterInterval](KinectGrabber & kg) {
+		kg.setIdleMode(enabled, delay, filterInterval);
+	});
+	if (!enabled)
+		idle = false;
+}
+
+// The color stream is only needed by the calibration, the color view and the recording of the color
+void KinectProjector::updateColorStreaming(){
+	bool enabled = !depthOnlyAcquisition || applicationState != APPLICATION_STATE_RUNNING || drawKinectColorView || (recordingSession && recordColor);
+	if (enabled == colorStreaming)
+		return;
+	colorStreaming = enabled;
+	kinectgrabber.performInThread([enabled](KinectGrabber & kg) {
+		kg.setColorEnabled(enabled);
+	});
+}
+
+// The buffers of the temporal filter are freed as soon as the chessboard acquisition ends or is aborted
+void KinectProjector::updateTemporalFrameFilter(){
+	if (TemporalFrameFilter.isActive() && (applicationState != APPLICATION_STATE_CALIBRATING || (autoCalibState != AUTOCALIB_STATE_NEXT_POINT && autoCalibState != AUTOCALIB_STATE_DETECT_CHESSBOARD)))
+		TemporalFrameFilter.Release();
+}
+
 void KinectProjector::onButtonEvent(ofxDatGuiButtonEvent e){
     if (e.target->is("Full Calibration")) {
         startFullCalibration();
@@ -1716,6 +2053,21 @@ void KinectProjector::onToggleEvent(ofxDatGuiToggleEvent e){
 	else if (e.target->is("Full Frame Filtering")) {
 		setFullFrameFiltering(e.checked);
 	}
+	else if (e.target->is("Integer filter buffers")) {
+		setIntegerFilterBuffers(e.checked);
+	}
+	else if (e.target->is("Recursive filter")) {
+		setRecursiveFilter(e.checked);
+	}
+	else if (e.target->is("16 bit depth texture")) {
+		setDepthTexture16Bit(e.checked);
+	}
+	else if (e.target->is("Idle mode")) {
+		setIdleMode(e.checked);
+	}
+	else if (e.target->is("Drift correction")) {
+		setDriftCorrection(e.checked);
+	}
 	else if (e.target->is("Draw kinect depth view")){
         drawKinectView = e.checked;
 		if (drawKinectView)
@@ -1736,6 +2088,10 @@ void KinectProjector::onToggleEvent(ofxDatGuiToggleEvent e){
 	{
 		DumpDebugFiles = e.checked;
 	}
+	else if (e.target->is("Record session"))
+	{
+		setRecording(e.checked);
+	}
 	else if (e.target->is("Show ROI on sand"))
 	{
 		showROIonProjector(e.checked);
@@ -1850,6 +2206,52 @@ void KinectProjector::saveCalibrationAndSettings()
 	}
 }
 
+std::unique_ptr<DepthSource> KinectProjector::createDepthSource(){
+	// A recorded session can be replayed instead of the live kinect
+	string settingsFile = "settings/depthSourceSettings.xml";
+
+	ofXml xml;
+	if (!xml.load(settingsFile))
+		return nullptr;
+	xml.setTo("DEPTHSOURCE");
+	recordColor = xml.getValue<bool>("recordColor", true);
+	compressRecordedDepth = xml.getValue<bool>("compressRecordedDepth", true);
+	string replayPath = xml.getValue<string>("replayPath", "");
+	if (replayPath == "")
+		return nullptr;
+
+	ReplayDepthSource::Replay_mode mode = ReplayDepthSource::modeFromString(xml.getValue<string>("replayMode", "realtime"));
+	bool loop = xml.getValue<bool>("replayLoop", true);
+	ofLogVerbose("KinectProjector") << "createDepthSource(): Replaying recording " << replayPath;
+	return std::unique_ptr<DepthSource>(new ReplayDepthSource(replayPath, mode, loop));
+}
+
+void KinectProjector::stepReplay(){
+	kinectgrabber.stepReplay();
+}
+
+void KinectProjector::setRecording(bool srecording){
+	recordingSession = srecording;
+	if (recordingSession)
+	{
+		ofDirectory::createDirectory("recordings", true, true);
+		string path = ofToDataPath("recordings/session_" + GetTimeAndDateString() + ".msd");
+		bool scolor = recordColor;
+		bool scompress = compressRecordedDepth;
+		ofLogVerbose("KinectProjector") << "setRecording(): Recording session to " << path;
+		kinectgrabber.performInThread([path, scolor, scompress](KinectGrabber & kg) {
+			kg.startRecording(path, scolor, scompress);
+		});
+	}
+	else
+	{
+		ofLogVerbose("KinectProjector") << "setRecording(): Stop recording session";
+		kinectgrabber.performInThread([](KinectGrabber & kg) {
+			kg.stopRecording();
+		});
+	}
+}
+
 bool KinectProjector::loadSettings(){
     string settingsFile = "settings/kinectProjectorSettings.xml";
     
@@ -1870,6 +2272,26 @@ bool KinectProjector::loadSettings(){
     numAveragingSlots = xml.getValue<int>("numAveragingSlots");
 	doInpainting = xml.getValue<bool>("OutlierInpainting", false);
 	doFullFrameFiltering = xml.getValue<bool>("FullFrameFiltering", false);
+	numFilterThreads = xml.getValue<int>("numFilterThreads", 0);
+	integerFilterBuffers = xml.getValue<bool>("IntegerFilterBuffers", false);
+	recursiveFilter = xml.getValue<bool>("RecursiveFilter", false);
+	depthTexture16Bit = xml.getValue<bool>("DepthTexture16Bit", false);
+	spatialFilterRadius = xml.getValue<int>("spatialFilterRadius", 1);
+	spatialFilterPasses = xml.getValue<int>("spatialFilterPasses", 2);
+	dirtyTileSize = xml.getValue<int>("dirtyTileSize", 16);
+	idleMode = xml.getValue<bool>("IdleMode", false);
+	idleDelay = xml.getValue<float>("idleDelay", 30);
+	idleFrameRate = xml.getValue<int>("idleFrameRate", 10);
+	latencyDumpInterval = xml.getValue<float>("latencyDumpInterval", 0);
+	depthOnlyAcquisition = xml.getValue<bool>("DepthOnlyAcquisition", false);
+	basePlaneRansac = xml.getValue<bool>("basePlaneRansac", true);
+	driftMonitoring = xml.getValue<bool>("DriftMonitoring", true);
+	driftCorrection = xml.getValue<bool>("DriftCorrection", false);
+	driftCheckInterval = xml.getValue<float>("driftCheckInterval", 60);
+	driftCorrectionTime = xml.getValue<float>("driftCorrectionTime", 10);
+	maxDriftAngle = xml.getValue<float>("maxDriftAngle", 2);
+	maxDriftOffset = xml.getValue<float>("maxDriftOffset", 20);
+	maxDriftROIShift = xml.getValue<int>("maxDriftROIShift", 8);
     return true;
 }
 
@@ -1890,6 +2312,26 @@ bool KinectProjector::saveSettings()
     xml.addValue("numAveragingSlots", numAveragingSlots);
 	xml.addValue("OutlierInpainting", doInpainting);
 	xml.addValue("FullFrameFiltering", doFullFrameFiltering);
+	xml.addValue("numFilterThreads", numFilterThreads);
+	xml.addValue("IntegerFilterBuffers", integerFilterBuffers);
+	xml.addValue("RecursiveFilter", recursiveFilter);
+	xml.addValue("DepthTexture16Bit", depthTexture16Bit);
+	xml.addValue("spatialFilterRadius", spatialFilterRadius);
+	xml.addValue("spatialFilterPasses", spatialFilterPasses);
+	xml.addValue("dirtyTileSize", dirtyTileSize);
+	xml.addValue("IdleMode", idleMode);
+	xml.addValue("idleDelay", idleDelay);
+	xml.addValue("idleFrameRate", idleFrameRate);
+	xml.addValue("latencyDumpInterval", latencyDumpInterval);
+	xml.addValue("DepthOnlyAcquisition", depthOnlyAcquisition);
+	xml.addValue("basePlaneRansac", basePlaneRansac);
+	xml.addValue("DriftMonitoring", driftMonitoring);
+	xml.addValue("DriftCorrection", driftCorrection);
+	xml.addValue("driftCheckInterval", driftCheckInterval);
+	xml.addValue("driftCorrectionTime", driftCorrectionTime);
+	xml.addValue("maxDriftAngle", maxDriftAngle);
+	xml.addValue("maxDriftOffset", maxDriftOffset);
+	xml.addValue("maxDriftROIShift", maxDriftROIShift);
 	xml.setToParent();
     return xml.save(settingsFile);
 }
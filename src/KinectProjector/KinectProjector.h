@@ -34,6 +34,11 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #include "KinectProjectorCalibration.h"
 #include "Utils.h"
 #include "TemporalFrameFilter.h"
+#include "LatencyTracker.h"
+#include "PlaneEstimator.h"
+#include "DriftMonitor.h"
+#include "DepthTextureStreamer.h"
+#include "ChessboardDetector.h"
 
 class ofxModalThemeProjKinect : public ofxModalTheme {
 public:
@@ -84,6 +89,12 @@ public:
 	void setFullFrameFiltering(bool ff);	
 	
 	void setFollowBigChanges(bool sfollowBigChanges);
+	void setIntegerFilterBuffers(bool sintegerFilterBuffers); // uint16 samples and exact integer statistics
+	void setRecursiveFilter(bool srecursiveFilter); // Running mean and variance of each pixel instead of the averaging ring
+	void setDepthTexture16Bit(bool sdepthTexture16Bit); // 16 bit normalized depth texture instead of 32 bit float
+	void setSpatialFilterParameters(int sradius, int spasses); // Binomial kernel radius (1-5) and number of passes
+	void setIdleMode(bool sidleMode); // Throttle the filter and the rendering when the sand is static
+	void setDriftCorrection(bool sdriftCorrection); // Follow the small displacements of the sandbox
 	void StartManualROIDefinition();
 	void ResetSeaLevel();
 	void showROIonProjector(bool show);
@@ -103,10 +114,10 @@ public:
 
     // Functions for shaders
     void bind(){
-        FilteredDepthImage.getTexture().bind();
+        depthStreamer.getTexture().bind();
     }
     void unbind(){
-        FilteredDepthImage.getTexture().unbind();
+        depthStreamer.getTexture().unbind();
     }
     ofMatrix4x4 getTransposedKinectWorldMatrix(){
         return kinectWorldMatrix.getTransposedOf(kinectWorldMatrix);
@@ -120,11 +131,38 @@ public:
 
     // Getter and setter
     ofTexture & getTexture(){
-        return FilteredDepthImage.getTexture();
+        return depthStreamer.getTexture();
     }
     ofRectangle getKinectROI(){
         return kinectROI;
     }
+    // Per stage latency of the depth frames - the renderer and the app add their time stamps
+    LatencyTracker& getLatencyTracker(){
+        return latencyTracker;
+    }
+    // Has the sand been static for the idle delay - only when the idle mode is enabled
+    bool isIdle(){
+        return idle;
+    }
+    float getIdleDelay(){
+        return idleDelay;
+    }
+    int getIdleFrameRate(){
+        return idleFrameRate;
+    }
+    // Incremented each time the depth texture changes - caches derived from it can be kept while it is unchanged
+    uint64_t getDepthRevision(){
+        return depthRevision;
+    }
+    // Tiles of the depth changed in the latest frame - the frame is invalid before the first frame
+    FrameRef<DirtyTiles> getDirtyTiles(){
+        return dirtyFrame;
+    }
+    // Coarse depth and elevation of the latest frame - the frame is invalid before the first frame
+    // The elevation uses the base plane of the frame, which can lag one frame behind getBasePlaneEq()
+    FrameRef<DepthPyramid> getDepthPyramid(){
+        return pyramidFrame;
+    }
     ofVec2f getKinectRes(){
         return kinectRes;
     }
@@ -180,6 +218,11 @@ public:
 	void SaveFilteredDepthImage();
 	void SaveKinectColorImage();
 
+	// Deliver the next frame when replaying a recording in step mode
+	void stepReplay();
+	// Record the raw kinect frames in data/recordings
+	void setRecording(bool srecording);
+
 private:
 
     enum Calibration_state
@@ -209,6 +252,7 @@ private:
         AUTOCALIB_STATE_INIT_FIRST_PLANE,
         AUTOCALIB_STATE_INIT_POINT,
         AUTOCALIB_STATE_NEXT_POINT,
+        AUTOCALIB_STATE_DETECT_CHESSBOARD,
         AUTOCALIB_STATE_COMPUTE,
         AUTOCALIB_STATE_DONE
     };
@@ -216,6 +260,16 @@ private:
    
     void exit(ofEventArgs& e);
     void setupGradientField();
+    void updateFilterStorage();
+    void updateGrabberIdleMode();
+    void updateColorStreaming();
+    void updateTemporalFrameFilter();
+    void updateLatencyStatus();
+    void updateDriftMonitor();
+    void updateElevationPlane();
+    void handleDriftReport(const DriftReport& report);
+    void applyDriftCorrection();
+    ofVec2f gradientAtScale(float x, float y);
     
 
     void updateCalibration();
@@ -229,12 +283,14 @@ private:
     void updateROIFromCalibration();
     void setMaxKinectGrabberROI();
     void setNewKinectROI();
+    void setupKinectGrabberFramefilter();
     void updateKinectGrabberROI(ofRectangle ROI);
 
 	void updateProjKinectAutoCalibration();
 
 	double ComputeReprojectionError(bool WriteFile);
 	void CalibrateNextPoint();
+	void ProcessChessboardResult(const ChessboardResult& result);
 
 	void updateProjKinectManualCalibration();
     bool addPointPair();
@@ -248,6 +304,7 @@ private:
     void saveCalibrationAndSettings();
     bool loadSettings();
     bool saveSettings();
+	std::unique_ptr<DepthSource> createDepthSource(); // Replay source from settings - nullptr for the live kinect
     
 	void ProcessChessBoardInput(ofxCvGrayscaleImage& image);
 	void CheckAndNormalizeKinectROI();
@@ -276,17 +333,61 @@ private:
     std::shared_ptr<ofAppBaseWindow> projWindow;
     
     //kinect grabber
+	DriftMonitor                driftMonitor; // Measures the drift of the sandbox walls - outlives the grabber sending it frames
     KinectGrabber               kinectgrabber;
     bool                        spatialFiltering;
     bool                        followBigChanges;
     int                         numAveragingSlots;
 	bool                        doInpainting;
 	bool                        doFullFrameFiltering;
+	bool                        recordingSession;
+	bool                        recordColor;
+	bool                        compressRecordedDepth;
+	int                         numFilterThreads; // 0 for one per core
+	bool                        integerFilterBuffers;
+	bool                        recursiveFilter;
+	bool                        depthTexture16Bit;
+	int                         spatialFilterRadius;
+	int                         spatialFilterPasses;
+	int                         dirtyTileSize; // Size of the change tracking tiles: 16 or 32 pixels
+	bool                        idleMode;
+	float                       idleDelay; // Seconds without change before going idle
+	int                         idleFrameRate; // Filter and rendering rate while idle
+	bool                        idle; // Is the grabber idle
+	bool                        grabberIdleMode; // Idle mode sent to the grabber
+	bool                        depthOnlyAcquisition; // Stop the color stream while the application runs
+	bool                        colorStreaming; // Color stream state sent to the grabber
+	LatencyTracker              latencyTracker;
+	float                       latencyDumpInterval; // Seconds between two dumps of the latency statistics - 0 to disable
+	float                       lastLatencyUpdate;
+	float                       lastLatencyDump;
+	PlaneEstimator              planeEstimator; // Base plane and ceiling fits
+	bool                        basePlaneRansac; // Ignore the objects on the sand when fitting the base plane
+	bool                        driftMonitoring;
+	bool                        driftCorrection; // Apply the small drifts to the base plane and the ROI
+	float                       driftCheckInterval; // Seconds between two measures
+	float                       driftCorrectionTime; // Seconds to apply a base plane correction
+	float                       maxDriftAngle; // Larger drifts need a recalibration: degrees,
+	float                       maxDriftOffset; // millimeters
+	int                         maxDriftROIShift; // and kinect pixels
+	float                       lastDriftCheck;
+	bool                        driftReset; // The calibration changed since the last measure
+	bool                        driftTargetValid;
+	ofVec3f                     driftTargetNormal, driftTargetOffset; // Base plane the correction converges to
 
     //kinect buffer
-    ofxCvFloatImage             FilteredDepthImage;
+    ofxCvFloatImage             FilteredDepthImage; // CPU copy of the latest uploaded depth
+    DepthTextureStreamer        depthStreamer; // Depth texture of the shaders
+    std::vector<ofRectangle>    depthUploadRects; // Tiles changed since the last upload
     ofxCvColorImage             kinectColorImage;
-    ofVec2f*                    gradField;
+    FrameRef<GradientPyramid>   gradientFrame; // Latest gradient of the filtered depth
+    FrameRef<DirtyTiles>        dirtyFrame; // Tiles changed in the latest frame
+    FrameRef<DepthPyramid>      pyramidFrame; // Coarse depth and elevation of the latest frame
+    ofVec4f                     elevationPlane; // Base plane last sent to the grabber for the pyramid
+    bool                        elevationPlaneSent;
+    bool                        depthUploaded;
+    uint64_t                    uploadedFrameId; // Id of the last frame checked for changes
+    uint64_t                    depthRevision; // Incremented each time FilteredDepthImage changes
 	ofFpsCounter                fpsKinect;
 	ofxDatGuiTextInput*         fpsKinectText;
 
@@ -353,6 +454,9 @@ private:
 	// Type of temporal filtering of colour image 0: Median, 1 :average
 	int TemporalFilteringType;
 
+	// Searches the chessboards of the automatic calibration on a worker
+	ChessboardDetector chessboardDetector;
+
     // Chessboard variables
     int   chessboardSize;
     int   chessboardX;
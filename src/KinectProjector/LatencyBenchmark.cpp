@@ -0,0 +1,244 @@
+/***********************************************************************
+LatencyBenchmark - Motion-to-photon latency of the depth filter measured
+on a recorded session with a step change of the sand surface.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "LatencyBenchmark.h"
+#include "KinectGrabber.h"
+#include "DepthSource.h"
+
+#include <fstream>
+
+// Frames averaged for the surfaces before and after the step
+static const int surfaceFrames = 10;
+// Minimal depth change of a pixel of the changed region in millimeters
+static const float minStepChange = 15;
+// A pixel is at the new surface when it is within this fraction of its change
+static const float newSurfaceTolerance = 0.25f;
+// Fractions of the changed region at the new surface for the raw step and the filtered output
+static const float rawStepFraction = 0.8f;
+static const float filteredReachFraction = 0.9f;
+// Time for a frame to be displayed by the projector at 60 Hz - no window is opened so it is not measured
+static const float displayFrameMilliseconds = 1000.0f / 60.0f;
+
+LatencyBenchmark::LatencyBenchmark()
+:width(0),
+height(0),
+stepFrame(-1)
+{
+}
+
+bool LatencyBenchmark::run(std::string recordingPath, std::string resultPath){
+	if (!analyseRecording(recordingPath))
+		return false;
+
+	std::ofstream fost(resultPath.c_str());
+	if (!fost)
+	{
+		ofLogError("LatencyBenchmark") << "run(): Could not write " << resultPath;
+		return false;
+	}
+	fost << "numAveragingSlots,followBigChange,spatialFiltering,inpainting,frames,filtered_ms,projector_ms_estimate,mean_filter_ms" << std::endl;
+
+	int slots[] = {5, 10, 15, 20, 30};
+	for (int numAveragingSlots : slots)
+	{
+		for (int combination = 0; combination < 8; combination++)
+		{
+			Configuration configuration;
+			configuration.numAveragingSlots = numAveragingSlots;
+			configuration.followBigChange = (combination & 1) != 0;
+			configuration.spatialFiltering = (combination & 2) != 0;
+			configuration.inpainting = (combination & 4) != 0;
+			Result result = runConfiguration(recordingPath, configuration);
+
+			fost << configuration.numAveragingSlots << "," << configuration.followBigChange << ","
+				<< configuration.spatialFiltering << "," << configuration.inpainting << ","
+				<< result.frames << "," << result.milliseconds << "," << result.projectorMilliseconds << ","
+				<< result.filterMilliseconds << std::endl;
+			ofLogNotice("LatencyBenchmark") << "Slots: " << configuration.numAveragingSlots
+				<< " Quick reaction: " << configuration.followBigChange
+				<< " Spatial filtering: " << configuration.spatialFiltering
+				<< " Inpainting: " << configuration.inpainting
+				<< " -> " << result.frames << " frames " << result.milliseconds << " ms (estimated projector latency "
+				<< result.projectorMilliseconds << " ms)";
+		}
+	}
+	ofLogNotice("LatencyBenchmark") << "run(): Results written to " << resultPath;
+	return true;
+}
+
+bool LatencyBenchmark::analyseRecording(std::string recordingPath){
+	ReplayDepthSource source(recordingPath, ReplayDepthSource::REPLAY_MODE_FAST, false);
+	if (!source.setup() || !source.open())
+	{
+		ofLogError("LatencyBenchmark") << "analyseRecording(): Could not open " << recordingPath;
+		return false;
+	}
+	width = source.getWidth();
+	height = source.getHeight();
+	int numFrames = source.getNumFrames();
+	if (numFrames < 3*surfaceFrames)
+	{
+		ofLogError("LatencyBenchmark") << "analyseRecording(): The recording needs at least " << 3*surfaceFrames << " frames";
+		return false;
+	}
+
+	// Mean of the valid samples of the first and last frames
+	std::vector<float> beforeSum(width*height, 0), afterSum(width*height, 0);
+	std::vector<int> beforeCount(width*height, 0), afterCount(width*height, 0);
+	timestamps.clear();
+	while (!source.isFinished())
+	{
+		source.update();
+		if (!source.isFrameNew())
+			continue;
+		int frame = source.getCurrentFrame();
+		timestamps.push_back(source.getTimestamp());
+		bool first = frame < surfaceFrames;
+		bool last = frame >= numFrames - surfaceFrames;
+		if (!first && !last)
+			continue;
+		const unsigned short* depth = source.getRawDepthPixels().getData();
+		for (int i = 0; i < width*height; i++)
+		{
+			if (depth[i] == 0)
+				continue;
+			if (first)
+			{
+				beforeSum[i] += depth[i];
+				beforeCount[i]++;
+			}
+			else
+			{
+				afterSum[i] += depth[i];
+				afterCount[i]++;
+			}
+		}
+	}
+
+	before.assign(width*height, 0);
+	after.assign(width*height, 0);
+	changedPixels.clear();
+	for (int i = 0; i < width*height; i++)
+	{
+		// Pixels missing in half of the frames are not reliable
+		if (2*beforeCount[i] < surfaceFrames || 2*afterCount[i] < surfaceFrames)
+			continue;
+		before[i] = beforeSum[i] / beforeCount[i];
+		after[i] = afterSum[i] / afterCount[i];
+		if (fabs(after[i] - before[i]) > minStepChange)
+			changedPixels.push_back(i);
+	}
+	if (changedPixels.empty())
+	{
+		ofLogError("LatencyBenchmark") << "analyseRecording(): No change between the first and last frames of the recording";
+		return false;
+	}
+
+	// Step: first raw frame where the changed region is at its new depth
+	source.open();
+	stepFrame = -1;
+	while (!source.isFinished() && stepFrame < 0)
+	{
+		source.update();
+		if (source.isFrameNew() && fractionAtNewSurface(source.getRawDepthPixels().getData()) >= rawStepFraction)
+			stepFrame = source.getCurrentFrame();
+	}
+	ofLogNotice("LatencyBenchmark") << "analyseRecording(): " << numFrames << " frames, " << changedPixels.size()
+		<< " changed pixels, step at frame " << stepFrame;
+	return stepFrame >= 0;
+}
+
+LatencyBenchmark::Result LatencyBenchmark::runConfiguration(std::string recordingPath, const Configuration& configuration){
+	Result result = {-1, -1, -1, 0};
+
+	KinectGrabber grabber;
+	std::unique_ptr<DepthSource> source(new ReplayDepthSource(recordingPath, ReplayDepthSource::REPLAY_MODE_STEP, false));
+	if (!grabber.setup(std::move(source)))
+		return result;
+	// Every depth is under the ceiling and the whole frame is filtered - the grabber thread is not started yet
+	grabber.setupFramefilter(0, ofRectangle(0, 0, width, height), configuration.spatialFiltering, configuration.followBigChange, configuration.numAveragingSlots);
+	grabber.setInPainting(configuration.inpainting);
+	grabber.setColorEnabled(false); // Only the depth is measured
+	grabber.start();
+
+	uint64_t filterTime = 0;
+	int numFiltered = 0;
+	for (int frame = 0; frame < (int)timestamps.size(); frame++)
+	{
+		grabber.stepReplay();
+		// Wait for the filtered frame
+		uint64_t waitStart = ofGetElapsedTimeMicros();
+		while (!grabber.frames.update())
+		{
+			if (ofGetElapsedTimeMicros() - waitStart > 2000000)
+			{
+				ofLogError("LatencyBenchmark") << "runConfiguration(): No filtered frame received for frame " << frame;
+				grabber.stop();
+				return result;
+			}
+			ofSleepMillis(1);
+		}
+		FrameBundle& bundle = grabber.frames.getReadBuffer();
+		filterTime += bundle.filterTime - bundle.grabTime;
+		numFiltered++;
+
+		if (frame >= stepFrame && result.frames < 0 && fractionAtNewSurface(bundle.depth->getData()) >= filteredReachFraction)
+		{
+			result.frames = frame - stepFrame;
+			result.milliseconds = (timestamps[frame] - timestamps[stepFrame]) / 1000.0f;
+			result.projectorMilliseconds = result.milliseconds + (bundle.filterTime - bundle.grabTime) / 1000.0f + displayFrameMilliseconds;
+		}
+		bundle.release();
+	}
+	grabber.stop();
+	grabber.waitForThread(false);
+	result.filterMilliseconds = numFiltered > 0 ? filterTime / 1000.0f / numFiltered : 0;
+	return result;
+}
+
+float LatencyBenchmark::fractionAtNewSurface(const float* depth){
+	int numValid = 0;
+	int numAtNew = 0;
+	for (int i : changedPixels)
+	{
+		if (depth[i] == 0)
+			continue;
+		numValid++;
+		if (fabs(depth[i] - after[i]) < newSurfaceTolerance*fabs(after[i] - before[i]))
+			numAtNew++;
+	}
+	return numValid > 0 ? (float)numAtNew / numValid : 0;
+}
+
+float LatencyBenchmark::fractionAtNewSurface(const unsigned short* depth){
+	int numValid = 0;
+	int numAtNew = 0;
+	for (int i : changedPixels)
+	{
+		if (depth[i] == 0)
+			continue;
+		numValid++;
+		if (fabs(depth[i] - after[i]) < newSurfaceTolerance*fabs(after[i] - before[i]))
+			numAtNew++;
+	}
+	return numValid > 0 ? (float)numAtNew / numValid : 0;
+}
@@ -0,0 +1,69 @@
+/***********************************************************************
+LatencyBenchmark - Motion-to-photon latency of the depth filter measured
+on a recorded session with a step change of the sand surface.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <string>
+#include <vector>
+
+#include "ofMain.h"
+
+//! Latency of the filter to a step change of the sand
+/** The recording must start and end on a static surface (for instance before and after
+    a hand scooped sand). The surfaces are averaged over the first and last frames and
+    the pixels whose depth changed between them form the changed region. The step
+    happens at the first raw frame where most of the changed region is at its new depth
+    (once the hand has left) and the filtered output reaches the new surface when
+    nearly all the region is at its new depth. The recording is replayed frame by
+    frame through a KinectGrabber for each combination of the filter settings.
+    Run with: Magic-Sand --benchmark <recording> [results.csv]*/
+class LatencyBenchmark {
+public:
+	LatencyBenchmark();
+
+	bool run(std::string recordingPath, std::string resultPath);
+
+private:
+	struct Configuration {
+		int numAveragingSlots;
+		bool followBigChange;
+		bool spatialFiltering;
+		bool inpainting;
+	};
+	struct Result {
+		int frames; // Filtered frames from the step to the new surface, -1 if never reached
+		float milliseconds; // Recording time from the step to the new surface
+		float projectorMilliseconds; // Estimate adding the processing and one displayed frame at 60 Hz, not measured
+		float filterMilliseconds; // Mean processing time of a frame in the grabber
+	};
+
+	bool analyseRecording(std::string recordingPath);
+	Result runConfiguration(std::string recordingPath, const Configuration& configuration);
+	// Fraction of the valid pixels of the changed region that are at their new depth
+	float fractionAtNewSurface(const float* depth);
+	float fractionAtNewSurface(const unsigned short* depth);
+
+	int width, height;
+	std::vector<uint64_t> timestamps;
+	std::vector<float> before, after; // Mean depth of the first and last frames
+	std::vector<int> changedPixels; // Indices of the changed region
+	int stepFrame; // First raw frame at the new surface
+};
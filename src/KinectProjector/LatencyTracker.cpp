@@ -0,0 +1,150 @@
+/***********************************************************************
+LatencyTracker - Rolling percentiles of the time spent by the depth
+frames in each stage from the kinect to the projector.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "LatencyTracker.h"
+#include "ofMain.h"
+
+#include <algorithm>
+#include <fstream>
+
+// Frames in the rolling window of each stage
+static const int windowSize = 512;
+
+LatencyTracker::LatencyTracker()
+:frameActive(false),
+grabTime(0)
+{
+	for (auto & window : windows)
+	{
+		window.samples.assign(windowSize, 0.0f);
+		window.next = 0;
+		window.count = 0;
+	}
+	std::fill(stamps, stamps + LATENCY_STAGE_COUNT, 0);
+}
+
+void LatencyTracker::frameReceived(uint64_t sgrabTime, uint64_t filterTime){
+	// A frame that did not reach the projector before the next one is dropped
+	frameActive = true;
+	grabTime = sgrabTime;
+	std::fill(stamps, stamps + LATENCY_STAGE_COUNT, 0);
+	stamps[LATENCY_STAGE_FILTER] = filterTime;
+	stamps[LATENCY_STAGE_HANDOFF] = ofGetElapsedTimeMicros();
+}
+
+void LatencyTracker::mark(Latency_stage stage){
+	if (frameActive)
+		stamps[stage] = ofGetElapsedTimeMicros();
+}
+
+void LatencyTracker::framePresented(){
+	if (!frameActive)
+		return;
+	frameActive = false;
+	stamps[LATENCY_STAGE_PRESENT] = ofGetElapsedTimeMicros();
+
+	// Each stage starts at the last stage the frame went through
+	uint64_t begin = grabTime;
+	for (int stage = LATENCY_STAGE_FILTER; stage <= LATENCY_STAGE_PRESENT; stage++)
+	{
+		if (stamps[stage] == 0)
+			continue;
+		addSample((Latency_stage)stage, begin, stamps[stage]);
+		begin = stamps[stage];
+	}
+	addSample(LATENCY_STAGE_TOTAL, grabTime, stamps[LATENCY_STAGE_PRESENT]);
+}
+
+void LatencyTracker::addSample(Latency_stage stage, uint64_t begin, uint64_t end){
+	Window& window = windows[stage];
+	window.samples[window.next] = end > begin ? (end - begin) / 1000.0f : 0.0f;
+	window.next = (window.next + 1) % windowSize;
+	window.count = min(window.count + 1, windowSize);
+}
+
+LatencyStats LatencyTracker::getStats(Latency_stage stage) const {
+	const Window& window = windows[stage];
+	LatencyStats stats = {window.count, 0, 0, 0, 0};
+	if (window.count == 0)
+		return stats;
+	std::vector<float> sorted(window.samples.begin(), window.samples.begin() + window.count);
+	std::sort(sorted.begin(), sorted.end());
+	auto percentile = [&sorted](float p) {
+		return sorted[min((int)(p*sorted.size()), (int)sorted.size() - 1)];
+	};
+	stats.p50 = percentile(0.50f);
+	stats.p95 = percentile(0.95f);
+	stats.p99 = percentile(0.99f);
+	stats.max = sorted.back();
+	return stats;
+}
+
+std::string LatencyTracker::getStageName(Latency_stage stage){
+	switch (stage)
+	{
+	case LATENCY_STAGE_FILTER: return "filter";
+	case LATENCY_STAGE_HANDOFF: return "handoff";
+	case LATENCY_STAGE_UPLOAD: return "upload";
+	case LATENCY_STAGE_RENDER: return "render";
+	case LATENCY_STAGE_PRESENT: return "present";
+	case LATENCY_STAGE_TOTAL: return "total";
+	default: return "unknown";
+	}
+}
+
+bool LatencyTracker::appendCSV(const std::string& path) const {
+	std::string fullPath = ofToDataPath(path);
+	bool newFile = !ofFile::doesFileExist(path);
+	std::ofstream fost(fullPath.c_str(), std::ios::app);
+	if (!fost)
+		return false;
+	if (newFile)
+		fost << "time,stage,count,p50,p95,p99,max" << std::endl;
+	std::string time = ofGetTimestampString("%Y-%m-%d %H:%M:%S");
+	for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++)
+	{
+		LatencyStats stats = getStats((Latency_stage)stage);
+		fost << time << "," << getStageName((Latency_stage)stage) << "," << stats.count << ","
+			<< stats.p50 << "," << stats.p95 << "," << stats.p99 << "," << stats.max << std::endl;
+	}
+	return true;
+}
+
+bool LatencyTracker::saveJSON(const std::string& path) const {
+	std::ofstream fost(ofToDataPath(path).c_str());
+	if (!fost)
+		return false;
+	fost << "{" << std::endl;
+	fost << "  \"time\": \"" << ofGetTimestampString("%Y-%m-%d %H:%M:%S") << "\"," << std::endl;
+	fost << "  \"unit\": \"ms\"," << std::endl;
+	fost << "  \"stages\": {" << std::endl;
+	for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++)
+	{
+		LatencyStats stats = getStats((Latency_stage)stage);
+		fost << "    \"" << getStageName((Latency_stage)stage) << "\": {\"count\": " << stats.count
+			<< ", \"p50\": " << stats.p50 << ", \"p95\": " << stats.p95 << ", \"p99\": " << stats.p99
+			<< ", \"max\": " << stats.max << "}" << (stage + 1 < LATENCY_STAGE_COUNT ? "," : "") << std::endl;
+	}
+	fost << "  }" << std::endl;
+	fost << "}" << std::endl;
+	return true;
+}
@@ -0,0 +1,83 @@
+/***********************************************************************
+LatencyTracker - Rolling percentiles of the time spent by the depth
+frames in each stage from the kinect to the projector.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Stages of a depth frame - each one ends at the time stamp of the same name
+enum Latency_stage {
+	LATENCY_STAGE_FILTER, // Kinect frame received -> filtered (grabber thread)
+	LATENCY_STAGE_HANDOFF, // -> received by KinectProjector::update()
+	LATENCY_STAGE_UPLOAD, // -> depth texture updated
+	LATENCY_STAGE_RENDER, // -> sandbox drawn
+	LATENCY_STAGE_PRESENT, // -> projector window drawn and swapped
+	LATENCY_STAGE_TOTAL, // Kinect frame received -> projector window
+	LATENCY_STAGE_COUNT
+};
+
+// Latency percentiles of a stage in milliseconds
+struct LatencyStats {
+	int count;
+	float p50, p95, p99, max;
+};
+
+//! Per stage latency of the depth frames
+/** The grabber time stamps the frames when they are received and filtered and the
+    main thread adds the following time stamps to the latest frame. The durations of
+    the last frames of each stage are kept in a rolling window and summarised in
+    percentiles. Frames that skip a stage (when the sand is static and the texture is
+    not updated) only count in the stages they went through. All the functions are
+    called from the main thread.*/
+class LatencyTracker {
+public:
+	LatencyTracker();
+
+	// A frame from the grabber: time stamps of the grabber in microseconds (ofGetElapsedTimeMicros)
+	void frameReceived(uint64_t grabTime, uint64_t filterTime);
+	// The current frame reached the end of a stage
+	void mark(Latency_stage stage);
+	// The current frame is on the projector - records its durations
+	void framePresented();
+
+	LatencyStats getStats(Latency_stage stage) const;
+	static std::string getStageName(Latency_stage stage);
+
+	// Write the statistics: one line per stage appended to a CSV file and a JSON snapshot
+	bool appendCSV(const std::string& path) const;
+	bool saveJSON(const std::string& path) const;
+
+private:
+	void addSample(Latency_stage stage, uint64_t begin, uint64_t end);
+
+	struct Window {
+		std::vector<float> samples; // Durations in milliseconds
+		int next;
+		int count;
+	};
+	Window windows[LATENCY_STAGE_COUNT];
+
+	bool frameActive;
+	uint64_t stamps[LATENCY_STAGE_COUNT]; // Time stamps of the current frame, 0 if the stage was skipped
+	uint64_t grabTime;
+};
@@ -0,0 +1,257 @@
+/***********************************************************************
+PlaneEstimator - Least squares fit of a plane to the depth pixels of a
+region with streaming moments and an optional RANSAC front end.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "PlaneEstimator.h"
+#include <random>
+
+#include "Utils.h"
+
+// Rows of the region in a band of the moments accumulation
+static const int planeBandRows = 16;
+// RANSAC hypotheses scored by a band
+static const int ransacBandIterations = 16;
+// Spacing of the grid of pixels scoring the RANSAC hypotheses
+static const int ransacGridStep = 4;
+// Attempts to draw a valid pixel for a RANSAC sample
+static const int ransacMaxDraws = 32;
+
+PlaneMoments::PlaneMoments()
+:n(0),
+x(0), y(0), z(0),
+xx(0), xy(0), xz(0), yy(0), yz(0), zz(0)
+{
+}
+
+void PlaneMoments::add(const ofVec3f& p){
+	n += 1;
+	x += p.x;
+	y += p.y;
+	z += p.z;
+	xx += (double)p.x*p.x;
+	xy += (double)p.x*p.y;
+	xz += (double)p.x*p.z;
+	yy += (double)p.y*p.y;
+	yz += (double)p.y*p.z;
+	zz += (double)p.z*p.z;
+}
+
+void PlaneMoments::add(const PlaneMoments& other){
+	n += other.n;
+	x += other.x;
+	y += other.y;
+	z += other.z;
+	xx += other.xx;
+	xy += other.xy;
+	xz += other.xz;
+	yy += other.yy;
+	yz += other.yz;
+	zz += other.zz;
+}
+
+bool PlaneMoments::getPlane(ofVec4f& plane) const {
+	if (n < 3)
+		return false;
+	double cx = x / n, cy = y / n, cz = z / n;
+
+	// Covariance matrix of the points (times n), excluding symmetries
+	double cxx = xx - n*cx*cx;
+	double cxy = xy - n*cx*cy;
+	double cxz = xz - n*cx*cz;
+	double cyy = yy - n*cy*cy;
+	double cyz = yz - n*cy*cz;
+	double czz = zz - n*cz*cz;
+
+	double det_x = cyy*czz - cyz*cyz;
+	double det_y = cxx*czz - cxz*cxz;
+	double det_z = cxx*cyy - cxy*cxy;
+	double det_max = max(det_x, max(det_y, det_z));
+	if (det_max <= 0)
+		return false;
+
+	// Pick path with best conditioning
+	ofVec3f dir;
+	if (det_max == det_x)
+		dir = ofVec3f(1.0, (cxz*cyz - cxy*czz) / det_x, (cxy*cyz - cxz*cyy) / det_x);
+	else if (det_max == det_y)
+		dir = ofVec3f((cyz*cxz - cxy*czz) / det_y, 1.0, (cxy*cxz - cyz*cxx) / det_y);
+	else
+		dir = ofVec3f((cyz*cxy - cxz*cyy) / det_z, (cxz*cxy - cyz*cxx) / det_z, 1.0);
+
+	plane = ofxCSG::getPlaneEquation(ofVec3f(cx, cy, cz), dir.getNormalized());
+	return true;
+}
+
+PlaneEstimator::PlaneEstimator()
+:ransac(true),
+numIterations(256),
+inlierDistance(15),
+invalidDepth(4000),
+sampleStep(1),
+depth(nullptr),
+width(0),
+left(0), right(0), top(0), bottom(0),
+excludedLeft(0), excludedRight(0), excludedTop(0), excludedBottom(0),
+numPoints(0),
+numInliers(0)
+{
+}
+
+void PlaneEstimator::setRansac(bool enabled, int snumIterations, float sinlierDistance){
+	ransac = enabled;
+	numIterations = max(1, snumIterations);
+	inlierDistance = sinlierDistance;
+}
+
+void PlaneEstimator::setSampling(int step, ofRectangle sexcluded){
+	sampleStep = max(1, step);
+	excluded = sexcluded;
+}
+
+ofVec3f PlaneEstimator::worldPoint(int x, int y) const {
+	ofVec4f kc = ofVec2f(x, y);
+	kc.z = depth[y*width + x];
+	kc.w = 1;
+	ofVec4f wc = worldMatrix*kc*kc.z;
+	return ofVec3f(wc);
+}
+
+bool PlaneEstimator::estimate(const float* sdepth, int swidth, int sheight, ofRectangle ROI, const ofMatrix4x4& kinectWorldMatrix, ofVec4f& plane){
+	depth = sdepth;
+	width = swidth;
+	worldMatrix = kinectWorldMatrix;
+	left = max(0, static_cast<int>(ROI.getLeft()));
+	top = max(0, static_cast<int>(ROI.getTop()));
+	right = min(swidth, static_cast<int>(ROI.getRight()));
+	bottom = min(sheight, static_cast<int>(ROI.getBottom()));
+	excludedLeft = static_cast<int>(excluded.getLeft());
+	excludedTop = static_cast<int>(excluded.getTop());
+	excludedRight = static_cast<int>(excluded.getRight());
+	excludedBottom = static_cast<int>(excluded.getBottom());
+	numPoints = 0;
+	numInliers = 0;
+	if (right - left < 2 || bottom - top < 2)
+	{
+		ofLogVerbose("PlaneEstimator") << "estimate(): Empty region " << ROI;
+		return false;
+	}
+
+	ofVec4f ransacPlane;
+	bool useInliers = ransac && runRansac(ransacPlane);
+	if (ransac && !useInliers)
+		ofLogVerbose("PlaneEstimator") << "estimate(): RANSAC found no plane, fitting all the pixels";
+	if (!fitPlane(useInliers, ransacPlane, plane))
+	{
+		ofLogVerbose("PlaneEstimator") << "estimate(): The " << numPoints << " points don't span a plane";
+		return false;
+	}
+	ofLogVerbose("PlaneEstimator") << "estimate(): Plane " << plane << " fitted to " << numPoints << " points";
+	return true;
+}
+
+// Accumulate the moments of the valid pixels (close to the RANSAC plane if useInliers) by bands of rows
+bool PlaneEstimator::fitPlane(bool useInliers, const ofVec4f& ransacPlane, ofVec4f& plane){
+	bandMoments.assign(WorkerPool::getNumBands(top, bottom, planeBandRows), PlaneMoments());
+	workers.parallelFor(top, bottom, planeBandRows, [&](int y0, int y1, int band) {
+		PlaneMoments& moments = bandMoments[band];
+		for (int y = y0; y < y1; y++)
+		{
+			if ((y - top) % sampleStep != 0)
+				continue;
+			for (int x = left; x < right; x += sampleStep)
+			{
+				if (!isValid(depth[y*width + x]) || isExcluded(x, y))
+					continue;
+				ofVec3f p = worldPoint(x, y);
+				if (useInliers && std::fabs(ransacPlane.x*p.x + ransacPlane.y*p.y + ransacPlane.z*p.z + ransacPlane.w) >= inlierDistance)
+					continue;
+				moments.add(p);
+			}
+		}
+	});
+	PlaneMoments moments;
+	for (auto & bandMoment : bandMoments)
+		moments.add(bandMoment);
+	numPoints = static_cast<int>(moments.n);
+	return moments.getPlane(plane);
+}
+
+// Score planes through random triples of valid pixels - each hypothesis has its own seed so the
+// best plane does not depend on the number of threads
+bool PlaneEstimator::runRansac(ofVec4f& ransacPlane){
+	scores.assign(numIterations, 0);
+	candidates.resize(numIterations);
+	workers.parallelFor(0, numIterations, ransacBandIterations, [&](int i0, int i1, int /*band*/) {
+		for (int i = i0; i < i1; i++)
+		{
+			std::mt19937 rng(i);
+			std::uniform_int_distribution<int> xDist(left, right - 1);
+			std::uniform_int_distribution<int> yDist(top, bottom - 1);
+			ofVec3f p[3];
+			bool sampled = true;
+			for (int k = 0; k < 3 && sampled; k++)
+			{
+				sampled = false;
+				for (int draw = 0; draw < ransacMaxDraws && !sampled; draw++)
+				{
+					int x = xDist(rng);
+					int y = yDist(rng);
+					if (isValid(depth[y*width + x]) && !isExcluded(x, y))
+					{
+						p[k] = worldPoint(x, y);
+						sampled = true;
+					}
+				}
+			}
+			ofVec3f normal = (p[1] - p[0]).getCrossed(p[2] - p[0]);
+			if (!sampled || normal.length() == 0)
+				continue; // Degenerate sample
+			normal.normalize();
+			candidates[i] = ofVec4f(normal.x, normal.y, normal.z, -normal.dot(p[0]));
+			scores[i] = scorePlane(candidates[i]);
+		}
+	});
+	int best = 0;
+	for (int i = 1; i < numIterations; i++)
+		if (scores[i] > scores[best])
+			best = i;
+	numInliers = scores[best];
+	if (numInliers < 3)
+		return false;
+	ransacPlane = candidates[best];
+	ofLogVerbose("PlaneEstimator") << "runRansac(): Best plane " << ransacPlane << " supported by " << numInliers << " grid pixels";
+	return true;
+}
+
+int PlaneEstimator::scorePlane(const ofVec4f& candidate) const {
+	int count = 0;
+	int step = max(ransacGridStep, sampleStep);
+	for (int y = top; y < bottom; y += step)
+		for (int x = left; x < right; x += step)
+		{
+			if (!isValid(depth[y*width + x]) || isExcluded(x, y))
+				continue;
+			ofVec3f p = worldPoint(x, y);
+			if (std::fabs(candidate.x*p.x + candidate.y*p.y + candidate.z*p.z + candidate.w) < inlierDistance)
+				count++;
+		}
+	return count;
+}
@@ -0,0 +1,103 @@
+/***********************************************************************
+PlaneEstimator - Least squares fit of a plane to the depth pixels of a
+region with streaming moments and an optional RANSAC front end.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <vector>
+
+#include "ofMain.h"
+#include "WorkerPool.h"
+
+// Running first and second order moments of a set of 3D points
+struct PlaneMoments {
+	PlaneMoments();
+	void add(const ofVec3f& p);
+	void add(const PlaneMoments& other);
+	// Plane through the centroid normal to the direction of least variance
+	// Returns false if the points do not span a plane
+	bool getPlane(ofVec4f& plane) const;
+
+	double n;
+	double x, y, z;
+	double xx, xy, xz, yy, yz, zz;
+};
+
+//! Plane of the depth pixels of a region in kinect world coordinates
+/** The points are never stored: the moments are accumulated by bands of rows in
+    parallel and reduced in band order so the result does not depend on the number
+    of threads. With RANSAC, planes through random triples of pixels are scored on
+    a sub-sampled grid in parallel and the final fit only uses the pixels close to
+    the best one, so hands or objects on the sand do not tilt the plane.
+    estimate() is called from a single thread (the main thread).*/
+class PlaneEstimator {
+public:
+	PlaneEstimator();
+
+	void setRansac(bool enabled, int numIterations = 256, float inlierDistance = 15);
+	void setNumThreads(int numThreads){
+		workers.setNumThreads(numThreads);
+	}
+	// Only use one pixel out of step x step and ignore the pixels of the excluded region
+	void setSampling(int step, ofRectangle excluded = ofRectangle());
+
+	// depth is the filtered frame in millimeters, pixels at 0 or at the initial value of the filter are ignored
+	bool estimate(const float* depth, int width, int height, ofRectangle ROI, const ofMatrix4x4& kinectWorldMatrix, ofVec4f& plane);
+
+	int getNumPoints(){ // Pixels used by the last fit
+		return numPoints;
+	}
+	int getNumInliers(){ // Pixels of the sub-sampled grid supporting the best RANSAC plane
+		return numInliers;
+	}
+
+private:
+	bool isValid(float z) const {
+		return z > 0 && z < invalidDepth;
+	}
+	bool isExcluded(int x, int y) const {
+		return x >= excludedLeft && x < excludedRight && y >= excludedTop && y < excludedBottom;
+	}
+	ofVec3f worldPoint(int x, int y) const;
+	bool fitPlane(bool useInliers, const ofVec4f& ransacPlane, ofVec4f& plane);
+	bool runRansac(ofVec4f& ransacPlane);
+	int scorePlane(const ofVec4f& candidate) const;
+
+	bool ransac;
+	int numIterations;
+	float inlierDistance;
+	float invalidDepth;
+	int sampleStep;
+	ofRectangle excluded;
+
+	// Current estimation
+	const float* depth;
+	int width;
+	int left, right, top, bottom;
+	int excludedLeft, excludedRight, excludedTop, excludedBottom;
+	ofMatrix4x4 worldMatrix;
+
+	WorkerPool workers;
+	std::vector<PlaneMoments> bandMoments; // Reused between estimations
+	std::vector<int> scores;
+	std::vector<ofVec4f> candidates;
+	int numPoints;
+	int numInliers;
+};
@@ -24,18 +24,160 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <cstring>
 #include "ofLog.h"
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define TEMPORAL_FILTER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define TEMPORAL_FILTER_NEON
+#include <arm_neon.h>
+#endif
+
+// The SSSE3 kernels are compiled for SSSE3 without changing the flags of the whole project
+#if defined(__GNUC__) || defined(__clang__)
+#define TEMPORAL_TARGET_SSSE3 __attribute__((target("ssse3")))
+#else
+#define TEMPORAL_TARGET_SSSE3
+#endif
+
+//--------------------------------------------------------------
+// Conversion of a row of RGB pixels to R+G+B and to gray (R+G+B)/3
+//--------------------------------------------------------------
+static void rgbSumPixels(const unsigned char* rgb, unsigned short* sum, int start, int end)
+{
+	for (int x = start; x < end; x++)
+		sum[x] = rgb[3 * x] + rgb[3 * x + 1] + rgb[3 * x + 2];
+}
+
+static void rgbGrayPixels(const unsigned char* rgb, unsigned char* gray, int start, int end)
+{
+	for (int x = start; x < end; x++)
+		gray[x] = (unsigned char)((rgb[3 * x] + rgb[3 * x + 1] + rgb[3 * x + 2]) / 3);
+}
+
+#ifdef TEMPORAL_FILTER_X86
+// R+G+B of 8 pixels - reads 28 bytes
+TEMPORAL_TARGET_SSSE3
+static inline __m128i rgbSum8SSSE3(const unsigned char* rgb)
+{
+	// R and G of 4 pixels in the low and high words, B in the low words
+	const __m128i rg = _mm_setr_epi8(0, -1, 3, -1, 6, -1, 9, -1, 1, -1, 4, -1, 7, -1, 10, -1);
+	const __m128i b = _mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	__m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb));
+	__m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb + 12));
+	__m128i rgLo = _mm_shuffle_epi8(lo, rg);
+	__m128i rgHi = _mm_shuffle_epi8(hi, rg);
+	__m128i sumLo = _mm_add_epi16(_mm_add_epi16(rgLo, _mm_srli_si128(rgLo, 8)), _mm_shuffle_epi8(lo, b));
+	__m128i sumHi = _mm_add_epi16(_mm_add_epi16(rgHi, _mm_srli_si128(rgHi, 8)), _mm_shuffle_epi8(hi, b));
+	return _mm_unpacklo_epi64(sumLo, sumHi);
+}
+
+TEMPORAL_TARGET_SSSE3
+static void rgbSumRowSSSE3(const unsigned char* rgb, unsigned short* sum, int n)
+{
+	int x = 0;
+	for (; x + 10 <= n; x += 8)
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(sum + x), rgbSum8SSSE3(rgb + 3 * x));
+	rgbSumPixels(rgb, sum, x, n);
+}
+
+TEMPORAL_TARGET_SSSE3
+static void rgbGrayRowSSSE3(const unsigned char* rgb, unsigned char* gray, int n)
+{
+	// floor(s/3) = (s*0xAAAB) >> 17 for s <= 765
+	const __m128i third = _mm_set1_epi16((short)0xAAAB);
+	int x = 0;
+	for (; x + 10 <= n; x += 8)
+	{
+		__m128i g = _mm_srli_epi16(_mm_mulhi_epu16(rgbSum8SSSE3(rgb + 3 * x), third), 1);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(gray + x), _mm_packus_epi16(g, g));
+	}
+	rgbGrayPixels(rgb, gray, x, n);
+}
+
+static bool cpuSupportsSSSE3()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 9)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+#endif
+}
+#endif
+
+static void rgbSumRow(const unsigned char* rgb, unsigned short* sum, int n)
+{
+#if defined(TEMPORAL_FILTER_X86)
+	static const bool ssse3 = cpuSupportsSSSE3();
+	if (ssse3)
+	{
+		rgbSumRowSSSE3(rgb, sum, n);
+		return;
+	}
+#elif defined(TEMPORAL_FILTER_NEON)
+	int x = 0;
+	for (; x + 8 <= n; x += 8)
+	{
+		uint8x8x3_t p = vld3_u8(rgb + 3 * x);
+		vst1q_u16(sum + x, vaddw_u8(vaddl_u8(p.val[0], p.val[1]), p.val[2]));
+	}
+	rgbSumPixels(rgb, sum, x, n);
+	return;
+#endif
+	rgbSumPixels(rgb, sum, 0, n);
+}
+
+static void rgbGrayRow(const unsigned char* rgb, unsigned char* gray, int n)
+{
+#if defined(TEMPORAL_FILTER_X86)
+	static const bool ssse3 = cpuSupportsSSSE3();
+	if (ssse3)
+	{
+		rgbGrayRowSSSE3(rgb, gray, n);
+		return;
+	}
+#elif defined(TEMPORAL_FILTER_NEON)
+	int x = 0;
+	for (; x + 8 <= n; x += 8)
+	{
+		uint8x8x3_t p = vld3_u8(rgb + 3 * x);
+		uint16x8_t s = vaddw_u8(vaddl_u8(p.val[0], p.val[1]), p.val[2]);
+		uint16x8_t g = vcombine_u16(vshrn_n_u32(vmull_n_u16(vget_low_u16(s), 0xAAAB), 16), vshrn_n_u32(vmull_n_u16(vget_high_u16(s), 0xAAAB), 16));
+		vst1_u8(gray + x, vmovn_u16(vshrq_n_u16(g, 1)));
+	}
+	rgbGrayPixels(rgb, gray, x, n);
+	return;
+#endif
+	rgbGrayPixels(rgb, gray, 0, n);
+}
+
 CTemporalFrameFilter::CTemporalFrameFilter()
 {
 	medianImg = nullptr;
 	imgDataBuffer = nullptr;
-	imgDataBufferCol = nullptr;
+	imgSortedBuffer = nullptr;
+	imgSumBuffer = nullptr;
+	imgSumTotal = nullptr;
 	currentFrame = 0;
 	validBuffer = false;
+	active = false;
 	sizeX = 0;
 	sizeY = 0;
 	nFrames = 0;
+	roiX = 0;
+	roiY = 0;
+	roiW = 0;
+	roiH = 0;
 }
 
 CTemporalFrameFilter::~CTemporalFrameFilter()
@@ -43,69 +185,144 @@ CTemporalFrameFilter::~CTemporalFrameFilter()
 	ClearData();
 }
 
-void CTemporalFrameFilter::Init(int sx, int sy, int frames)
+void CTemporalFrameFilter::Init(int sx, int sy, int frames, int sroiX, int sroiY, int sroiW, int sroiH)
 {
 	ClearData();
 	sizeX = sx;
 	sizeY = sy;
 	nFrames = frames;
-	imgDataBuffer = new unsigned char[sx * sy * frames];
+	// ROI clipped to the frame - the whole frame if it is empty
+	roiX = std::max(sroiX, 0);
+	roiY = std::max(sroiY, 0);
+	roiW = std::min(sroiX + sroiW, sx) - roiX;
+	roiH = std::min(sroiY + sroiH, sy) - roiY;
+	if (roiW <= 0 || roiH <= 0)
+	{
+		roiX = 0;
+		roiY = 0;
+		roiW = sx;
+		roiH = sy;
+	}
+	// The rings are allocated by the first frame as only one of them is used
 	medianImg = new unsigned char[sx * sy];
-	imgDataBufferCol = new unsigned char[sx * sy * 3 * frames];
+	memset(medianImg, 0, sx * sy);
 	validBuffer = false;
 	currentFrame = 0;
+	active = true;
+	ofLogVerbose("CTemporalFrameFilter") << "Init(): " << frames << " frames of " << roiW << "x" << roiH << " pixels";
 }
 
-void CTemporalFrameFilter::NewFrame(unsigned char* imgData, int sx, int sy, int nFrames)
+void CTemporalFrameFilter::Release()
 {
+	ClearData();
+	active = false;
+	ofLogVerbose("CTemporalFrameFilter") << "Release(): buffers freed";
+}
+
+bool CTemporalFrameFilter::isActive()
+{
+	return active;
+}
+
+void CTemporalFrameFilter::NewFrame(unsigned char* imgData, int sx, int sy)
+{
+	if (!active || sx != sizeX || sy != sizeY)
+		return;
 	if (!imgDataBuffer)
 	{
-		ofLogVerbose("CTemporalFrameFilter") << "NewFrame(): No buffer allocated: allocating";
-		Init(sx, sy, nFrames);
-	}
-	int offset = currentFrame * sizeX * sizeY;
-	for (int i = 0; i < sizeX *sizeY; i++)
-	{
-		unsigned char R = imgData[3*i];
-		unsigned char G = imgData[3 * i+1];
-		unsigned char B = imgData[3 * i+2];
-		double IV = (R + G + B) / 3;
-		imgDataBuffer[offset + i] = (unsigned char)IV;
+		imgDataBuffer = new unsigned char[roiW * roiH * nFrames];
+		imgSortedBuffer = new unsigned char[roiW * roiH * nFrames];
 	}
 
-	currentFrame++;
-	if (currentFrame >= nFrames)
+	// The samples of the new frame replace the oldest ones in the sorted windows
+	int count = validBuffer ? nFrames : currentFrame;
+	bool full = validBuffer || currentFrame + 1 == nFrames;
+	grayRow.resize(roiW);
+	for (int y = 0; y < roiH; y++)
 	{
-		validBuffer = true;
-		currentFrame = 0;
+		rgbGrayRow(imgData + 3 * ((roiY + y) * sizeX + roiX), grayRow.data(), roiW);
+		unsigned char* ring = imgDataBuffer + y * roiW * nFrames;
+		unsigned char* sorted = imgSortedBuffer + y * roiW * nFrames;
+		unsigned char* out = medianImg + (roiY + y) * sizeX + roiX;
+		for (int x = 0; x < roiW; x++, ring += nFrames, sorted += nFrames)
+		{
+			unsigned char val = grayRow[x];
+			int i = count;
+			if (validBuffer)
+			{
+				unsigned char old = ring[currentFrame];
+				i = 0;
+				while (sorted[i] != old)
+					i++;
+				while (i + 1 < count && sorted[i + 1] < val)
+				{
+					sorted[i] = sorted[i + 1];
+					i++;
+				}
+			}
+			while (i > 0 && sorted[i - 1] > val)
+			{
+				sorted[i] = sorted[i - 1];
+				i--;
+			}
+			sorted[i] = val;
+			ring[currentFrame] = val;
+			if (full)
+				out[x] = MedianOfSorted(sorted);
+		}
 	}
+
+	AdvanceFrame();
+}
+
+// Middle sample - average of the two middle samples for an even number of frames
+unsigned char CTemporalFrameFilter::MedianOfSorted(const unsigned char* sorted)
+{
+	int n = nFrames / 2;
+	if (nFrames % 2)
+		return sorted[n];
+	return (unsigned char)((sorted[n - 1] + sorted[n]) / 2);
 }
 
 
-void CTemporalFrameFilter::NewColFrame(unsigned char* imgData, int sx, int sy, int nFrames /*= 15*/)
+void CTemporalFrameFilter::NewColFrame(unsigned char* imgData, int sx, int sy)
 {
-	if (!imgDataBufferCol)
+	if (!active || sx != sizeX || sy != sizeY)
+		return;
+	if (!imgSumBuffer)
 	{
-		std::cerr << "CTemporalFrameFilter::NewFrame: No color buffer allocated: allocating" << std::endl;
-		Init(sx, sy, nFrames);
+		imgSumBuffer = new unsigned short[roiW * roiH * nFrames];
+		imgSumTotal = new unsigned int[roiW * roiH];
+		memset(imgSumTotal, 0, roiW * roiH * sizeof(unsigned int));
 	}
-	int offset = currentFrame * sizeX * sizeY * 3;
-	for (int i = 0; i < sizeX *sizeY; i++)
+
+	// The oldest frame of a full buffer is replaced in the running sum
+	unsigned short* frame = imgSumBuffer + currentFrame * roiW * roiH;
+	for (int y = 0; y < roiH; y++)
 	{
-		unsigned char R = imgData[3 * i];
-		unsigned char G = imgData[3 * i + 1];
-		unsigned char B = imgData[3 * i + 2];
-		imgDataBufferCol[offset + 3 * i + 0] = R;
-		imgDataBufferCol[offset + 3 * i + 1] = G;
-		imgDataBufferCol[offset + 3 * i + 2] = B;
+		unsigned short* sum = frame + y * roiW;
+		unsigned int* total = imgSumTotal + y * roiW;
+		if (validBuffer)
+		{
+			for (int x = 0; x < roiW; x++)
+				total[x] -= sum[x];
+		}
+		rgbSumRow(imgData + 3 * ((roiY + y) * sizeX + roiX), sum, roiW);
+		for (int x = 0; x < roiW; x++)
+			total[x] += sum[x];
 	}
+
+	AdvanceFrame();
+}
+
+void CTemporalFrameFilter::AdvanceFrame()
+{
 	currentFrame++;
 	if (currentFrame >= nFrames)
 	{
 		validBuffer = true;
 		currentFrame = 0;
 	}
-
 }
 
 int CTemporalFrameFilter::getBufferSize()
@@ -130,34 +347,28 @@ void CTemporalFrameFilter::ClearData()
 		delete[] medianImg;
 		medianImg = nullptr;
 	}
-	if (imgDataBufferCol)
+	if (imgSortedBuffer)
+	{
+		delete[] imgSortedBuffer;
+		imgSortedBuffer = nullptr;
+	}
+	if (imgSumBuffer)
+	{
+		delete[] imgSumBuffer;
+		imgSumBuffer = nullptr;
+	}
+	if (imgSumTotal)
 	{
-		delete[] imgDataBufferCol;
-		imgDataBufferCol = nullptr;
+		delete[] imgSumTotal;
+		imgSumTotal = nullptr;
 	}
 
+	std::vector<unsigned char>().swap(grayRow);
+
 	currentFrame = 0;
 	validBuffer = false;
 }
 
-// https://stackoverflow.com/questions/1719070/what-is-the-right-approach-when-using-stl-container-for-median-calculation
-template <typename T = double, typename C>
-inline const T median(const C &the_container)
-{
-	std::vector<T> tmp_array(std::begin(the_container),
-		std::end(the_container));
-	size_t n = tmp_array.size() / 2;
-	std::nth_element(tmp_array.begin(), tmp_array.begin() + n, tmp_array.end());
-
-	if (tmp_array.size() % 2) { return tmp_array[n]; }
-	else
-	{
-		// even sized vector -> average the two middle values
-		auto max_it = std::max_element(tmp_array.begin(), tmp_array.begin() + n);
-		return (*max_it + tmp_array[n]) / 2.0;
-	}
-}
-
 unsigned char* CTemporalFrameFilter::getMedianFilteredImage()
 {
 	if (!ComputeMedianImage())
@@ -175,64 +386,25 @@ unsigned char* CTemporalFrameFilter::getAverageFilteredColImage()
 
 }
 
+// The median of every pixel is updated with each frame once the buffer is full
 bool CTemporalFrameFilter::ComputeMedianImage()
 {
-	if (!validBuffer)
-		return false;
-
-	std::vector<unsigned char> tvals(nFrames);
-	
-	for (int y = 0; y < sizeY; y++)
-	{
-		for (int x = 0; x < sizeX; x++)
-		{
-			for (int f = 0; f < nFrames; f++)
-			{
-				int offset = f * sizeX * sizeY;
-				int idx = offset + y*sizeX + x;
-				tvals[f] = imgDataBuffer[idx];
-			}
-			unsigned char med = (unsigned char)median(tvals);
-			int idx2 = y*sizeX + x;	
-			medianImg[idx2] = med;
-		}
-	}
-
-	return true;
+	return validBuffer && imgDataBuffer;
 }
 
 bool CTemporalFrameFilter::ComputeAverageImageCol()
 {
-	if (!validBuffer && nFrames > 0)
+	if (!validBuffer || !imgSumBuffer)
 		return false;
 
-	for (int y = 0; y < sizeY; y++)
+	// Average of the R, G and B averages
+	unsigned int div = 3 * nFrames;
+	for (int y = 0; y < roiH; y++)
 	{
-		for (int x = 0; x < sizeX; x++)
-		{
-			double RSum = 0;
-			double GSum = 0;
-			double BSum = 0;
-			for (int f = 0; f < nFrames; f++)
-			{
-				int offset = f * sizeX * sizeY * 3;
-				int idx = offset + (y*sizeX + x) * 3;
-				unsigned char R = imgDataBufferCol[idx + 0];
-				unsigned char G = imgDataBufferCol[idx + 1];
-				unsigned char B = imgDataBufferCol[idx + 2];
-
-				RSum += R;				
-				GSum += G;				
-				BSum += B;
-			}
-			RSum /= nFrames;
-			GSum /= nFrames;
-			BSum /= nFrames;
-
-			unsigned char val = (unsigned char)((RSum + GSum + BSum) / 3.0);
-			int idx2 = y*sizeX + x;
-			medianImg[idx2] = val;
-		}
+		const unsigned int* total = imgSumTotal + y*roiW;
+		unsigned char* out = medianImg + (roiY + y)*sizeX + roiX;
+		for (int x = 0; x < roiW; x++)
+			out[x] = (unsigned char)(total[x] / div);
 	}
 
 	return true;
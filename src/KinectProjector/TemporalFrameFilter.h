@@ -22,9 +22,17 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 #ifndef _TemporalFrameFilter_h_
 #define _TemporalFrameFilter_h_
 
+#include <vector>
+
 //! Temporal frame filter for colour images
 /** Can do temporal average and temporal median filtering
-    Can be used for dealing with rolling shutter effects etc.*/
+    Can be used for dealing with rolling shutter effects etc.
+	The buffers only exist between Init() and Release(), during a calibration pass, and
+	only the ROI of the frames is stored. The filtered images are full frames that are
+	black outside the ROI.
+	The median is kept up to date with each frame: every pixel has a ring of its last
+	samples and the same samples sorted, where the new sample replaces the oldest one
+	with an insertion step.*/
 class CTemporalFrameFilter
 {
 	public:
@@ -32,11 +40,19 @@ class CTemporalFrameFilter
 
 		virtual ~CTemporalFrameFilter();
 
-		void Init(int sx, int sy, int frames);
+		// Start a pass on frames of sx x sy pixels of which the ROI [roiX, roiX+roiW[ x [roiY, roiY+roiH[ is kept
+		void Init(int sx, int sy, int frames, int roiX, int roiY, int roiW, int roiH);
+
+		// Free the buffers at the end of the pass - the next frames are ignored
+		void Release();
 
-		void NewFrame(unsigned char* imgData, int sx, int sy, int nFrames = 15);
+		bool isActive();
 
-		void NewColFrame(unsigned char* imgData, int sx, int sy, int nFrames = 50);
+		// Gray image of the frame for median filtering - ignored outside a pass
+		void NewFrame(unsigned char* imgData, int sx, int sy);
+
+		// Colour frame for average filtering - ignored outside a pass
+		void NewColFrame(unsigned char* imgData, int sx, int sy);
 
 		int getBufferSize();
 
@@ -46,29 +62,56 @@ class CTemporalFrameFilter
 
 		unsigned char* getAverageFilteredColImage();
 
+		static const int defaultMedianFrames = 15;
+
+		static const int defaultAverageFrames = 50;
+
 	private:
+		// Samples of the ROI pixels, the nFrames samples of a pixel are contiguous
 		unsigned char *imgDataBuffer;
 
+		// Same samples sorted for each pixel - the median is the middle one
+		unsigned char *imgSortedBuffer;
+
+		std::vector<unsigned char> grayRow;
+
 		unsigned char *medianImg;
 
-		unsigned char *imgDataBufferCol;
+		// R+G+B of the ROI pixels of each frame and their sum over the buffer
+		unsigned short *imgSumBuffer;
+
+		unsigned int *imgSumTotal;
 
 		int currentFrame;
 
 		bool validBuffer;
 
+		bool active;
+
 		void ClearData();
 		
 		bool ComputeMedianImage();
 
 		bool ComputeAverageImageCol();
 
+		void AdvanceFrame();
+
+		unsigned char MedianOfSorted(const unsigned char* sorted);
+
 		int sizeX;
 
 		int sizeY;
 
 		int nFrames;
 
+		int roiX;
+
+		int roiY;
+
+		int roiW;
+
+		int roiH;
+
 };
 
 #endif
@@ -0,0 +1,68 @@
+/***********************************************************************
+TripleBuffer - Wait-free single producer / single consumer handoff
+of the latest complete frame between two threads.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <atomic>
+
+//! Triple buffer between one producer thread and one consumer thread
+/** The producer fills getWriteBuffer() and calls publish(). The consumer calls update()
+    and reads getReadBuffer() if it returns true. Each side owns one buffer and the third one
+    is swapped atomically: neither side ever waits and the consumer always gets the latest
+    published buffer. Buffers are reused so their content is not reallocated between frames.*/
+template<class T>
+class TripleBuffer {
+public:
+	TripleBuffer()
+	:middle(1),
+	back(0),
+	front(2)
+	{
+	}
+
+	// Producer side
+	T& getWriteBuffer(){
+		return buffers[back];
+	}
+	void publish(){
+		back = middle.exchange(back | newBit, std::memory_order_acq_rel) & indexMask;
+	}
+
+	// Consumer side - returns true if a new buffer was published since the last call
+	bool update(){
+		if ((middle.load(std::memory_order_relaxed) & newBit) == 0)
+			return false;
+		front = middle.exchange(front, std::memory_order_acq_rel) & indexMask;
+		return true;
+	}
+	T& getReadBuffer(){
+		return buffers[front];
+	}
+
+private:
+	static const unsigned char indexMask = 3;
+	static const unsigned char newBit = 4;
+
+	T buffers[3];
+	std::atomic<unsigned char> middle; // Index of the shared buffer and flag telling if it holds a new frame
+	unsigned char back; // Owned by the producer
+	unsigned char front; // Owned by the consumer
+};
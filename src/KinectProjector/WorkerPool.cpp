@@ -0,0 +1,132 @@
+/***********************************************************************
+WorkerPool - Persistent threads running the stages of the depth filter
+on bands of rows in parallel.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#include "WorkerPool.h"
+#include "ofMain.h"
+
+WorkerPool::WorkerPool(int numThreads)
+:stopping(false),
+generation(0),
+task(nullptr),
+begin(0),
+end(0),
+bandSize(1),
+numBands(0),
+nextBand(0),
+remainingBands(0),
+busyWorkers(0)
+{
+	startWorkers(numThreads);
+}
+
+WorkerPool::~WorkerPool(){
+	stopWorkers();
+}
+
+void WorkerPool::setNumThreads(int numThreads){
+	stopWorkers();
+	startWorkers(numThreads);
+}
+
+void WorkerPool::startWorkers(int numThreads){
+	if (numThreads <= 0)
+		numThreads = std::max(1u, std::thread::hardware_concurrency());
+	stopping = false;
+	for (int i = 1; i < numThreads; i++) // The calling thread is the first worker
+		workers.push_back(std::thread(&WorkerPool::workerFunction, this));
+	ofLogVerbose("WorkerPool") << "startWorkers(): Filtering with " << numThreads << " threads";
+}
+
+void WorkerPool::stopWorkers(){
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	jobCondition.notify_all();
+	for (auto & worker : workers)
+		worker.join();
+	workers.clear();
+}
+
+void WorkerPool::parallelFor(int sbegin, int send, int sbandSize, const BandTask& stask){
+	int snumBands = getNumBands(sbegin, send, sbandSize);
+	if (snumBands == 0)
+		return;
+	if (workers.empty() || snumBands == 1)
+	{
+		for (int band = 0; band < snumBands; band++)
+			stask(sbegin + band*sbandSize, std::min(send, sbegin + (band + 1)*sbandSize), band);
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		// A worker woken late by the previous job may still be leaving runBands()
+		doneCondition.wait(guard, [this]{ return busyWorkers == 0; });
+		task = &stask;
+		begin = sbegin;
+		end = send;
+		bandSize = sbandSize;
+		numBands = snumBands;
+		nextBand = 0;
+		remainingBands = snumBands;
+		generation++;
+	}
+	jobCondition.notify_all();
+
+	runBands();
+
+	std::unique_lock<std::mutex> guard(lock);
+	doneCondition.wait(guard, [this]{ return remainingBands == 0 && busyWorkers == 0; });
+	task = nullptr;
+}
+
+void WorkerPool::runBands(){
+	int band;
+	while ((band = nextBand.fetch_add(1)) < numBands)
+	{
+		(*task)(begin + band*bandSize, std::min(end, begin + (band + 1)*bandSize), band);
+		if (remainingBands.fetch_sub(1) == 1)
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			doneCondition.notify_all();
+		}
+	}
+}
+
+void WorkerPool::workerFunction(){
+	std::unique_lock<std::mutex> guard(lock);
+	unsigned int lastGeneration = generation;
+	while (true)
+	{
+		jobCondition.wait(guard, [&]{ return stopping || generation != lastGeneration; });
+		if (stopping)
+			return;
+		lastGeneration = generation;
+		busyWorkers++;
+		guard.unlock();
+		runBands();
+		guard.lock();
+		busyWorkers--;
+		doneCondition.notify_all();
+	}
+}
@@ -0,0 +1,76 @@
+/***********************************************************************
+WorkerPool - Persistent threads running the stages of the depth filter
+on bands of rows in parallel.
+Copyright (c) 2016-2017 Thomas Wolf and Rasmus R. Paulsen (people.compute.dtu.dk/rapa)
+
+This file is part of the Magic Sand.
+
+The Magic Sand is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The Magic Sand is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with the Magic Sand; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+***********************************************************************/
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//! Pool of worker threads for data parallel loops
+/** parallelFor() cuts a range in bands of a fixed size and the workers and the calling
+    thread take the bands one by one until none is left. The bands only depend on the range
+    and the band size, not on the number of threads, so a task writing disjoint outputs and
+    reducing per band results in band order gives the same result on every host.
+    parallelFor() is meant to be called from a single thread (the grabber thread).*/
+class WorkerPool {
+public:
+	// task(begin, end, band) processes the elements [begin, end[ of band number band
+	typedef std::function<void(int begin, int end, int band)> BandTask;
+
+	WorkerPool(int numThreads = 0); // Number of threads including the caller - 0 for one per core
+	~WorkerPool();
+
+	void setNumThreads(int numThreads);
+	int getNumThreads(){
+		return workers.size() + 1;
+	}
+
+	static int getNumBands(int begin, int end, int bandSize){
+		return end > begin ? (end - begin + bandSize - 1) / bandSize : 0;
+	}
+
+	// Run task on all the bands of [begin, end[ and return once they are all processed
+	void parallelFor(int begin, int end, int bandSize, const BandTask& task);
+
+private:
+	void startWorkers(int numThreads);
+	void stopWorkers();
+	void workerFunction();
+	void runBands();
+
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable jobCondition; // Signals a new job or the end of the pool
+	std::condition_variable doneCondition; // Signals the end of the last band or of a worker
+	bool stopping;
+	unsigned int generation; // Incremented for each job
+
+	// Current job
+	const BandTask* task;
+	int begin, end, bandSize, numBands;
+	std::atomic<int> nextBand;
+	std::atomic<int> remainingBands;
+	int busyWorkers; // Workers inside runBands()
+};
@@ -29,6 +29,10 @@ using namespace ofxCSG;
 
 SandSurfaceRenderer::SandSurfaceRenderer(std::shared_ptr<KinectProjector> const& k, std::shared_ptr<ofAppBaseWindow> const& p)
 :settingsLoaded(false),
+contourLinesValid(false),
+contourLinesRevision(0),
+idle(false),
+sandboxRevision(0),
 editColorMap(false){
     kinectProjector = k;
     projWindow = p;
@@ -158,12 +162,14 @@ void SandSurfaceRenderer::updateConversionMatrices(){
     // Get conversion matrices
     transposedKinectProjMatrix = kinectProjector->getTransposedKinectProjMatrix();
     transposedKinectWorldMatrix = kinectProjector->getTransposedKinectWorldMatrix();
+    contourLinesValid = false;
 }
 
 void SandSurfaceRenderer::updateRangesAndBasePlane(){
     basePlaneEq = kinectProjector->getBasePlaneEq();
     basePlaneNormal = kinectProjector->getBasePlaneNormal();
     basePlaneOffset = kinectProjector->getBasePlaneOffset();
+    contourLinesValid = false;
 
     // Set the FilteredDepthImage native scale - converted to 0..1 when send to the shader
     kinectProjector->updateNativeScale(basePlaneOffset.z+elevationMax, basePlaneOffset.z+elevationMin);
@@ -179,6 +185,7 @@ void SandSurfaceRenderer::updateRangesAndBasePlane(){
 void SandSurfaceRenderer::setupMesh(){
     // Initialise mesh
     kinectROI = kinectProjector->getKinectROI();
+    contourLinesValid = false;
   //  ofVec2f kinectRes = kinectProjector->getKinectRes();
 	ofLogVerbose("SandSurfaceRenderer") << "setupMesh. KinectROI: " << kinectROI;
 
@@ -217,9 +224,20 @@ void SandSurfaceRenderer::update(){
         updateConversionMatrices();
     
     // Draw sandbox
-    if (drawContourLines)
+    // The contour lines only depend on the depth and the calibration: redraw them when one changed
+    if (drawContourLines && (!contourLinesValid || kinectProjector->getDepthRevision() != contourLinesRevision))
+    {
         prepareContourLinesFbo();
-    drawSandbox();
+        contourLinesRevision = kinectProjector->getDepthRevision();
+        contourLinesValid = true;
+    }
+    // While idle the projector keeps showing the cached fbo until the sand changes
+    if (!idle || kinectProjector->getDepthRevision() != sandboxRevision)
+    {
+        drawSandbox();
+        kinectProjector->getLatencyTracker().mark(LATENCY_STAGE_RENDER);
+        sandboxRevision = kinectProjector->getDepthRevision();
+    }
     
     // GUI
 	if (displayGui) {
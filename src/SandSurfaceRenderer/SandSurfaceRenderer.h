@@ -69,6 +69,9 @@ public:
     // Main loop function
     void setup(bool sdisplayGui);
     void update();
+    void setIdle(bool sidle){
+        idle = sidle;
+    }
     void drawMainWindow(float x, float y, float width, float height);
     void drawProjectorWindow();
     
@@ -141,6 +144,10 @@ private:
     // Contourlines
     float contourLineDistance, contourLineFactor;
     bool drawContourLines; // Flag if topographic contour lines are enabled
+    bool contourLinesValid; // Is the contour line fbo up to date with the calibration
+    uint64_t contourLinesRevision; // Revision of the depth texture drawn in the contour line fbo
+    bool idle; // Nobody uses the sandbox: only redraw it when the depth changes
+    uint64_t sandboxRevision;
     
     // GUI Main interface and Modal
     bool displayGui;
@@ -22,6 +22,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ofMain.h"
 #include "ofApp.h"
+#include "KinectProjector/LatencyBenchmark.h"
 
 const std::string MagicSandVersion = "1.5.4.2";
 
@@ -63,7 +64,17 @@ bool setWindowDimensions(ofGLFWWindowSettings& settings, int windowsNum) {
 }
 
 //========================================================================
-int main() {
+int main(int argc, char* argv[]) {
+	// Headless latency benchmark on a recorded session: --benchmark <recording> [results.csv]
+	if (argc >= 3 && std::string(argv[1]) == "--benchmark")
+	{
+		ofSetLogLevel(OF_LOG_NOTICE);
+		ofSetLogLevel("ofThread", OF_LOG_WARNING);
+		LatencyBenchmark benchmark;
+		std::string resultPath = argc >= 4 ? argv[3] : ofToDataPath("latency_benchmark.csv");
+		return benchmark.run(argv[2], resultPath) ? 0 : 1;
+	}
+
 	ofGLFWWindowSettings settings;
 	//setFirstWindowDimensions(settings);
 	//settings.width = 1200;
@@ -58,12 +58,25 @@ void ofApp::setup() {
 	boidGameController.setKinectRes(kinectRes);
 	boidGameController.setKinectROI(kinectROI);
 
+	appIdle = false;
+	lastInputTime = 0;
 }
 
 
 void ofApp::update() {
     // Call kinectProjector->update() first during the update function()
 	kinectProjector->update();
+
+	// Lower the frame rate while the sand is static and nobody plays or uses the gui
+	bool idle = kinectProjector->isIdle() && mapGameController.isIdle() && boidGameController.isIdle() &&
+		ofGetElapsedTimef() - lastInputTime > kinectProjector->getIdleDelay();
+	if (idle != appIdle)
+	{
+		appIdle = idle;
+		ofSetFrameRate(appIdle ? kinectProjector->getIdleFrameRate() : 60);
+		ofLogVerbose("ofApp") << "update(): Idle: " << appIdle;
+	}
+	sandSurfaceRenderer->setIdle(appIdle);
    	sandSurfaceRenderer->update();
     
     //if (kinectProjector->isROIUpdated())
@@ -104,10 +117,13 @@ void ofApp::drawProjWindow(ofEventArgs &args)
 		boidGameController.drawProjectorWindow();
 	}
 	kinectProjector->drawProjectorWindow();
+	// The buffers of the projector window are swapped right after this event
+	kinectProjector->getLatencyTracker().framePresented();
 }
 
 void ofApp::keyPressed(int key) 
 {
+	lastInputTime = ofGetElapsedTimef();
 	if (key == 'c')
 	{
 		kinectProjector->SaveKinectColorImage();
@@ -202,6 +218,10 @@ void ofApp::keyPressed(int key)
 		mapGameController.setDebug(kinectProjector->getDumpDebugFiles());
 		mapGameController.DebugTestMe();
 	}
+	else if (key == 'n')
+	{
+		kinectProjector->stepReplay();
+	}
 }
 
 void ofApp::keyReleased(int key) {
@@ -209,7 +229,7 @@ void ofApp::keyReleased(int key) {
 }
 
 void ofApp::mouseMoved(int x, int y) {
-
+	lastInputTime = ofGetElapsedTimef();
 }
 
 void ofApp::mouseDragged(int x, int y, int button) {
@@ -220,6 +240,7 @@ void ofApp::mouseDragged(int x, int y, int button) {
 
 void ofApp::mousePressed(int x, int y, int button) 
 {
+	lastInputTime = ofGetElapsedTimef();
 	if (mainWindowROI.inside((float)x, (float)y))
 	{
 		kinectProjector->mousePressed(x-mainWindowROI.x, y-mainWindowROI.y, button);
@@ -60,4 +60,8 @@ private:
 
 	// Main window ROI 
 	ofRectangle mainWindowROI;
+
+	// Idle mode
+	bool appIdle; // Running at the idle frame rate
+	float lastInputTime; // Time of the last mouse or key event
 };